@@ -6,6 +6,9 @@
 #include "common.hh"
 #include "ONEArchive.hh"
 #include "util/prs.hh"
+#include "util/ByteReader.hh"
+#include <string.h>
+#include <chrono>
 
 static const int ONE_HeroesMagic = 0x1400FFFF;
 static const int ONE_HeroesE3Magic = 0x1005FFFF;
@@ -15,14 +18,12 @@ static const int ONE_Shadow050Magic = 0x1C020020;
 
 ONEArchive::ONEArchive(FSPath& path) : f(path.read()), name(path.fileName()) {
 	if (f.size()) {
-		f.seek(4);
+		auto start = std::chrono::steady_clock::now();
+		ByteReader in(f.base_ptr(), f.size());
+		in.seek(4);
 
-		u32 filesize;
-		f.read(&filesize);
-		filesize += 0xc;
-
-		u32 magic;
-		f.read(&magic);
+		u32 filesize = in.read<u32>() + 0xc;
+		u32 magic = in.read<u32>();
 
 		switch (magic) {
 			case ONE_HeroesMagic: {
@@ -54,40 +55,45 @@ ONEArchive::ONEArchive(FSPath& path) : f(path.read()), name(path.fileName()) {
 		}
 
 		if (type == ArchiveType::Heroes || type == ArchiveType::HeroesE3 || type == ArchiveType::HeroesPreE3) {
-			f.seek(f.tell() + 4);
-
-			u32 filenames_len;
-			f.read(&filenames_len);
-
-			f.seek(f.tell() + 4);
+			in.skip(4);
+			u32 filenames_len = in.read<u32>();
+			in.skip(4);
 
 			std::vector<std::string> filenames;
-			u32 filenames_end = filenames_len + f.tell();
-			char name_buffer[64];
-
-			while (f.tell() < filenames_end) {
-				f.read(name_buffer, 64);
-				filenames.emplace_back(name_buffer);
+			size_t filenames_end = in.tell() + filenames_len;
+			if (filenames_end > in.size()) {
+				log_error("Invalid file name table in %s", path.str.c_str());
+				return;
 			}
-			f.seek(filenames_end);
+			while (in.tell() + 64 <= filenames_end) {
+				const char* entry_name = (const char*) in.ptr();
+				filenames.emplace_back(entry_name, strnlen(entry_name, 64));
+				in.skip(64);
+			}
+			in.seek(filenames_end);
 
-			while (f.tell() < filesize) {
-				struct {
-					u32 nameidx;
-					u32 size;
-					u32 unknown;
-				} header;
-				f.read(&header);
+			if (filesize > in.size()) filesize = (u32) in.size();
+			while (in.tell() + 12 <= filesize) {
+				u32 nameidx = in.readUnchecked<u32>();
+				u32 size = in.readUnchecked<u32>();
+				in.skip(4); // unknown
 
 				FileEntry entry;
-				entry.offset = (u32) f.tell();
-				entry.length = header.size;
-				entry.name = std::string(filenames[header.nameidx]);
+				entry.offset = (u32) in.tell();
+				entry.length = size;
+				if (nameidx >= filenames.size() || !in.has(size)) {
+					log_error("Invalid file entry in %s", path.str.c_str());
+					break;
+				}
+				entry.name = filenames[nameidx];
 				fileTable.push_back(entry);
 
-				f.seek(entry.offset + entry.length);
+				in.skip(entry.length);
 			}
 		}
+
+		log_info("Indexed %s (%d files) in %.1f ms", name.c_str(), (int) fileTable.size(),
+				 std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
 	}
 }
 
@@ -108,15 +114,10 @@ int ONEArchive::findFile(const char* _name) {
 }
 
 Buffer ONEArchive::readFile(int index) {
-	// read data
+	// decompress straight from the archive's data, entries were range checked when the file table was read
 	auto offs = fileTable[index].offset;
 	auto len = fileTable[index].length;
-	auto data = malloc(len);
-	f.seek(offs);
-	f.read(data, len);
-
-	Buffer b = prs_decode(data, len);
-	free(data);
+	Buffer b = prs_decode((const u8*) f.base_ptr() + offs, len);
 	b.seek(0);
 
 	return std::move(b);
@@ -0,0 +1,232 @@
+#include "RWChunkView.hh"
+#include "util/ByteReader.hh"
+
+static const u32 HEADER_SIZE = 12;
+
+// world format flags, geometries use the same bits
+static const u32 WORLD_TEXTURED = 0x04;
+static const u32 WORLD_PRELIT = 0x08;
+static const u32 WORLD_NORMALS = 0x10;
+static const u32 WORLD_TEXTURED2 = 0x80;
+static const u32 GEOMETRY_NATIVE = 0x01000000;
+
+static u32 uvSetCount(u32 format) {
+	u32 uvSets = (format >> 16) & 0xff;
+	if (!uvSets) uvSets = (format & WORLD_TEXTURED2) ? 2 : ((format & WORLD_TEXTURED) ? 1 : 0);
+	return uvSets;
+}
+
+bool RWChunkView::read(const u8* p, const u8* end, RWChunkView& out) {
+	if (p > end || (size_t) (end - p) < HEADER_SIZE) return false;
+	ByteReader in(p, HEADER_SIZE);
+	out.type = in.readUnchecked<u32>();
+	out.size = in.readUnchecked<u32>();
+	out.libraryID = in.readUnchecked<u32>();
+	out.header = p;
+	out.data = p + HEADER_SIZE;
+	return out.size <= (size_t) (end - out.data);
+}
+
+bool RWChunkView::child(int index, RWChunkView& out) const {
+	const u8* p = data;
+	const u8* end = data + size;
+	for (int i = 0; RWChunkView::read(p, end, out); i++) {
+		if (i == index) return true;
+		p = out.data + out.size;
+	}
+	return false;
+}
+
+bool RWChunkView::findChild(u32 childType, RWChunkView& out) const {
+	const u8* p = data;
+	const u8* end = data + size;
+	while (RWChunkView::read(p, end, out)) {
+		if (out.type == childType) return true;
+		p = out.data + out.size;
+	}
+	return false;
+}
+
+u32 RWChunkView::version() const {
+	if (!(libraryID & 0xffff0000)) return libraryID << 8; // written before 3.1
+	return (((libraryID >> 14) & 0x3ff00) + 0x30000) | ((libraryID >> 16) & 0x3f);
+}
+
+// arrays are used in place, so they must be aligned for their element type
+template<typename T>
+static bool takeSpan(ByteReader& in, u32 count, RWSpan<T>& out) {
+	size_t bytes = (size_t) count * sizeof(T);
+	if (!in.has(bytes) || ((uintptr_t) in.ptr() & 3)) return false;
+	out.data = (const T*) in.ptr();
+	out.count = count;
+	in.skip(bytes);
+	return true;
+}
+
+bool RWAtomicSectionView::parse(const RWChunkView& chunk, u32 worldFormat, Arena& scratch) {
+	RWChunkView header;
+	if (!chunk.child(0, header) || header.type != RWChunkView::STRUCT) return false;
+
+	ByteReader in(header.data, header.size);
+	if (!in.has(44)) return false;
+	in.skip(4); // material list window base
+	u32 triangleCount = in.readUnchecked<u32>();
+	u32 vertexCount = in.readUnchecked<u32>();
+	in.skip(24 + 8); // bounding box, unused
+
+	u32 uvSets = uvSetCount(worldFormat);
+	bool normals = (worldFormat & WORLD_NORMALS) != 0;
+	bool prelit = (worldFormat & WORLD_PRELIT) != 0;
+
+	// the struct holds exactly these arrays, if it doesn't the format flags were misread
+	u64 expected = 44 + (u64) vertexCount * (12 + (normals ? 4 : 0) + (prelit ? 4 : 0) + 8 * uvSets) +
+				   (u64) triangleCount * 8;
+	if (expected != header.size) return false;
+
+	if (!takeSpan(in, vertexCount, positions)) return false;
+	if (normals) in.skip((size_t) vertexCount * 4);
+	if (prelit && !takeSpan(in, vertexCount, colors)) return false;
+	if (uvSets && !takeSpan(in, vertexCount, uvs)) return false;
+
+	// bin meshes are in the section's extension
+	RWChunkView extension, binMesh;
+	if (!chunk.findChild(RWChunkView::EXTENSION, extension)) return false;
+	if (!extension.findChild(RWChunkView::BIN_MESH_PLG, binMesh)) return false;
+
+	ByteReader mesh(binMesh.data, binMesh.size);
+	if (!mesh.has(12)) return false;
+	mesh.skip(4); // flags, always triangle strips in stage files
+	u32 meshCount = mesh.readUnchecked<u32>();
+	mesh.skip(4); // total index count
+	// each mesh is at least a count and material, which bounds meshCount before allocating
+	if (!mesh.has((size_t) meshCount * 8)) return false;
+	RWBinMeshView* meshes = scratch.allocArray<RWBinMeshView>(meshCount);
+	for (u32 i = 0; i < meshCount; i++) {
+		if (!mesh.has(8)) return false;
+		RWBinMeshView& view = meshes[i];
+		u32 indexCount = mesh.readUnchecked<u32>();
+		view.material = mesh.readUnchecked<u32>();
+		if (!takeSpan(mesh, indexCount, view.indices)) return false;
+	}
+	binMeshes.data = meshes;
+	binMeshes.count = meshCount;
+	return true;
+}
+
+bool RWWorldView::parse(const RWChunkView& chunk) {
+	if (chunk.type != RWChunkView::WORLD || chunk.version() < 0x31000) return false;
+
+	RWChunkView header;
+	if (!chunk.child(0, header) || header.type != RWChunkView::STRUCT) return false;
+
+	// root is atomic (4), inverse origin (12), triangle, vertex, plane, atomic and collision sector counts (20)
+	ByteReader in(header.data, header.size);
+	in.seek(36);
+	format = in.read<u32>();
+	if (!in.ok()) return false;
+
+	if (!chunk.child(1, materialList) || materialList.type != RWChunkView::MATERIAL_LIST) return false;
+	if (!chunk.child(2, rootSection)) return false;
+	return rootSection.type == RWChunkView::ATOMIC_SECTION || rootSection.type == RWChunkView::PLANE_SECTION;
+}
+
+bool RWGeometryView::parse(const RWChunkView& chunk) {
+	if (chunk.type != RWChunkView::GEOMETRY) return false;
+
+	RWChunkView header;
+	if (!chunk.child(0, header) || header.type != RWChunkView::STRUCT) return false;
+
+	ByteReader in(header.data, header.size);
+	if (!in.has(16)) return false;
+	format = in.readUnchecked<u32>();
+	u32 triangleCount = in.readUnchecked<u32>();
+	u32 vertexCount = in.readUnchecked<u32>();
+	u32 morphTargetCount = in.readUnchecked<u32>();
+	if ((format & GEOMETRY_NATIVE) || !morphTargetCount) return false;
+	if (chunk.version() < 0x34000) in.skip(12); // surface properties, unused
+
+	u32 uvSets = uvSetCount(format);
+	positions = RWSpan<RWVertexPosition>();
+	colors = RWSpan<RWVertexColor>();
+	uvs = RWSpan<RWVertexUV>();
+	if ((format & WORLD_PRELIT) && !takeSpan(in, vertexCount, colors)) return false;
+	if (uvSets && !takeSpan(in, vertexCount, uvs)) return false;
+	if (uvSets > 1) in.skip((size_t) (uvSets - 1) * vertexCount * 8);
+	if (!takeSpan(in, triangleCount, triangles)) return false;
+
+	// only the first morph target is used, the others are skipped over
+	for (u32 i = 0; i < morphTargetCount; i++) {
+		if (!in.has(24)) return false;
+		in.skip(16); // bounding sphere
+		bool hasPositions = in.readUnchecked<u32>() != 0;
+		bool hasNormals = in.readUnchecked<u32>() != 0;
+		if (hasPositions) {
+			if (i == 0 && !takeSpan(in, vertexCount, positions)) return false;
+			if (i != 0) in.skip((size_t) vertexCount * 12);
+		}
+		if (hasNormals) in.skip((size_t) vertexCount * 12);
+	}
+	// the struct holds exactly these arrays, if it doesn't the format flags were misread
+	if (in.tell() != header.size || (vertexCount && positions.empty())) return false;
+
+	return chunk.child(1, materialList) && materialList.type == RWChunkView::MATERIAL_LIST;
+}
+
+bool RWClumpView::parse(const RWChunkView& chunk, Arena& scratch) {
+	if (chunk.type != RWChunkView::CLUMP || chunk.version() < 0x31000) return false;
+
+	RWChunkView header, frameList, frameHeader, geometryList, geometryHeader;
+	if (!chunk.child(0, header) || header.type != RWChunkView::STRUCT) return false;
+	ByteReader in(header.data, header.size);
+	u32 atomicCount = in.read<u32>();
+	if (!in.ok()) return false;
+
+	if (!chunk.child(1, frameList) || frameList.type != RWChunkView::FRAME_LIST) return false;
+	if (!frameList.child(0, frameHeader) || frameHeader.type != RWChunkView::STRUCT) return false;
+	ByteReader frameIn(frameHeader.data, frameHeader.size);
+	u32 frameCount = frameIn.read<u32>();
+	static_assert(sizeof(RWFrameView) == 56, "frames are used in place");
+	if (!frameIn.ok() || !takeSpan(frameIn, frameCount, frames)) return false;
+
+	if (!chunk.child(2, geometryList) || geometryList.type != RWChunkView::GEOMETRY_LIST) return false;
+	if (!geometryList.child(0, geometryHeader) || geometryHeader.type != RWChunkView::STRUCT) return false;
+	ByteReader geometryIn(geometryHeader.data, geometryHeader.size);
+	u32 geometryCount = geometryIn.read<u32>();
+	// every geometry and atomic is at least a chunk header, which bounds the counts before allocating
+	if (!geometryIn.ok() || geometryCount > geometryList.size / HEADER_SIZE || atomicCount > chunk.size / HEADER_SIZE)
+		return false;
+
+	RWGeometryView* geometryViews = scratch.allocArray<RWGeometryView>(geometryCount);
+	const u8* p = geometryHeader.data + geometryHeader.size;
+	const u8* end = geometryList.data + geometryList.size;
+	for (u32 i = 0; i < geometryCount; i++) {
+		RWChunkView geometry;
+		if (!RWChunkView::read(p, end, geometry) || !geometryViews[i].parse(geometry)) return false;
+		p = geometry.data + geometry.size;
+	}
+	geometries.data = geometryViews;
+	geometries.count = geometryCount;
+
+	// atomics follow the geometry list, lights and cameras may be mixed in after them
+	RWAtomicView* atomicViews = scratch.allocArray<RWAtomicView>(atomicCount);
+	p = geometryList.data + geometryList.size;
+	end = chunk.data + chunk.size;
+	u32 found = 0;
+	RWChunkView atomic;
+	while (found < atomicCount && RWChunkView::read(p, end, atomic)) {
+		p = atomic.data + atomic.size;
+		if (atomic.type != RWChunkView::ATOMIC) continue;
+
+		RWChunkView atomicHeader;
+		if (!atomic.child(0, atomicHeader) || atomicHeader.type != RWChunkView::STRUCT) return false;
+		ByteReader atomicIn(atomicHeader.data, atomicHeader.size);
+		RWAtomicView& view = atomicViews[found++];
+		view.frameIndex = atomicIn.read<u32>();
+		view.geometryIndex = atomicIn.read<u32>();
+		if (!atomicIn.ok() || view.frameIndex >= frameCount || view.geometryIndex >= geometryCount) return false;
+	}
+	if (found != atomicCount) return false;
+	atomics.data = atomicViews;
+	atomics.count = atomicCount;
+	return true;
+}
@@ -0,0 +1,148 @@
+// RWChunkView.hh: Walk RenderWare chunks in place, without building rwstreamlib's chunk tree
+// Geometry arrays are exposed as spans pointing into the buffer, which must outlive the views;
+// anything unexpected makes parsing fail, so callers can fall back to rw::readChunk
+
+#pragma once
+#include "common.hh"
+#include "util/Arena.hh"
+
+template<typename T>
+struct RWSpan {
+	const T* data = nullptr;
+	u32 count = 0;
+
+	const T& operator[](u32 i) const { return data[i]; }
+	bool empty() const { return !count; }
+	u32 size() const { return count; }
+	const T* begin() const { return data; }
+	const T* end() const { return data + count; }
+};
+
+struct RWChunkView {
+	enum Type : u32 {
+		STRUCT = 0x01,
+		EXTENSION = 0x03,
+		MATERIAL_LIST = 0x08,
+		ATOMIC_SECTION = 0x09,
+		PLANE_SECTION = 0x0a,
+		WORLD = 0x0b,
+		FRAME_LIST = 0x0e,
+		GEOMETRY = 0x0f,
+		CLUMP = 0x10,
+		ATOMIC = 0x14,
+		GEOMETRY_LIST = 0x1a,
+		BIN_MESH_PLG = 0x50e
+	};
+
+	u32 type = 0;
+	u32 size = 0;
+	u32 libraryID = 0;
+	const u8* header = nullptr; // start of the chunk, including its header
+	const u8* data = nullptr; // contents, size bytes
+
+	/// read chunk header at p, returns false if the chunk doesn't fit before end
+	static bool read(const u8* p, const u8* end, RWChunkView& out);
+
+	/// find first direct child of type, returns false if there is none
+	bool findChild(u32 childType, RWChunkView& out) const;
+	/// get index'th direct child, returns false if there are fewer children
+	bool child(int index, RWChunkView& out) const;
+
+	/// RenderWare version the chunk was written by, e.g. 0x35000 for 3.5.0.0
+	u32 version() const;
+};
+
+struct RWVertexPosition {
+	float x, y, z;
+};
+struct RWVertexColor {
+	u8 r, g, b, a;
+};
+struct RWVertexUV {
+	float u, v;
+};
+
+/// triangle as stored in a geometry, field names match rwstreamlib's
+struct RWTriangle {
+	u16 vertex2, vertex1, material, vertex3;
+};
+
+/// frame as stored in a frame list, field names match rwstreamlib's
+struct RWFrameView {
+	struct {
+		RWVertexPosition row1, row2, row3;
+	} rotation;
+	RWVertexPosition translation;
+	i32 parent;
+	u32 flags;
+};
+
+struct RWBinMeshView {
+	u32 material;
+	RWSpan<u32> indices;
+};
+
+/// an atomic section of a world, with its first uv set and bin meshes
+struct RWAtomicSectionView {
+	RWSpan<RWVertexPosition> positions;
+	RWSpan<RWVertexColor> colors; // empty if the world isn't prelit
+	RWSpan<RWVertexUV> uvs; // empty if the world isn't textured
+	RWSpan<RWBinMeshView> binMeshes; // allocated from the scratch arena passed to parse
+
+	bool parse(const RWChunkView& chunk, u32 worldFormat, Arena& scratch);
+};
+
+struct RWWorldView {
+	u32 format = 0;
+	RWChunkView materialList;
+	RWChunkView rootSection;
+
+	bool parse(const RWChunkView& chunk);
+
+	/// call fn for every atomic section below section, returns false if any section couldn't be parsed
+	/// section views are built in scratch, which must not be reset until this returns
+	template<typename F>
+	bool forEachAtomicSection(const RWChunkView& section, Arena& scratch, F fn) const;
+};
+
+/// a geometry's first morph target, with its first uv set and triangles
+struct RWGeometryView {
+	u32 format;
+	RWSpan<RWVertexPosition> positions;
+	RWSpan<RWVertexColor> colors; // empty if the geometry isn't prelit
+	RWSpan<RWVertexUV> uvs; // empty if the geometry isn't textured
+	RWSpan<RWTriangle> triangles;
+	RWChunkView materialList;
+
+	bool parse(const RWChunkView& chunk);
+};
+
+struct RWAtomicView {
+	u32 frameIndex;
+	u32 geometryIndex;
+};
+
+/// a clump of non-native geometry, other morph targets and plugin data are skipped
+struct RWClumpView {
+	RWSpan<RWFrameView> frames;
+	RWSpan<RWGeometryView> geometries; // allocated from the scratch arena passed to parse
+	RWSpan<RWAtomicView> atomics; // allocated from the scratch arena passed to parse
+
+	bool parse(const RWChunkView& chunk, Arena& scratch);
+};
+
+template<typename F>
+bool RWWorldView::forEachAtomicSection(const RWChunkView& section, Arena& scratch, F fn) const {
+	if (section.type == RWChunkView::ATOMIC_SECTION) {
+		RWAtomicSectionView atomic;
+		if (!atomic.parse(section, format, scratch)) return false;
+		fn(atomic);
+		return true;
+	}
+	if (section.type != RWChunkView::PLANE_SECTION) return false;
+
+	// plane section is a struct followed by the left and right sections
+	RWChunkView left, right;
+	if (!section.child(1, left) || !section.child(2, right)) return false;
+	return forEachAtomicSection(left, scratch, fn) && forEachAtomicSection(right, scratch, fn);
+}
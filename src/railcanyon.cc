@@ -13,6 +13,8 @@
 #include "render/DMAAnimation.hh"
 #include "util/config.hh"
 #include "render/DFFModel.hh"
+#include "render/GPUPicker.hh"
+#include "render/RenderUniforms.hh"
 #include "misc/Help.h"
 #include "misc/ImGuizmo.h"
 
@@ -165,6 +167,7 @@ static char dvdroot[512] = "D:\\Heroes\\dvdroot\0";
 static char dvdroot_out[512] = "";
 static float mouse_sensitivity;
 static float move_speed_scale;
+static bool gpu_picking;
 
 const char* getOutPath() {
 	return dvdroot_out[0] ? dvdroot_out : ".";
@@ -266,14 +269,8 @@ private:
 	ONEArchive* one;
 	bool useDMA = false;
 
-	bgfx::TextureHandle picking_rt;
-	bgfx::TextureHandle picking_rt_depth;
-	bgfx::TextureHandle blitted;
-	bgfx::FrameBufferHandle picking_fb;
-	u32 readback_frame = 0;
-	u32 current_frame = 0;
-	#define PICK_SIZE 64
-	u8 blit_data[PICK_SIZE * PICK_SIZE * 4];
+	GPUPicker* picker = nullptr;
+	u32 current_frame = 0; // last frame number returned by bgfx::frame
 
 	bool showTestWindow = false;
 	bool showPanel = true;
@@ -284,19 +281,11 @@ public:
 	RailCanyonApp() : camera(glm::vec3(0.f, 100.f, 350.f), glm::vec3(0,0,0), 60, 1.f, 960000.f) {}
 private:
 	void openTXD(const FSPath& path) {
-		FSPath txdPath(path);
-		Buffer sk_x = txdPath.read();
-		rw::Chunk* root = rw::readChunk(sk_x);
-		txd = new TexDictionary((rw::TextureDictionary*) root);
-		delete root;
+		txd = new TexDictionary(path);
 	}
 
 	void openCommonTXD(const FSPath& path) {
-		FSPath txdPath(path);
-		Buffer sk_x = txdPath.read();
-		rw::Chunk* root = rw::readChunk(sk_x);
-		txd_common = new TexDictionary((rw::TextureDictionary*) root);
-		delete root;
+		txd_common = new TexDictionary(path);
 	}
 
 	void openBSPWorld(FSPath& onePath, FSPath& blkPath) {
@@ -349,10 +338,7 @@ private:
 			delete stage;
 			stage = nullptr;
 		}
-		if (txd) {
-			delete txd;
-			txd = nullptr;
-		}
+		// textures are released by their users, so delete those first
 		if (txc) {
 			delete txc;
 			txc = nullptr;
@@ -361,6 +347,10 @@ private:
 			delete dff;
 			dff = nullptr;
 		}
+		if (txd) {
+			delete txd;
+			txd = nullptr;
+		}
 	}
 	void initialize( int _argc, char** _argv ) override {
 		// read config
@@ -371,6 +361,7 @@ private:
 
 		mouse_sensitivity = config_getf("mouse_sensitivity", 0.15f);
 		move_speed_scale = config_getf("move_speed_scale", 1.00f);
+		gpu_picking = config_geti("gpu_picking", 0) != 0;
 
 		// setup bgfx
 		bgfx::setDebug( BGFX_DEBUG_TEXT );
@@ -378,26 +369,19 @@ private:
 		reset(BGFX_RESET_VSYNC);
 
 		ddInit();
+		renderUniformsInit();
+
+		picker = new GPUPicker();
 
-		// setup picking framebuffer
-		auto tex_flags = BGFX_TEXTURE_MIN_POINT
-					   | BGFX_TEXTURE_MAG_POINT
-					   | BGFX_TEXTURE_MIP_POINT
-					   | BGFX_TEXTURE_U_CLAMP
-					   | BGFX_TEXTURE_V_CLAMP;
-
-		using bgfx::TextureFormat;
-		picking_rt = bgfx::createTexture2D(PICK_SIZE, PICK_SIZE, false, 1, TextureFormat::RGBA8, tex_flags | BGFX_TEXTURE_RT);
-		picking_rt_depth = bgfx::createTexture2D(PICK_SIZE, PICK_SIZE, false, 1, TextureFormat::D24S8, tex_flags | BGFX_TEXTURE_RT);
-		blitted = bgfx::createTexture2D(PICK_SIZE, PICK_SIZE, false, 1, TextureFormat::RGBA8,
-										tex_flags | BGFX_TEXTURE_BLIT_DST | BGFX_TEXTURE_READ_BACK);
-
-		bgfx::TextureHandle targets[] = {picking_rt, picking_rt_depth};
-		picking_fb = bgfx::createFrameBuffer(2, targets, true);
+		// sync frame counter with bgfx, so readback frame numbers can be compared against it
+		current_frame = bgfx::frame();
 	}
 
 	int shutdown() override {
 		closeStage();
+		delete picker;
+		picker = nullptr;
+		renderUniformsShutdown();
 		ddShutdown();
 		return 0;
 	}
@@ -633,17 +617,12 @@ private:
 			screenshotNextFrame = 1;
 		}
 
-		union BiggImTexture { ImTextureID ptr; struct { uint16_t flags; bgfx::TextureHandle handle; } s; };
-		BiggImTexture img;
-		img.s.flags = 0; // unused
-		img.s.handle = picking_rt;
-		ImGui::Image(img.ptr, ImVec2(128, 128));
-		img.s.handle = blitted;
-		ImGui::Image(img.ptr, ImVec2(128, 128));
-		if (ImGui::Button("ReadBack")) {
-			bgfx::readTexture(blitted, &blit_data);
-			bgfx::frame();
-			bgfx::frame();
+		if (ImGui::Checkbox("gpu picking", &gpu_picking)) {
+			config_seti("gpu_picking", gpu_picking);
+		}
+
+		if (gpu_picking) {
+			picker->drawUI();
 		}
 	}
 
@@ -844,11 +823,13 @@ private:
 						ImGui::TextColored(ImVec4(1.0f, 0.25f, 0.0f, 1.0f), "No stage is loaded");
 					}
 				} break;
-				/*
-				case 6: { 
-					// DFF Cache
-				} break; 
-				*/
+				case 6: {
+					if (stage) {
+						stage->drawCacheUI();
+					} else {
+						ImGui::TextColored(ImVec4(1.0f, 0.25f, 0.0f, 1.0f), "No stage is loaded");
+					}
+				} break;
 				case 7: {
 					help->drawUI();
 				} break;
@@ -865,6 +846,9 @@ private:
 			ImGui::ShowTestWindow(&showTestWindow);
 		}
 
+		// purge and stream textures to fit the vram budget
+		TexDictionary::updateAll();
+
 		if (txc) {
 			txc->setTime(mTime);
 		}
@@ -899,49 +883,36 @@ private:
 			}
 		}
 
-		// calculate picking view
 		double mouseX;
 		double mouseY;
 		glfwGetCursorPos(this->mWindow, &mouseX, &mouseY);
 
-		// below copied directly from https://github.com/bkaradzic/bgfx/blob/master/examples/30-picking/picking.cpp
-		// Set up picking pass
-		glm::mat4 view = camera.getViewMatrix();
-		glm::mat4 proj = camera.getPerspMatrix();
-		float viewProj[16];
-		bx::mtxMul(viewProj, &view[0][0], &proj[0][0]);
-
-		float invViewProj[16];
-		bx::mtxInverse(invViewProj, viewProj);
-
 		// Mouse coord in NDC
 		float mouseXNDC = ( mouseX             / (float)getWidth() ) * 2.0f - 1.0f;
 		float mouseYNDC = ((getHeight() - mouseY) / (float)getHeight()) * 2.0f - 1.0f;
 
-		float pickEye[3];
-		float mousePosNDC[3] = { mouseXNDC, mouseYNDC, 0.0f };
-		bx::vec3MulMtxH(pickEye, mousePosNDC, invViewProj);
-
-		float pickAt[3];
-		float mousePosNDCEnd[3] = { mouseXNDC, mouseYNDC, 0.1f };
-		bx::vec3MulMtxH(pickAt, mousePosNDCEnd, invViewProj);
-
-		// Look at our unprojected point
-		float pickView[16];
-		bx::mtxLookAt(pickView, pickEye, pickAt);
-
-		// Tight FOV is best for picking
-		float pickProj[16];
-		bx::mtxProj(pickProj, 2, 1, 0.1f, 10000.0f, bgfx::getCaps()->homogeneousDepth);
-
-		// View rect and transforms for picking pass
-		bgfx::setViewFrameBuffer(1, picking_fb);
-		bgfx::setViewRect(1, 0, 0, PICK_SIZE, PICK_SIZE);
-		bgfx::setViewTransform(1, pickView, pickProj);
-
+		// picking: cast ray through cursor on click, or queue a gpu pick
+		static bool pickPress = false; // used to get left click as press
+		bool clicked = glfwGetMouseButton(this->mWindow, GLFW_MOUSE_BUTTON_LEFT) && !ImGui::GetIO().WantCaptureMouse;
+		if (clicked && !pickPress && stage) {
+			if (gpu_picking) {
+				picker->request(vec2(mouseXNDC, mouseYNDC), [this](int list, int idx) {
+					if (!list) return;
+					log_debug("selected %d:%d", list, idx);
+					setSelectedObject(list, idx);
+				});
+			} else {
+				int list, idx;
+				if (stage->pick(camera.screenRay(vec2(mouseXNDC, mouseYNDC)), campos, list, idx)) {
+					log_debug("selected %d:%d", list, idx);
+					setSelectedObject(list, idx);
+				}
+			}
+		}
+		pickPress = clicked;
 
 		if (stage) {
-			stage->draw(campos, txc, true);
+			stage->draw(campos, txc);
 		}
 
 		if (dff) {
@@ -955,38 +926,13 @@ private:
 			screenshotNextFrame = 0;
 		}
 
-		// perform selection from readback result
-		if (readback_frame && readback_frame == current_frame) {
-			readback_frame = 0;
-
-			log_info("READBACK ACHIEVED");
-			log_debug("pixel[0][0] = #%02x%02x%02x%02x", blit_data[0], blit_data[1], blit_data[2], blit_data[3]);
-
-			u16 idx = blit_data[0] | (blit_data[1] << 8);
-			u8 list = blit_data[2];
-
-			log_debug("selected %d:%d", list, idx);
-			setSelectedObject(list, idx);
-		}
-
-		// perform readback for selection
-		if (!readback_frame &&
-				glfwGetMouseButton(this->mWindow, GLFW_MOUSE_BUTTON_LEFT) &&
-				!ImGui::GetIO().WantCaptureMouse && txd) {
-			if ((bgfx::getCaps()->supported & BGFX_CAPS_TEXTURE_BLIT) &&
-				(bgfx::getCaps()->supported & BGFX_CAPS_TEXTURE_READ_BACK)) {
-				bgfx::blit(2, blitted, 0, 0, picking_rt);
-				bgfx::readTexture(blitted, blit_data);
-				bgfx::frame();
-				bgfx::frame();
-				readback_frame = current_frame + 1;
-			} else {
-				bgfx::readTexture(picking_rt, blit_data);
-				bgfx::frame();
-				bgfx::frame();
-				readback_frame = current_frame + 1;
-			}
+		// gpu picking only renders a pass when a pick has been requested, and completes a couple frames later
+		Ray pickRay;
+		if (picker->beginPass(camera, pickRay)) {
+			if (stage) stage->drawPicking(pickRay, campos);
+			picker->endPass();
 		}
+		picker->update(current_frame);
 
 		current_frame++;
 	}
@@ -1,11 +1,8 @@
 #include "common.hh"
 #include "BSPModel.hh"
+#include "util/vertexpack.hh"
 #include <bigg.hpp>
 
-bgfx::ProgramHandle bspProgram;
-bgfx::UniformHandle uSamplerTexture;
-bgfx::UniformHandle uMaterialColor;
-bgfx::UniformHandle uMaterialBits;
 static bool bspStaticValuesLoaded = false;
 
 struct BSPVertex
@@ -87,57 +84,63 @@ BSPModel::~BSPModel() {
 	}
 }
 
+// build a section's vertex buffer, from either rwstreamlib's arrays or spans over the file
+template<typename Positions, typename Colors, typename UVs>
+void BSPModel::addSection(u32 vertexCount, const Positions& positions, const Colors& colors, const UVs& uvs,
+						  bool hasColors, bool hasUVs) {
+	static_assert(sizeof(positions[0]) == 12 && sizeof(colors[0]) == 4 && sizeof(uvs[0]) == 8,
+				  "vertex arrays must be tightly packed to be interleaved");
+	static_assert(sizeof(BSPVertex) == PACKED_VERTEX_SIZE, "BSPVertex must match packVertices layout");
+	sections.emplace_back();
+	auto& section = sections.back();
+	BSPVertex* meshVertices = new BSPVertex[vertexCount];
+
+	if (vertexCount) {
+		packVertices(meshVertices, vertexCount, &positions[0].x, hasColors ? &colors[0].r : nullptr,
+					 hasUVs ? &uvs[0].u : nullptr);
+	}
+
+	section.vertices = bgfx::createVertexBuffer(
+			bgfx::makeRef(meshVertices,
+						  sizeof(BSPVertex) * vertexCount,
+						  [](void* p, void* _) {delete[] (BSPVertex*) p;}),
+			BSPVertex::ms_decl
+	);
+}
+
+template<typename Indices>
+void BSPModel::addBinMesh(u32 vertexCount, u32 indexCount, const Indices& indices, int material) {
+	auto& section = sections.back();
+	uint16_t* meshTriStrip = new uint16_t[indexCount];
+
+	if (indexCount) {
+		u32 invalid = narrowIndices(meshTriStrip, &indices[0], indexCount, vertexCount);
+		if (invalid) log_warn("%u invalid indices in %s (vertex count %u)", invalid, name.c_str(), vertexCount);
+	}
+
+	section.binMeshes.emplace_back();
+	auto& binMesh = section.binMeshes.back();
+	binMesh.indices = bgfx::createIndexBuffer(
+			bgfx::makeRef(meshTriStrip,
+						  sizeof(uint16_t) * indexCount,
+						  [](void* p, void* _) {delete[] (uint16_t*) p;})
+	);
+	binMesh.material = material;
+}
+
 void BSPModel::setFromSection(rw::AbstractSectionChunk* sectionChunk) {
 	if (sectionChunk->isAtomic()) {
 		auto atomicSection = (rw::AtomicSectionChunk*) sectionChunk;
 
 		const auto vertexCount = atomicSection->vertexCount;
-		const auto& vertexPositions = atomicSection->vertexPositions;
-		const auto& vertexColors = atomicSection->vertexColors;
-		const auto& vertexUVs = atomicSection->vertexUVs;
-
-		sections.emplace_back();
-		auto& section = sections.back();
-		BSPVertex* meshVertices = new BSPVertex[vertexCount];
-
-		for (int i = 0; i < vertexCount; i++) {
-			const auto& vertex = vertexPositions[i];
-			const auto& color = vertexColors[i];
-			const auto& uv = vertexUVs[i];
-			meshVertices[i] = {
-					vertex.x, vertex.y, vertex.z,
-					uint32_t((color.a << 24) | (color.b << 16) | (color.g << 8) | color.r),
-					uv.u, uv.v};
-		}
-
-		section.vertices = bgfx::createVertexBuffer(
-				bgfx::makeRef(meshVertices,
-							  sizeof(BSPVertex) * vertexCount,
-							  [](void* p, void* _) {delete[] (BSPVertex*) p;}),
-				BSPVertex::ms_decl
-		);
+		addSection(vertexCount, atomicSection->vertexPositions, atomicSection->vertexColors,
+				   atomicSection->vertexUVs, !atomicSection->vertexColors.empty(), !atomicSection->vertexUVs.empty());
 
 		const auto objectCount = atomicSection->binMeshPLG->objectCount;
 		log_debug("objectCount: %d", objectCount);
 		for (int bmIdx = 0; bmIdx < objectCount; bmIdx++) {
-			const auto indexCount = atomicSection->binMeshPLG->objects[bmIdx].meshIndexCount;
-			const auto& indices = atomicSection->binMeshPLG->objects[bmIdx].indices;
-			uint16_t* meshTriStrip = new uint16_t[indexCount];
-
-			for (int i = 0; i < indexCount; i++) {
-				if (indices[i] > vertexCount) log_warn("invalid index %08x", indices[i]);
-				meshTriStrip[i] = (uint16_t) indices[i];
-			}
-
-			section.binMeshes.emplace_back();
-
-			section.binMeshes[bmIdx].indices = bgfx::createIndexBuffer(
-					bgfx::makeRef(meshTriStrip,
-								  sizeof(uint16_t) * indexCount,
-								  [](void* p, void* _) {delete[] (uint16_t*) p;})
-			);
-
-			section.binMeshes[bmIdx].material = atomicSection->binMeshPLG->objects[bmIdx].material;
+			const auto& object = atomicSection->binMeshPLG->objects[bmIdx];
+			addBinMesh(vertexCount, object.meshIndexCount, object.indices, object.material);
 		}
 	} else {
 		auto planeSection = (rw::PlaneSectionChunk*) sectionChunk;
@@ -147,27 +150,63 @@ void BSPModel::setFromSection(rw::AbstractSectionChunk* sectionChunk) {
 	}
 }
 
-void BSPModel::setFromWorldChunk(const char* name, const rw::WorldChunk& worldChunk, TexDictionary* txd) {
-	clear();
-
+void BSPModel::setName(const char* name) {
 	this->name = name;
+	renderBits = 0; // parseName toggles bits, so it mustn't build on an earlier attempt
 	parseName(name);
 
 	if (!bspStaticValuesLoaded) {
-		bspProgram = bigg::loadProgram("shaders/glsl/vs_bspmesh.bin", "shaders/glsl/fs_bspmesh.bin");
 		BSPVertex::init();
-		uSamplerTexture = bgfx::createUniform("s_texture", bgfx::UniformType::Int1);
-		uMaterialColor = bgfx::createUniform("u_materialColor", bgfx::UniformType::Vec4);
-		uMaterialBits = bgfx::createUniform("u_materialBits", bgfx::UniformType::Int1);
 		bspStaticValuesLoaded = true;
 	}
+}
+
+void BSPModel::setFromWorldChunk(const char* name, const rw::WorldChunk& worldChunk, TexDictionary* txd) {
+	clear();
+	setName(name);
 
 	setFromSection(worldChunk.rootSection);
 
 	// set materials
-	matList = new MaterialList(worldChunk.materialList, txd);
+	matList = new MaterialList(worldChunk.materialList, txd, MESH_BSP);
+
+	hasData = true;
+}
+
+bool BSPModel::setFromWorldView(const char* name, const RWChunkView& worldChunk, TexDictionary* txd, Arena& scratch) {
+	RWWorldView world;
+	if (!world.parse(worldChunk)) return false;
+
+	clear();
+	setName(name);
+
+	bool parsed = world.forEachAtomicSection(world.rootSection, scratch, [this](const RWAtomicSectionView& atomic) {
+		u32 vertexCount = atomic.positions.size();
+		addSection(vertexCount, atomic.positions, atomic.colors, atomic.uvs, !atomic.colors.empty(), !atomic.uvs.empty());
+		for (auto& binMesh : atomic.binMeshes) {
+			addBinMesh(vertexCount, binMesh.indices.size(), binMesh.indices, binMesh.material);
+		}
+	});
+	if (!parsed) {
+		hasData = true; // so clear() frees the sections made before the failure
+		clear();
+		return false;
+	}
+
+	// the material list is small, so it still goes through rwstreamlib
+	sk::Buffer matListData((void*) world.materialList.header, world.materialList.size + 12, false);
+	rw::Chunk* matListChunk = rw::readChunk(matListData);
+	if (!matListChunk || matListChunk->type != RWChunkView::MATERIAL_LIST) {
+		delete matListChunk;
+		hasData = true;
+		clear();
+		return false;
+	}
+	matList = new MaterialList((rw::MaterialListChunk*) matListChunk, txd, MESH_BSP);
+	delete matListChunk;
 
 	hasData = true;
+	return true;
 }
 
 void BSPModel::draw(TXCAnimation* txc) {
@@ -179,10 +218,10 @@ void BSPModel::draw(TXCAnimation* txc) {
 				bgfx::setIndexBuffer(mesh.indices);
 
 				// set material & state
-				matList->bind(mesh.material, txc, renderBits, true);
+				auto program = matList->bind(mesh.material, txc, renderBits, true);
 
 				// draw
-				bgfx::submit(0, bspProgram);
+				bgfx::submit(0, program);
 			}
 		}
 	}
@@ -8,6 +8,7 @@
 #include "render/TexDictionary.hh"
 #include "render/TXCAnimation.hh"
 #include "render/MaterialList.hh"
+#include "io/RWChunkView.hh"
 
 class VisibilityManager;
 
@@ -33,12 +34,21 @@ private:
 	std::string name;
 	void clear();
 	void parseName(const char* name);
+	void setName(const char* name);
+	template<typename Positions, typename Colors, typename UVs>
+	void addSection(u32 vertexCount, const Positions& positions, const Colors& colors, const UVs& uvs,
+					bool hasColors, bool hasUVs);
+	template<typename Indices>
+	void addBinMesh(u32 vertexCount, u32 indexCount, const Indices& indices, int material);
 	void setFromSection(rw::AbstractSectionChunk* sectionChunk);
 public:
 	bool selected = false;
 	~BSPModel();
 
 	void setFromWorldChunk(const char* name, const rw::WorldChunk& worldChunk, TexDictionary* txd);
+	/// read geometry straight from a world chunk in memory, returns false if it has to go through setFromWorldChunk
+	/// scratch holds the section views while reading, it can be reset once this returns
+	bool setFromWorldView(const char* name, const RWChunkView& worldChunk, TexDictionary* txd, Arena& scratch);
 
 	void draw(TXCAnimation* txc);
 	int getId();
@@ -103,6 +103,17 @@ vec3 Camera::getDirection() {
 	return dir;
 }
 
+Ray Camera::screenRay(vec2 ndc) {
+	mat4 invViewProj = glm::inverse(getPerspMatrix() * getViewMatrix());
+	vec4 nearPoint = invViewProj * vec4(ndc.x, ndc.y, 0.0f, 1.0f);
+	vec4 farPoint = invViewProj * vec4(ndc.x, ndc.y, 1.0f, 1.0f);
+
+	Ray ray;
+	ray.origin = pos;
+	ray.dir = glm::normalize(vec3(farPoint / farPoint.w) - vec3(nearPoint / nearPoint.w));
+	return ray;
+}
+
 void Camera::use(int view, float aspect) {
 	if (this->aspect != aspect) {
 		this->aspect = aspect;
@@ -2,6 +2,7 @@
 
 #pragma once
 #include <bigg.hpp>
+#include "util/BVH.hh"
 
 using glm::vec2;
 using glm::vec3;
@@ -37,5 +38,8 @@ public:
 
 	vec3 getPosition();
 	vec3 getDirection();
+
+	// get world space ray through a point in normalized device coordinates
+	Ray screenRay(vec2 ndc);
 };
 
@@ -1,10 +1,11 @@
 #include "common.hh"
 #include "DFFModel.hh"
+#include "util/vertexpack.hh"
 #include <bigg.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/euler_angles.hpp>
+#include <float.h>
 
-static bgfx::ProgramHandle dffProgram;
 static bool dffStaticValuesLoaded = false;
 
 
@@ -30,6 +31,10 @@ struct DFFVertex
 bgfx::VertexDecl DFFVertex::ms_decl;
 
 DFFModel::~DFFModel() {
+	clear();
+}
+
+void DFFModel::clear() {
 	for (auto& atomic : atomics) {
 		delete atomic.matList;
 		bgfx::destroy(atomic.vertices);
@@ -37,12 +42,13 @@ DFFModel::~DFFModel() {
 			bgfx::destroy(submesh.indices);
 		}
 	}
+	atomics.clear();
+	memoryUsage = 0;
 }
 
 static void static_initialize() {
 	if (!dffStaticValuesLoaded) {
 		DFFVertex::init();
-		dffProgram = bigg::loadProgram( "shaders/glsl/vs_dffmesh.bin", "shaders/glsl/fs_dffmesh.bin" );
 		dffStaticValuesLoaded = true;
 	}
 }
@@ -86,7 +92,84 @@ static void permute_vertex(rw::ClumpChunk* clump, int dmtarget, int vtxid, rw::g
 	}
 }
 
-void DFFModel::setFromClump(rw::ClumpChunk* clump, TexDictionary* txd, int dmtarget) {
+template<typename Faces, typename Frame>
+void DFFModel::addAtomic(Atomic& atomic, const u8* colors, const float* uvs, u32 triangleCount, const Faces& faces,
+						 const Frame& frame, Arena& scratch) {
+	u32 vertexCount = atomic.positions.size();
+	atomic.boundsLow = glm::vec3(FLT_MAX);
+	atomic.boundsHigh = glm::vec3(-FLT_MAX);
+	for (auto& position : atomic.positions) {
+		atomic.boundsLow = glm::min(atomic.boundsLow, position);
+		atomic.boundsHigh = glm::max(atomic.boundsHigh, position);
+	}
+
+	static_assert(sizeof(DFFVertex) == PACKED_VERTEX_SIZE, "DFFVertex must match packVertices layout");
+	DFFVertex* meshVertices = new DFFVertex[vertexCount];
+	if (vertexCount) packVertices(meshVertices, vertexCount, &atomic.positions[0].x, colors, uvs);
+
+	atomic.vertices = bgfx::createVertexBuffer(
+			bgfx::makeRef(meshVertices,
+						  sizeof(DFFVertex) * vertexCount,
+						  [](void* p, void* _) {delete[] (DFFVertex*) p;}),
+			DFFVertex::ms_decl
+	);
+	memoryUsage += sizeof(DFFVertex) * vertexCount;
+
+	// count faces per material, then write each straight into its index buffer's memory
+	auto subMeshCount = atomic.subMeshes.size();
+	u32* faceCounts = scratch.allocArray<u32>(subMeshCount);
+	u16** faceCursors = scratch.allocArray<u16*>(subMeshCount);
+	const bgfx::Memory** indexMemory = scratch.allocArray<const bgfx::Memory*>(subMeshCount);
+	memset(faceCounts, 0, sizeof(u32) * subMeshCount);
+	for (u32 i = 0; i < triangleCount; i++) {
+		if (faces[i].material < subMeshCount) faceCounts[faces[i].material]++;
+	}
+	for (size_t i = 0; i < subMeshCount; i++) {
+		indexMemory[i] = bgfx::alloc(sizeof(uint16_t) * faceCounts[i] * 3);
+		faceCursors[i] = (u16*) indexMemory[i]->data;
+	}
+
+	atomic.triangles.resize(triangleCount * 3);
+	for (u32 i = 0; i < triangleCount; i++) {
+		const auto& face = faces[i];
+		atomic.triangles[i * 3] = face.vertex1;
+		atomic.triangles[i * 3 + 1] = face.vertex2;
+		atomic.triangles[i * 3 + 2] = face.vertex3;
+		if (face.material >= subMeshCount) continue;
+		u16*& out = faceCursors[face.material];
+		out[0] = face.vertex1;
+		out[1] = face.vertex2;
+		out[2] = face.vertex3;
+		out += 3;
+	}
+
+	for (size_t i = 0; i < subMeshCount; i++) {
+		atomic.subMeshes[i].indices = bgfx::createIndexBuffer(indexMemory[i]);
+		memoryUsage += indexMemory[i]->size;
+	}
+
+	atomic.transform = glm::translate(atomic.transform, glm::vec3(frame.translation.x, frame.translation.y, frame.translation.z));
+	atomic.transform[0][0] = frame.rotation.row1.x;
+	atomic.transform[0][1] = frame.rotation.row1.y;
+	atomic.transform[0][2] = frame.rotation.row1.z;
+	atomic.transform[1][0] = frame.rotation.row2.x;
+	atomic.transform[1][1] = frame.rotation.row2.y;
+	atomic.transform[1][2] = frame.rotation.row2.z;
+	atomic.transform[2][0] = frame.rotation.row3.x;
+	atomic.transform[2][1] = frame.rotation.row3.y;
+	atomic.transform[2][2] = frame.rotation.row3.z;
+
+	memoryUsage += atomic.positions.size() * sizeof(glm::vec3) + atomic.triangles.size() * sizeof(u16);
+
+	if (vertexCount) {
+		glm::vec3 low, high;
+		transformAabb(atomic.transform, atomic.boundsLow, atomic.boundsHigh, low, high);
+		boundsLow = glm::min(boundsLow, low);
+		boundsHigh = glm::max(boundsHigh, high);
+	}
+}
+
+void DFFModel::setFromClump(rw::ClumpChunk* clump, TexDictionary* txd, int dmtarget, Arena* scratch) {
 	std::vector<float> weights;
 
 	for (int i = 0; i < dmtarget; i++) {
@@ -97,101 +180,128 @@ void DFFModel::setFromClump(rw::ClumpChunk* clump, TexDictionary* txd, int dmtar
 		}
 	}
 
-	setFromClump(clump, txd, &weights);
+	setFromClump(clump, txd, &weights, scratch);
 }
 
-void DFFModel::setFromClump(rw::ClumpChunk* clump, TexDictionary* txd, std::vector<float>* dmweights) {
+void DFFModel::setFromClump(rw::ClumpChunk* clump, TexDictionary* txd, std::vector<float>* dmweights, Arena* scratchArena) {
 	static_initialize();
 
+	// callers loading many models pass their own arena so its blocks are reused between them
+	Arena localArena(4 << 10);
+	Arena& scratch = scratchArena ? *scratchArena : localArena;
+
+	boundsLow = glm::vec3(FLT_MAX);
+	boundsHigh = glm::vec3(-FLT_MAX);
+
 	for (auto atomicChunk : clump->atomics) {
 		auto geometry = clump->geometryList->geometries[atomicChunk->geometryIndex];
 		atomics.emplace_back();
 		auto& atomic = atomics.back();
 
-		auto target0 = geometry->morphTargets[0];
+		const auto& target0 = geometry->morphTargets[0];
 
 		atomic.subMeshes.resize(geometry->materialList->materials.size());
 		for (int i = 0; i < atomic.subMeshes.size(); i++) {
 			atomic.subMeshes[i].material = i;
 		}
 
-		DFFVertex* meshVertices = new DFFVertex[geometry->vertexCount];
-
-		for (int i = 0; i < geometry->vertexCount; i++) {
-			rw::geom::VertexPosition vertex = target0.vertexPositions[i];
-
-			rw::geom::VertexColor color;
-			if (geometry->vertexColors.size()) color = geometry->vertexColors[i];
-			else color.as_int = 0xffffffff;
-
-			rw::geom::VertexUVs uvs;
-			if (geometry->vertexUVLayers.size()) {
-				uvs = geometry->vertexUVLayers[0][i];
-			} else {
-				uvs.u = 0; uvs.v = 0;
-			}
+		u32 vertexCount = geometry->vertexCount;
+		atomic.positions.resize(vertexCount);
 
-			if (dmweights->size()) {
-				auto& dmwr = *dmweights;
+		// positions after morphing are kept for picking, and interleaved from there
+		static_assert(sizeof(rw::geom::VertexPosition) == sizeof(glm::vec3), "positions must be packed xyz floats");
+		if (vertexCount) memcpy(&atomic.positions[0], &target0.vertexPositions[0], sizeof(glm::vec3) * vertexCount);
+		if (dmweights->size()) {
+			auto& dmwr = *dmweights;
+			for (u32 i = 0; i < vertexCount; i++) {
+				rw::geom::VertexPosition vertex = target0.vertexPositions[i];
 				for (int j = 0; j < dmwr.size(); j++) {
 					float weight = dmwr[j];
 					if (weight < 0.001f && weight > -0.001f) continue;
 					permute_vertex(clump, j, i, vertex, weight);
 				}
+				atomic.positions[i] = glm::vec3(vertex.x, vertex.y, vertex.z);
 			}
-
-			meshVertices[i] = {
-					vertex.x, vertex.y, vertex.z,
-					color.as_int,
-					uvs.u, uvs.v
-			};
 		}
 
-		atomic.vertices = bgfx::createVertexBuffer(
-				bgfx::makeRef(meshVertices,
-							  sizeof(DFFVertex) * geometry->vertexCount,
-							  [](void* p, void* _) {delete[] (DFFVertex*) p;}),
-				DFFVertex::ms_decl
-		);
-
-		struct FaceIndices {
-			u16 vertex1;
-			u16 vertex2;
-			u16 vertex3;
-		};
-		std::vector<std::vector<FaceIndices>> subMeshFaces;
-		subMeshFaces.resize(atomic.subMeshes.size());
-
-		for (int i = 0; i < geometry->triangleCount; i++) {
-			const auto& face = geometry->faces[i];
-			FaceIndices indices {
-					face.vertex1, face.vertex2, face.vertex3
-			};
-			subMeshFaces[face.material].push_back(indices);
+		atomic.matList = new MaterialList(geometry->materialList, txd, MESH_DFF);
+		addAtomic(atomic, geometry->vertexColors.size() ? (const u8*) &geometry->vertexColors[0] : nullptr,
+				  geometry->vertexUVLayers.size() ? &geometry->vertexUVLayers[0][0].u : nullptr,
+				  geometry->triangleCount, geometry->faces, clump->frameList->frames[atomicChunk->frameIndex], scratch);
+	}
+}
+
+bool DFFModel::setFromClumpView(const RWChunkView& clumpChunk, TexDictionary* txd, Arena& scratch) {
+	RWClumpView clump;
+	if (!clump.parse(clumpChunk, scratch)) return false;
+
+	// material lists are small, so they still go through rwstreamlib, all read before anything is built
+	std::vector<rw::MaterialListChunk*> matLists;
+	for (auto& geometry : clump.geometries) {
+		sk::Buffer matListData((void*) geometry.materialList.header, geometry.materialList.size + 12, false);
+		rw::Chunk* matListChunk = rw::readChunk(matListData);
+		if (!matListChunk || matListChunk->type != RWChunkView::MATERIAL_LIST) {
+			delete matListChunk;
+			for (auto matList : matLists) delete matList;
+			return false;
 		}
+		matLists.push_back((rw::MaterialListChunk*) matListChunk);
+	}
+
+	static_initialize();
+	boundsLow = glm::vec3(FLT_MAX);
+	boundsHigh = glm::vec3(-FLT_MAX);
+
+	for (auto& atomicView : clump.atomics) {
+		const auto& geometry = clump.geometries[atomicView.geometryIndex];
+		auto matList = matLists[atomicView.geometryIndex];
+		atomics.emplace_back();
+		auto& atomic = atomics.back();
 
+		atomic.subMeshes.resize(matList->materials.size());
 		for (int i = 0; i < atomic.subMeshes.size(); i++) {
-			auto& subMesh = atomic.subMeshes[i];
-			auto size = sizeof(uint16_t) * subMeshFaces[i].size() * 3;
-			auto mem = bgfx::alloc(size);
-			memcpy(mem->data, &subMeshFaces[i][0], size);
-			subMesh.indices = bgfx::createIndexBuffer(mem);
+			atomic.subMeshes[i].material = i;
 		}
 
-		atomic.matList = new MaterialList(geometry->materialList, txd);
-
-		auto& frame = clump->frameList->frames[atomicChunk->frameIndex];
-		atomic.transform = glm::translate(atomic.transform, glm::vec3(frame.translation.x, frame.translation.y, frame.translation.z));
-		atomic.transform[0][0] = frame.rotation.row1.x;
-		atomic.transform[0][1] = frame.rotation.row1.y;
-		atomic.transform[0][2] = frame.rotation.row1.z;
-		atomic.transform[1][0] = frame.rotation.row2.x;
-		atomic.transform[1][1] = frame.rotation.row2.y;
-		atomic.transform[1][2] = frame.rotation.row2.z;
-		atomic.transform[2][0] = frame.rotation.row3.x;
-		atomic.transform[2][1] = frame.rotation.row3.y;
-		atomic.transform[2][2] = frame.rotation.row3.z;
+		static_assert(sizeof(RWVertexPosition) == sizeof(glm::vec3), "positions must be packed xyz floats");
+		atomic.positions.resize(geometry.positions.size());
+		if (!geometry.positions.empty())
+			memcpy(&atomic.positions[0], geometry.positions.begin(), sizeof(glm::vec3) * geometry.positions.size());
+
+		atomic.matList = new MaterialList(matList, txd, MESH_DFF);
+		addAtomic(atomic, geometry.colors.empty() ? nullptr : (const u8*) geometry.colors.begin(),
+				  geometry.uvs.empty() ? nullptr : &geometry.uvs[0].u, geometry.triangles.size(), geometry.triangles,
+				  clump.frames[atomicView.frameIndex], scratch);
+	}
+
+	for (auto matList : matLists) delete matList;
+	return true;
+}
+
+bool DFFModel::intersect(const glm::mat4& transform, const Ray& ray, float& t) {
+	bool hit = false;
+	float best = FLT_MAX;
+	for (auto& atomic : atomics) {
+		if (atomic.positions.empty()) continue;
+		Ray local = transformRay(glm::inverse(transform * atomic.transform), ray);
+
+		float boxT;
+		if (!rayIntersectAabb(local, atomic.boundsLow, atomic.boundsHigh, boxT) || boxT > best) continue;
+
+		const auto vertexCount = atomic.positions.size();
+		const auto& tris = atomic.triangles;
+		for (size_t i = 0; i + 2 < tris.size(); i += 3) {
+			if (tris[i] >= vertexCount || tris[i+1] >= vertexCount || tris[i+2] >= vertexCount) continue;
+			float triT;
+			if (rayIntersectTriangle(local, atomic.positions[tris[i]], atomic.positions[tris[i+1]], atomic.positions[tris[i+2]], triT)
+				&& triT < best) {
+				best = triT;
+				hit = true;
+			}
+		}
 	}
+	if (hit) t = best;
+	return hit;
 }
 
 void DFFModel::draw(glm::vec3 pos, int renderBits, int pick_color) {
@@ -208,13 +318,14 @@ void DFFModel::draw(const glm::mat4& render_transform, int renderBits, int pick_
 			bgfx::setVertexBuffer(0, atomic.vertices);
 			bgfx::setIndexBuffer(submesh.indices);
 
+			bgfx::ProgramHandle program;
 			if (pick_color) {
-				atomic.matList->bind_color(pick_color, false);
+				program = atomic.matList->bind_color(pick_color, false);
 			} else {
-				atomic.matList->bind(submesh.material, nullptr, renderBits, false);
+				program = atomic.matList->bind(submesh.material, nullptr, renderBits, false);
 			}
 
-			bgfx::submit(pick_color ? u8(1) : u8(0), dffProgram);
+			bgfx::submit(pick_color ? u8(1) : u8(0), program);
 		}
 	}
 }
@@ -257,7 +368,7 @@ void DFFModel::draw_solid_box(glm::vec3 position, u32 color, int view) {
 	bgfx::setVertexBuffer(0, box_vbo);
 	bgfx::setIndexBuffer(box_ibo);
 
-	MaterialList::bind_color(color, true);
+	auto program = MaterialList::bind_color(color, true);
 
-	bgfx::submit((u8) view, dffProgram);
+	bgfx::submit((u8) view, program);
 }
\ No newline at end of file
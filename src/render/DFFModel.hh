@@ -8,6 +8,9 @@
 #include "render/TexDictionary.hh"
 #include "render/TXCAnimation.hh"
 #include "render/MaterialList.hh"
+#include "util/BVH.hh"
+#include "util/Arena.hh"
+#include "io/RWChunkView.hh"
 
 class DFFModel {
 private:
@@ -20,14 +23,43 @@ private:
 		bgfx::VertexBufferHandle vertices;
 		MaterialList* matList;
 		glm::mat4 transform;
+
+		// geometry kept on the cpu for picking
+		std::vector<glm::vec3> positions;
+		std::vector<u16> triangles;
+		glm::vec3 boundsLow;
+		glm::vec3 boundsHigh;
 	};
 
 	std::vector<Atomic> atomics;
+	size_t memoryUsage = 0;
+	glm::vec3 boundsLow;
+	glm::vec3 boundsHigh;
+
+	/// build buffers for an atomic whose positions, sub meshes and material list are already set
+	template<typename Faces, typename Frame>
+	void addAtomic(Atomic& atomic, const u8* colors, const float* uvs, u32 triangleCount, const Faces& faces,
+				   const Frame& frame, Arena& scratch);
 public:
 	~DFFModel();
 
-	void setFromClump(rw::ClumpChunk* clump, TexDictionary* txd, int dmtarget = 0);
-	void setFromClump(rw::ClumpChunk* clump, TexDictionary* txd, std::vector<float>* dmweights);
+	/// frees all geometry, leaving an empty model that draws nothing
+	void clear();
+	/// true once geometry has been set from a clump
+	bool isLoaded() { return !atomics.empty(); }
+	/// approximate size of vertex and index buffers in bytes
+	size_t getMemoryUsage() { return memoryUsage; }
+	/// get model space bounding box (only valid once loaded)
+	void getBounds(glm::vec3& low, glm::vec3& high) { low = boundsLow; high = boundsHigh; }
+	/// exact ray test against triangles of the model drawn with the given transform
+	bool intersect(const glm::mat4& transform, const Ray& ray, float& t);
+
+	/// temporaries are allocated from scratch if given, it isn't reset here
+	void setFromClump(rw::ClumpChunk* clump, TexDictionary* txd, int dmtarget = 0, Arena* scratch = nullptr);
+	void setFromClump(rw::ClumpChunk* clump, TexDictionary* txd, std::vector<float>* dmweights, Arena* scratch = nullptr);
+	/// read an unmorphed model straight from a clump chunk in memory, returns false if it has to go through setFromClump
+	/// scratch holds the clump view while reading, it can be reset once this returns
+	bool setFromClumpView(const RWChunkView& clumpChunk, TexDictionary* txd, Arena& scratch);
 
 	void draw(glm::vec3 pos, int renderBits, int pick_color = 0);
 	void draw(const glm::mat4& transform, int renderBits, int pick_color = 0);
@@ -0,0 +1,791 @@
+#include "DrawScript.hh"
+#include "render/MaterialList.hh"
+#include <glm/gtc/matrix_transform.hpp>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+enum OpCode : u8 {
+	OP_NUMBER,     // push number
+	OP_STRING,     // push strings[a]
+	OP_TABLE,      // push tables[a]
+	OP_BOOL,       // push a != 0
+	OP_NIL,
+	OP_LOAD,       // push slot a
+	OP_STORE,      // pop into slot a
+	OP_PROPERTY,   // push property a of instance
+	OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_NEG,
+	OP_CONCAT,
+	OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE,
+	OP_INDEX,
+	OP_JUMP,       // jump to a
+	OP_JUMP_FALSE, // pop, jump to a if nil or false
+	OP_FOR_PREP,   // check slots a..a+2 (counter, limit, step) are numbers
+	OP_FOR_TEST,   // if counter is past limit jump to b, otherwise copy it to slot a+3
+	OP_FOR_STEP,   // add step to counter and jump to b
+	OP_PUSH,
+	OP_POP,
+	OP_TRANSLATE,
+	OP_ROTATE,     // rotate around strings[a] axes by count numbers
+	OP_ROTATE_INSTANCE, // rotate around strings[a] axes by instance rotation
+	OP_SCALE,
+	OP_MATERIAL,   // set renderBits to a
+	OP_DRAW,
+	OP_DRAW_LINE,   // model, count, dx, dy, dz
+	OP_DRAW_CIRCLE, // model, count, radius and optionally degrees between instances
+};
+
+// fixed sizes so running doesn't need to allocate
+static const int MAX_STACK = 32;
+static const int MAX_SLOTS = 64;
+static const int MAX_TRANSFORMS = 16;
+
+// tokenizer and recursive descent parser, emitting ops as it goes
+class DrawScriptCompiler {
+	enum TokenType { T_EOF, T_NAME, T_NUMBER, T_STRING, T_SYMBOL };
+	struct Token {
+		TokenType type;
+		std::string text;
+		double number;
+	};
+
+	DrawScript& script;
+	const char* p;
+	Token tok;
+	const char* error = nullptr;
+
+	// name to slot, for globals and locals currently in scope
+	std::unordered_map<std::string, int> bindings;
+	std::unordered_set<std::string> globalsRead;
+	std::unordered_set<std::string> globalsWritten;
+	std::vector<std::pair<std::string, int>> shadowed; // bindings to restore when a block ends
+	int depth = 0;
+
+	bool fail(const char* reason) {
+		if (!error) error = reason;
+		return false;
+	}
+
+	bool isSymbol(const char* s) {
+		return tok.type == T_SYMBOL && tok.text == s;
+	}
+
+	bool isName(const char* s) {
+		return tok.type == T_NAME && tok.text == s;
+	}
+
+	static bool isKeyword(const std::string& s) {
+		static const char* keywords[] = {
+			"and", "break", "do", "else", "elseif", "end", "false", "for", "function", "goto", "if", "in",
+			"local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while"
+		};
+		for (auto k : keywords) if (s == k) return true;
+		return false;
+	}
+
+	bool next() {
+		// skip whitespace and comments
+		while (true) {
+			while (*p && isspace((unsigned char) *p)) p++;
+			if (p[0] == '-' && p[1] == '-') {
+				if (p[2] == '[' && (p[3] == '[' || p[3] == '=')) return fail("long comment");
+				while (*p && *p != '\n') p++;
+			} else {
+				break;
+			}
+		}
+
+		tok.text.clear();
+		if (!*p) {
+			tok.type = T_EOF;
+		} else if (isdigit((unsigned char) *p) || (*p == '.' && isdigit((unsigned char) p[1]))) {
+			char* end;
+			tok.type = T_NUMBER;
+			tok.number = strtod(p, &end);
+			if (end == p || isalpha((unsigned char) *end) || *end == '_') return fail("malformed number");
+			p = end;
+		} else if (isalpha((unsigned char) *p) || *p == '_') {
+			tok.type = T_NAME;
+			while (isalnum((unsigned char) *p) || *p == '_') tok.text += *p++;
+		} else if (*p == '"' || *p == '\'') {
+			char quote = *p++;
+			tok.type = T_STRING;
+			while (*p != quote) {
+				if (!*p || *p == '\n' || *p == '\\') return fail("string escape");
+				tok.text += *p++;
+			}
+			p++;
+		} else {
+			static const char* symbols[] = {
+				"==", "~=", "<=", ">=", "..", "(", ")", "[", "]", "{", "}", ",", ";", "=", "<", ">", "+", "-", "*", "/"
+			};
+			tok.type = T_SYMBOL;
+			for (auto s : symbols) {
+				size_t len = strlen(s);
+				if (!strncmp(p, s, len)) {
+					if (!strcmp(s, "..") && p[2] == '.') return fail("varargs");
+					tok.text = s;
+					p += len;
+					return true;
+				}
+			}
+			return fail("unsupported symbol");
+		}
+		return true;
+	}
+
+	bool expect(const char* symbol) {
+		if (!isSymbol(symbol) && !isName(symbol)) return fail("syntax error");
+		return next();
+	}
+
+	int emit(u8 code, int effect, int a = 0, int b = 0, double number = 0.0, int count = 0) {
+		DrawScript::Op op;
+		op.code = code;
+		op.count = (u8) count;
+		op.a = a;
+		op.b = b;
+		op.number = number;
+		script.ops.push_back(op);
+		depth += effect;
+		if (depth > MAX_STACK) fail("expression too deep");
+		return (int) script.ops.size() - 1;
+	}
+
+	int here() {
+		return (int) script.ops.size();
+	}
+
+	int newSlot() {
+		if (script.slotCount >= MAX_SLOTS) {
+			fail("too many variables");
+			return 0;
+		}
+		return script.slotCount++;
+	}
+
+	int addString(const std::string& s) {
+		for (int i = 0; i < script.strings.size(); i++) {
+			if (script.strings[i] == s) return i;
+		}
+		script.strings.push_back(s);
+		return (int) script.strings.size() - 1;
+	}
+
+	// slot a name refers to, creating a global if it isn't bound
+	int lookup(const std::string& name) {
+		auto it = bindings.find(name);
+		if (it != bindings.end()) return it->second;
+		int slot = newSlot();
+		bindings[name] = slot;
+		return slot;
+	}
+
+	void bindLocal(const std::string& name, int slot) {
+		auto it = bindings.find(name);
+		shadowed.emplace_back(name, it == bindings.end() ? -1 : it->second);
+		bindings[name] = slot;
+	}
+
+	void endScope(size_t mark) {
+		while (shadowed.size() > mark) {
+			auto& binding = shadowed.back();
+			if (binding.second == -1) bindings.erase(binding.first);
+			else bindings[binding.first] = binding.second;
+			shadowed.pop_back();
+		}
+	}
+
+	bool isLocal(const std::string& name) {
+		for (auto& binding : shadowed) if (binding.first == name) return true;
+		return false;
+	}
+
+	// expressions
+
+	bool primary() {
+		if (tok.type == T_NUMBER) {
+			emit(OP_NUMBER, 1, 0, 0, tok.number);
+			return next();
+		} else if (tok.type == T_STRING) {
+			emit(OP_STRING, 1, addString(tok.text));
+			return next();
+		} else if (isName("true") || isName("false")) {
+			emit(OP_BOOL, 1, isName("true"));
+			return next();
+		} else if (isName("nil")) {
+			emit(OP_NIL, 1);
+			return next();
+		} else if (isSymbol("(")) {
+			return next() && expression() && expect(")");
+		} else if (isSymbol("{")) {
+			return table();
+		} else if (tok.type == T_NAME && !isKeyword(tok.text)) {
+			std::string name = tok.text;
+			if (!next()) return false;
+			if (isSymbol("(")) {
+				if (name == "property") return property();
+				return fail("unsupported function");
+			}
+			if (!isLocal(name)) globalsRead.insert(name);
+			emit(OP_LOAD, 1, lookup(name));
+			return true;
+		}
+		return fail("syntax error");
+	}
+
+	// property() with a literal index or name, resolved to an index now
+	bool property() {
+		if (!next()) return false;
+		int index;
+		if (tok.type == T_NUMBER) {
+			index = (int) tok.number - 1;
+			if (tok.number != (int) tok.number || index < 0 || index >= (int) script.objdata->properties.size()) {
+				return fail("invalid property index");
+			}
+		} else if (tok.type == T_STRING) {
+			index = script.objdata->findProperty(tok.text.c_str());
+			if (index == -1) return fail("unknown property");
+		} else {
+			return fail("non-literal property");
+		}
+		emit(OP_PROPERTY, 1, index);
+		return next() && expect(")");
+	}
+
+	// table of literal strings
+	bool table() {
+		std::vector<int> entries;
+		if (!next()) return false;
+		while (!isSymbol("}")) {
+			if (tok.type != T_STRING) return fail("non-string table entry");
+			entries.push_back(addString(tok.text));
+			if (!next()) return false;
+			if (isSymbol(",") || isSymbol(";")) {
+				if (!next()) return false;
+			} else if (!isSymbol("}")) {
+				return fail("syntax error");
+			}
+		}
+		script.tables.push_back(entries);
+		emit(OP_TABLE, 1, (int) script.tables.size() - 1);
+		return next();
+	}
+
+	bool postfix() {
+		if (!primary()) return false;
+		while (isSymbol("[")) {
+			if (!next() || !expression() || !expect("]")) return false;
+			emit(OP_INDEX, -1);
+		}
+		return true;
+	}
+
+	bool unary() {
+		if (isSymbol("-")) {
+			if (!next() || !unary()) return false;
+			auto& last = script.ops.back();
+			if (last.code == OP_NUMBER) last.number = -last.number; // fold negative literals
+			else emit(OP_NEG, 0);
+			return true;
+		}
+		return postfix();
+	}
+
+	bool multiplicative() {
+		if (!unary()) return false;
+		while (isSymbol("*") || isSymbol("/")) {
+			u8 code = isSymbol("*") ? OP_MUL : OP_DIV;
+			if (!next() || !unary()) return false;
+			emit(code, -1);
+		}
+		return true;
+	}
+
+	bool additive() {
+		if (!multiplicative()) return false;
+		while (isSymbol("+") || isSymbol("-")) {
+			u8 code = isSymbol("+") ? OP_ADD : OP_SUB;
+			if (!next() || !multiplicative()) return false;
+			emit(code, -1);
+		}
+		return true;
+	}
+
+	bool concat() {
+		if (!additive()) return false;
+		if (isSymbol("..")) {
+			if (!next() || !concat()) return false; // right associative
+			emit(OP_CONCAT, -1);
+		}
+		return true;
+	}
+
+	bool expression() {
+		if (!concat()) return false;
+		while (true) {
+			u8 code;
+			if (isSymbol("==")) code = OP_EQ;
+			else if (isSymbol("~=")) code = OP_NE;
+			else if (isSymbol("<")) code = OP_LT;
+			else if (isSymbol("<=")) code = OP_LE;
+			else if (isSymbol(">")) code = OP_GT;
+			else if (isSymbol(">=")) code = OP_GE;
+			else return true;
+			if (!next() || !concat()) return false;
+			emit(code, -1);
+		}
+	}
+
+	// comma separated expressions up to ')', returns count or -1
+	int arguments() {
+		int count = 0;
+		if (isSymbol(")")) return next() ? 0 : -1;
+		while (true) {
+			if (!expression()) return -1;
+			count++;
+			if (isSymbol(")")) return next() ? count : -1;
+			if (!expect(",")) return -1;
+		}
+	}
+
+	// statements
+
+	bool call(const std::string& name) {
+		if (!next()) return false; // skip '('
+		if (name == "push" || name == "pop") {
+			if (arguments() != 0) return fail("wrong argument count");
+			emit(name == "push" ? OP_PUSH : OP_POP, 0);
+		} else if (name == "draw") {
+			if (arguments() != 1) return fail("wrong argument count");
+			emit(OP_DRAW, -1);
+		} else if (name == "draw_line") {
+			if (arguments() != 5) return fail("wrong argument count");
+			emit(OP_DRAW_LINE, -5);
+		} else if (name == "draw_circle") {
+			int count = arguments();
+			if (count != 3 && count != 4) return fail("wrong argument count");
+			emit(OP_DRAW_CIRCLE, -count, 0, 0, 0.0, count);
+		} else if (name == "translate") {
+			if (arguments() != 3) return fail("wrong argument count");
+			emit(OP_TRANSLATE, -3);
+		} else if (name == "scale") {
+			int count = arguments();
+			if (count != 1 && count != 3) return fail("wrong argument count");
+			emit(OP_SCALE, -count, 0, 0, 0.0, count);
+		} else if (name == "material") {
+			int bits = 0;
+			if (tok.type == T_STRING) {
+				for (char c : tok.text) bits |= matFlagFromChar(c);
+				bits ^= BIT_REFLECTIVE;
+			} else if (tok.type == T_NUMBER) {
+				bits = (int) tok.number;
+			} else {
+				return fail("non-literal material");
+			}
+			if (!next() || !expect(")")) return false;
+			emit(OP_MATERIAL, 0, bits);
+		} else if (name == "rotate") {
+			if (tok.type != T_STRING || tok.text.empty()) return fail("non-literal rotation axes");
+			for (char c : tok.text) {
+				if (!strchr("xyzXYZ", c)) return fail("invalid rotation axis");
+			}
+			int axes = addString(tok.text);
+			if (!next() || !expect(",")) return false;
+			if (isName("rotation")) {
+				if (!next() || !expect("(") || !expect(")") || !expect(")")) return false;
+				emit(OP_ROTATE_INSTANCE, 0, axes);
+			} else {
+				int count = arguments();
+				if (count < 1) return fail("wrong argument count");
+				emit(OP_ROTATE, -count, axes, 0, 0.0, count);
+			}
+		} else {
+			return fail("unsupported function");
+		}
+		return true;
+	}
+
+	bool assignment(const std::string& name) {
+		if (!next() || !expression()) return false;
+		if (!isLocal(name)) globalsWritten.insert(name);
+		emit(OP_STORE, -1, lookup(name));
+		return true;
+	}
+
+	bool ifStatement() {
+		std::vector<int> exits;
+		do {
+			// 'if' or 'elseif'
+			if (!next() || !expression() || !expect("then")) return false;
+			int skip = emit(OP_JUMP_FALSE, -1);
+			if (!block()) return false;
+			if (isName("elseif") || isName("else")) exits.push_back(emit(OP_JUMP, 0));
+			script.ops[skip].a = here();
+		} while (isName("elseif"));
+		if (isName("else")) {
+			if (!next() || !block()) return false;
+		}
+		if (!expect("end")) return false;
+		for (int jump : exits) script.ops[jump].a = here();
+		return true;
+	}
+
+	bool forStatement() {
+		if (!next()) return false;
+		if (tok.type != T_NAME || isKeyword(tok.text)) return fail("syntax error");
+		std::string name = tok.text;
+		if (!next() || !expect("=")) return false;
+
+		// counter, limit, step and the loop variable
+		int base = script.slotCount;
+		for (int i = 0; i < 4; i++) newSlot();
+		if (!expression()) return false;
+		emit(OP_STORE, -1, base);
+		if (!expect(",") || !expression()) return false;
+		emit(OP_STORE, -1, base + 1);
+		if (isSymbol(",")) {
+			if (!next() || !expression()) return false;
+		} else {
+			emit(OP_NUMBER, 1, 0, 0, 1.0);
+		}
+		emit(OP_STORE, -1, base + 2);
+		if (!expect("do")) return false;
+
+		emit(OP_FOR_PREP, 0, base);
+		int test = emit(OP_FOR_TEST, 0, base);
+		size_t mark = shadowed.size();
+		bindLocal(name, base + 3);
+		if (!block()) return false;
+		endScope(mark);
+		emit(OP_FOR_STEP, 0, base, test);
+		script.ops[test].b = here();
+		return expect("end");
+	}
+
+	bool statement() {
+		if (isSymbol(";")) return next();
+		if (isName("if")) return ifStatement();
+		if (isName("for")) return forStatement();
+		if (isName("local")) {
+			if (!next()) return false;
+			if (tok.type != T_NAME || isKeyword(tok.text)) return fail("syntax error");
+			std::string name = tok.text;
+			if (!next() || !expect("=") || !expression()) return false;
+			int slot = newSlot();
+			bindLocal(name, slot); // bound after the expression, which can't see it
+			emit(OP_STORE, -1, slot);
+			return true;
+		}
+		if (tok.type != T_NAME || isKeyword(tok.text)) return fail("unsupported statement");
+		std::string name = tok.text;
+		if (!next()) return false;
+		if (isSymbol("(")) return call(name);
+		if (isSymbol("=")) return assignment(name);
+		return fail("unsupported statement");
+	}
+
+	// statements up to 'end', 'elseif', 'else' or eof, locals declared in it go out of scope after
+	bool block() {
+		size_t mark = shadowed.size();
+		while (tok.type != T_EOF && !isName("end") && !isName("elseif") && !isName("else")) {
+			if (!statement()) return false;
+			if (depth != 0) return fail("unbalanced stack");
+		}
+		endScope(mark);
+		return true;
+	}
+
+public:
+	DrawScriptCompiler(DrawScript& script, const char* src) : script(script), p(src) {}
+
+	bool compile() {
+		if (!next() || !block()) return false;
+		if (tok.type != T_EOF) return fail("syntax error");
+		for (auto& name : globalsRead) {
+			// would read whatever another object's script left in lua's globals
+			if (!globalsWritten.count(name)) return fail("read of unassigned variable");
+		}
+		return !error;
+	}
+
+	const char* getError() {
+		return error ? error : "unknown error";
+	}
+};
+
+glm::mat4 DrawScript::Instancing::get(int i) const {
+	switch (kind) {
+		case LINE: return glm::translate(glm::mat4(1.0f), param * (float) i);
+		case CIRCLE: {
+			glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), glm::radians(param.y * i), glm::vec3(0, 1, 0));
+			return glm::translate(rotation, glm::vec3(param.x, 0, 0));
+		}
+		case ARRAY: return (*transforms)[i];
+		default: return glm::mat4(1.0f);
+	}
+}
+
+DrawScript* DrawScript::compile(const ObjectList::ObjectTypeData* objdata) {
+	if (!objdata || !objdata->blockDraw) return nullptr;
+	auto script = new DrawScript();
+	script->objdata = objdata;
+	DrawScriptCompiler compiler(*script, objdata->blockDraw);
+	if (!compiler.compile()) {
+		log_debug("%s: can't compile draw block natively (%s), using lua", objdata->debugName, compiler.getError());
+		delete script;
+		return nullptr;
+	}
+	return script;
+}
+
+namespace {
+	struct Value {
+		enum Type : u8 { NIL, BOOL, NUMBER, STRING, TABLE } type;
+		int ref; // string index (negative for strings made while running), table index, or bool
+		double number;
+	};
+}
+
+static Value makeNumber(double number) {
+	Value v;
+	v.type = Value::NUMBER;
+	v.ref = 0;
+	v.number = number;
+	return v;
+}
+
+static Value makeRef(Value::Type type, int ref) {
+	Value v;
+	v.type = type;
+	v.ref = ref;
+	v.number = 0.0;
+	return v;
+}
+
+DrawScript::Result DrawScript::run(const glm::vec3& rotation, const u8* misc, int maxOps, int maxCalls,
+								   std::vector<DrawCall>& calls) const {
+	Value stack[MAX_STACK];
+	Value slots[MAX_SLOTS];
+	glm::mat4 transforms[MAX_TRANSFORMS];
+	std::vector<std::string> madeStrings; // results of concatenation
+	int sp = 0;
+	int transformCount = 0;
+	glm::mat4 transform(1.0f);
+	int renderBits = 0;
+	size_t firstCall = calls.size();
+
+	for (int i = 0; i < slotCount; i++) slots[i] = makeRef(Value::NIL, 0);
+
+	auto str = [&](const Value& v) -> const std::string& {
+		return v.ref >= 0 ? strings[v.ref] : madeStrings[-v.ref - 1];
+	};
+
+	// on error, undo any draw calls made so the caller can use lua instead
+	#define DS_CHECK(cond) if (!(cond)) { calls.resize(firstCall); return UNSUPPORTED; }
+
+	int opsLeft = maxOps;
+	int instancesLeft = maxCalls;
+	for (int pc = 0; pc < ops.size(); pc++) {
+		const Op& op = ops[pc];
+		if (--opsLeft < 0) {
+			calls.resize(firstCall);
+			return OVER_BUDGET;
+		}
+		switch (op.code) {
+			case OP_NUMBER: stack[sp++] = makeNumber(op.number); break;
+			case OP_STRING: stack[sp++] = makeRef(Value::STRING, op.a); break;
+			case OP_TABLE: stack[sp++] = makeRef(Value::TABLE, op.a); break;
+			case OP_BOOL: stack[sp++] = makeRef(Value::BOOL, op.a); break;
+			case OP_NIL: stack[sp++] = makeRef(Value::NIL, 0); break;
+			case OP_LOAD: stack[sp++] = slots[op.a]; break;
+			case OP_STORE: slots[op.a] = stack[--sp]; break;
+			case OP_PROPERTY: {
+				double value;
+				if (objdata->readProperty(op.a, misc, value)) stack[sp++] = makeNumber(value);
+				else stack[sp++] = makeRef(Value::NIL, 0);
+			} break;
+			case OP_ADD:
+			case OP_SUB:
+			case OP_MUL:
+			case OP_DIV: {
+				Value& l = stack[sp - 2];
+				Value& r = stack[sp - 1];
+				DS_CHECK(l.type == Value::NUMBER && r.type == Value::NUMBER);
+				switch (op.code) {
+					case OP_ADD: l.number += r.number; break;
+					case OP_SUB: l.number -= r.number; break;
+					case OP_MUL: l.number *= r.number; break;
+					default: l.number /= r.number;
+				}
+				sp--;
+			} break;
+			case OP_NEG: {
+				DS_CHECK(stack[sp - 1].type == Value::NUMBER);
+				stack[sp - 1].number = -stack[sp - 1].number;
+			} break;
+			case OP_CONCAT: {
+				// lua formats numbers its own way, so only strings are handled here
+				Value& l = stack[sp - 2];
+				Value& r = stack[sp - 1];
+				DS_CHECK(l.type == Value::STRING && r.type == Value::STRING);
+				madeStrings.push_back(str(l) + str(r));
+				l = makeRef(Value::STRING, -(int) madeStrings.size());
+				sp--;
+			} break;
+			case OP_EQ:
+			case OP_NE: {
+				Value& l = stack[sp - 2];
+				Value& r = stack[sp - 1];
+				bool equal = l.type == r.type;
+				if (equal) {
+					switch (l.type) {
+						case Value::NIL: break;
+						case Value::NUMBER: equal = l.number == r.number; break;
+						case Value::STRING: equal = str(l) == str(r); break;
+						default: equal = l.ref == r.ref;
+					}
+				}
+				l = makeRef(Value::BOOL, equal == (op.code == OP_EQ));
+				sp--;
+			} break;
+			case OP_LT:
+			case OP_LE:
+			case OP_GT:
+			case OP_GE: {
+				Value& l = stack[sp - 2];
+				Value& r = stack[sp - 1];
+				DS_CHECK(l.type == r.type && (l.type == Value::NUMBER || l.type == Value::STRING));
+				int cmp;
+				if (l.type == Value::NUMBER) cmp = l.number < r.number ? -1 : (l.number > r.number ? 1 : 0);
+				else cmp = str(l).compare(str(r));
+				bool result;
+				switch (op.code) {
+					case OP_LT: result = cmp < 0; break;
+					case OP_LE: result = cmp <= 0; break;
+					case OP_GT: result = cmp > 0; break;
+					default: result = cmp >= 0;
+				}
+				l = makeRef(Value::BOOL, result);
+				sp--;
+			} break;
+			case OP_INDEX: {
+				Value& t = stack[sp - 2];
+				Value& k = stack[sp - 1];
+				DS_CHECK(t.type == Value::TABLE);
+				auto& entries = tables[t.ref];
+				if (k.type == Value::NUMBER && k.number == (int) k.number && k.number >= 1 && k.number <= entries.size()) {
+					t = makeRef(Value::STRING, entries[(int) k.number - 1]);
+				} else {
+					t = makeRef(Value::NIL, 0);
+				}
+				sp--;
+			} break;
+			case OP_JUMP: pc = op.a - 1; break;
+			case OP_JUMP_FALSE: {
+				Value& v = stack[--sp];
+				if (v.type == Value::NIL || (v.type == Value::BOOL && !v.ref)) pc = op.a - 1;
+			} break;
+			case OP_FOR_PREP: {
+				for (int i = 0; i < 3; i++) DS_CHECK(slots[op.a + i].type == Value::NUMBER);
+				DS_CHECK(slots[op.a + 2].number != 0.0);
+			} break;
+			case OP_FOR_TEST: {
+				double counter = slots[op.a].number;
+				double limit = slots[op.a + 1].number;
+				if (slots[op.a + 2].number > 0 ? counter <= limit : counter >= limit) {
+					slots[op.a + 3] = makeNumber(counter);
+				} else {
+					pc = op.b - 1;
+				}
+			} break;
+			case OP_FOR_STEP: {
+				slots[op.a].number += slots[op.a + 2].number;
+				pc = op.b - 1;
+			} break;
+			case OP_PUSH: {
+				DS_CHECK(transformCount < MAX_TRANSFORMS);
+				transforms[transformCount++] = transform;
+			} break;
+			case OP_POP: {
+				DS_CHECK(transformCount > 0);
+				transform = transforms[--transformCount];
+			} break;
+			case OP_TRANSLATE: {
+				sp -= 3;
+				for (int i = 0; i < 3; i++) DS_CHECK(stack[sp + i].type == Value::NUMBER);
+				transform = glm::translate(transform,
+					glm::vec3((float) stack[sp].number, (float) stack[sp + 1].number, (float) stack[sp + 2].number));
+			} break;
+			case OP_ROTATE:
+			case OP_ROTATE_INSTANCE: {
+				sp -= op.count;
+				for (int i = 0; i < op.count; i++) DS_CHECK(stack[sp + i].type == Value::NUMBER);
+				auto& axes = strings[op.a];
+				for (int i = 0; i < axes.size(); i++) {
+					int axis_id = (axes[i] | 0x20) - 'x';
+					glm::vec3 axis(0.0f);
+					axis[axis_id] = 1.0f;
+					float f;
+					if (op.code == OP_ROTATE_INSTANCE) f = rotation[axis_id];
+					else f = i < op.count ? (float) stack[sp + i].number : 0.0f;
+					transform = glm::rotate(transform, glm::radians(f), axis);
+				}
+			} break;
+			case OP_SCALE: {
+				sp -= op.count;
+				for (int i = 0; i < op.count; i++) DS_CHECK(stack[sp + i].type == Value::NUMBER);
+				if (op.count == 1) {
+					float factor = (float) stack[sp].number;
+					transform = glm::scale(transform, glm::vec3(factor, factor, factor));
+				} else {
+					transform = glm::scale(transform,
+						glm::vec3((float) stack[sp].number, (float) stack[sp + 1].number, (float) stack[sp + 2].number));
+				}
+			} break;
+			case OP_MATERIAL: renderBits = op.a; break;
+			case OP_DRAW:
+			case OP_DRAW_LINE:
+			case OP_DRAW_CIRCLE: {
+				int argc = op.code == OP_DRAW ? 1 : (op.code == OP_DRAW_LINE ? 5 : op.count);
+				sp -= argc;
+				Value& v = stack[sp];
+				DS_CHECK(v.type != Value::NUMBER); // lua would draw the number as a name
+				for (int i = 1; i < argc; i++) DS_CHECK(stack[sp + i].type == Value::NUMBER);
+
+				Instancing instancing;
+				if (op.code != OP_DRAW) {
+					instancing.count = (int) stack[sp + 1].number;
+					if (instancing.count <= 0) break;
+				}
+				if (op.code == OP_DRAW_LINE) {
+					instancing.kind = Instancing::LINE;
+					instancing.param = glm::vec3((float) stack[sp + 2].number, (float) stack[sp + 3].number,
+												 (float) stack[sp + 4].number);
+				} else if (op.code == OP_DRAW_CIRCLE) {
+					instancing.kind = Instancing::CIRCLE;
+					float step = argc == 4 ? (float) stack[sp + 3].number : 360.0f / instancing.count;
+					instancing.param = glm::vec3((float) stack[sp + 2].number, step, 0.0f);
+				}
+				instancesLeft -= instancing.count;
+				if (instancesLeft < 0) {
+					calls.resize(firstCall);
+					return OVER_BUDGET;
+				}
+
+				calls.emplace_back();
+				auto& dc = calls.back();
+				dc.transform = transform;
+				dc.renderBits = renderBits;
+				if (v.type == Value::STRING) dc.modelName = str(v);
+				dc.instancing = instancing;
+			} break;
+			default: DS_CHECK(false);
+		}
+	}
+
+	#undef DS_CHECK
+	return OK;
+}
@@ -0,0 +1,57 @@
+// Compiles ObjectList.ini draw blocks to native ops
+// Covers the subset of lua the draw blocks use (transform calls, property(), tables of names, if/for);
+// blocks using anything else fail to compile and should be run through lua instead
+
+#pragma once
+#include "common.hh"
+#include "util/ObjectList.hh"
+#include <glm/glm.hpp>
+
+class DrawScript {
+public:
+	/// compact record of a draw repeated along a line, around a circle or over a list of transforms
+	/// copies are expanded on the cpu wherever the model is drawn or tested, each is still its own submission
+	struct Instancing {
+		enum Kind : u8 { SINGLE, LINE, CIRCLE, ARRAY } kind = SINGLE;
+		int count = 1;
+		glm::vec3 param; // LINE: offset between instances, CIRCLE: x is radius and y is degrees between instances
+		shared_ptr<const std::vector<glm::mat4>> transforms; // ARRAY
+
+		/// transform of instance i, relative to the draw's transform
+		glm::mat4 get(int i) const;
+	};
+
+	struct DrawCall {
+		glm::mat4 transform;
+		int renderBits;
+		std::string modelName;
+		Instancing instancing;
+	};
+
+	/// compile object type's draw block, returns nullptr if it uses anything unsupported
+	static DrawScript* compile(const ObjectList::ObjectTypeData* objdata);
+
+	enum Result {
+		OK,
+		UNSUPPORTED, // hit something lua would handle differently, lua should be used to get the actual result
+		OVER_BUDGET // ran more than maxOps ops or made more than maxCalls draw calls
+	};
+
+	/// run for an object instance, appending to calls (left unchanged unless OK is returned)
+	Result run(const glm::vec3& rotation, const u8* misc, int maxOps, int maxCalls, std::vector<DrawCall>& calls) const;
+private:
+	struct Op {
+		u8 code;
+		u8 count; // number of arguments taken from the stack
+		int a;
+		int b;
+		double number;
+	};
+	const ObjectList::ObjectTypeData* objdata;
+	std::vector<Op> ops;
+	std::vector<std::string> strings;
+	std::vector<std::vector<int>> tables; // indices into strings
+	int slotCount = 0;
+
+	friend class DrawScriptCompiler;
+};
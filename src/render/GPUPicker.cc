@@ -0,0 +1,109 @@
+#include "GPUPicker.hh"
+#include <bx/math.h>
+
+GPUPicker::GPUPicker() {
+	auto tex_flags = BGFX_TEXTURE_MIN_POINT
+				   | BGFX_TEXTURE_MAG_POINT
+				   | BGFX_TEXTURE_MIP_POINT
+				   | BGFX_TEXTURE_U_CLAMP
+				   | BGFX_TEXTURE_V_CLAMP;
+
+	using bgfx::TextureFormat;
+	pickingRT = bgfx::createTexture2D(PICK_SIZE, PICK_SIZE, false, 1, TextureFormat::RGBA8, tex_flags | BGFX_TEXTURE_RT);
+	pickingRTDepth = bgfx::createTexture2D(PICK_SIZE, PICK_SIZE, false, 1, TextureFormat::D24S8, tex_flags | BGFX_TEXTURE_RT);
+	blitted = bgfx::createTexture2D(PICK_SIZE, PICK_SIZE, false, 1, TextureFormat::RGBA8,
+									tex_flags | BGFX_TEXTURE_BLIT_DST | BGFX_TEXTURE_READ_BACK);
+
+	bgfx::TextureHandle targets[] = {pickingRT, pickingRTDepth};
+	pickingFB = bgfx::createFrameBuffer(2, targets, true);
+}
+
+GPUPicker::~GPUPicker() {
+	bgfx::destroy(pickingFB); // also destroys pickingRT and pickingRTDepth
+	bgfx::destroy(blitted);
+}
+
+void GPUPicker::request(vec2 ndc, Callback callback) {
+	Request req;
+	req.ndc = ndc;
+	req.callback = move(callback);
+	requests.push_back(move(req));
+}
+
+bool GPUPicker::beginPass(Camera& camera, Ray& ray) {
+	// one pick in flight at a time, as results share the readback buffer
+	if (hasInFlight || requests.empty()) return false;
+
+	inFlight = move(requests.front());
+	requests.pop_front();
+	hasInFlight = true;
+	readbackFrame = 0;
+
+	// below based on https://github.com/bkaradzic/bgfx/blob/master/examples/30-picking/picking.cpp
+	glm::mat4 view = camera.getViewMatrix();
+	glm::mat4 proj = camera.getPerspMatrix();
+	float viewProj[16];
+	bx::mtxMul(viewProj, &view[0][0], &proj[0][0]);
+
+	float invViewProj[16];
+	bx::mtxInverse(invViewProj, viewProj);
+
+	float pickEye[3];
+	float mousePosNDC[3] = { inFlight.ndc.x, inFlight.ndc.y, 0.0f };
+	bx::vec3MulMtxH(pickEye, mousePosNDC, invViewProj);
+
+	float pickAt[3];
+	float mousePosNDCEnd[3] = { inFlight.ndc.x, inFlight.ndc.y, 0.1f };
+	bx::vec3MulMtxH(pickAt, mousePosNDCEnd, invViewProj);
+
+	// Look at our unprojected point
+	float pickView[16];
+	bx::mtxLookAt(pickView, pickEye, pickAt);
+
+	// Tight FOV is best for picking
+	float pickProj[16];
+	bx::mtxProj(pickProj, 2, 1, 0.1f, 10000.0f, bgfx::getCaps()->homogeneousDepth);
+
+	// View rect and transforms for picking pass
+	bgfx::setViewFrameBuffer(VIEW_PICK, pickingFB);
+	bgfx::setViewRect(VIEW_PICK, 0, 0, PICK_SIZE, PICK_SIZE);
+	bgfx::setViewTransform(VIEW_PICK, pickView, pickProj);
+	bgfx::touch(VIEW_PICK); // make sure the clear happens even if nothing is drawn
+
+	ray = camera.screenRay(inFlight.ndc);
+	return true;
+}
+
+void GPUPicker::endPass() {
+	if ((bgfx::getCaps()->supported & BGFX_CAPS_TEXTURE_BLIT) &&
+		(bgfx::getCaps()->supported & BGFX_CAPS_TEXTURE_READ_BACK)) {
+		bgfx::blit(VIEW_BLIT, blitted, 0, 0, pickingRT);
+		readbackFrame = bgfx::readTexture(blitted, readbackData);
+	} else {
+		readbackFrame = bgfx::readTexture(pickingRT, readbackData);
+	}
+}
+
+void GPUPicker::update(u32 currentFrame) {
+	if (!hasInFlight || !readbackFrame || currentFrame < readbackFrame) return;
+
+	// center pixel lies on the ray through the cursor
+	const u8* pixel = &readbackData[((PICK_SIZE / 2) * PICK_SIZE + PICK_SIZE / 2) * 4];
+	int index = pixel[0] | (pixel[1] << 8);
+	int list = pixel[2];
+
+	hasInFlight = false;
+	readbackFrame = 0;
+	if (inFlight.callback) inFlight.callback(list, index);
+}
+
+void GPUPicker::drawUI() {
+	union BiggImTexture { ImTextureID ptr; struct { uint16_t flags; bgfx::TextureHandle handle; } s; };
+	BiggImTexture img;
+	img.s.flags = 0; // unused
+	img.s.handle = pickingRT;
+	ImGui::Image(img.ptr, ImVec2(128, 128));
+	img.s.handle = blitted;
+	ImGui::Image(img.ptr, ImVec2(128, 128));
+	ImGui::Text("%d pick requests queued%s", (int) requests.size(), hasInFlight ? ", 1 in flight" : "");
+}
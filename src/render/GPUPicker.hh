@@ -0,0 +1,52 @@
+// On-demand GPU picking
+// Renders object ids around the cursor into a small offscreen framebuffer only when a pick is requested,
+// and reads the result back asynchronously instead of stalling with extra frames
+
+#pragma once
+#include "common.hh"
+#include <bigg.hpp>
+#include <deque>
+#include <functional>
+#include "render/Camera.hh"
+
+class GPUPicker {
+public:
+	/// called with list 0 if nothing was under the cursor
+	typedef std::function<void(int list, int index)> Callback;
+
+	static const int PICK_SIZE = 64;
+	static const u8 VIEW_PICK = 1;
+	static const u8 VIEW_BLIT = 2;
+private:
+	struct Request {
+		vec2 ndc;
+		Callback callback;
+	};
+	std::deque<Request> requests;
+	Request inFlight;
+	bool hasInFlight = false;
+	u32 readbackFrame = 0;
+
+	bgfx::TextureHandle pickingRT;
+	bgfx::TextureHandle pickingRTDepth;
+	bgfx::TextureHandle blitted;
+	bgfx::FrameBufferHandle pickingFB;
+	u8 readbackData[PICK_SIZE * PICK_SIZE * 4];
+public:
+	GPUPicker();
+	~GPUPicker();
+
+	/// queue a pick at a point in normalized device coordinates
+	void request(vec2 ndc, Callback callback);
+
+	/// if a queued request can start this frame, setup the pick view and return true
+	/// the caller should then draw pick colors for objects along ray to VIEW_PICK and call endPass
+	bool beginPass(Camera& camera, Ray& ray);
+	/// schedule readback of the pass started this frame
+	void endPass();
+
+	/// deliver result once readback has completed (currentFrame is the last frame number returned by bgfx::frame)
+	void update(u32 currentFrame);
+
+	void drawUI();
+};
@@ -1,113 +1,124 @@
 #include "MaterialList.hh"
+#include "render/RenderUniforms.hh"
+
+// index into materialStates from the render bits that affect state
+static inline int stateKey(int renderBits, bool triList) {
+	return ((renderBits >> 4) & 1)  // BIT_NO_CULL
+		 | ((renderBits >> 5) & 2)  // BIT_FULL_ALPHA
+		 | ((renderBits >> 5) & 4)  // BIT_ADDITIVE
+		 | (triList ? 8 : 0);
+}
+
+static uint64_t computeState(int key) {
+	uint64_t state = BGFX_STATE_RGB_WRITE | BGFX_STATE_MSAA;
+	state |= BGFX_STATE_ALPHA_WRITE;
+
+	const bool noCull = (key & 1) != 0;
+	const bool fullAlpha = (key & 2) != 0;
+	const bool additive = (key & 4) != 0;
+	const bool triList = (key & 8) != 0;
+
+	if (!(additive || fullAlpha))
+		state |= BGFX_STATE_DEPTH_WRITE;
+	state |= BGFX_STATE_DEPTH_TEST_LESS;
+
+	if (triList) {
+		state |= BGFX_STATE_PT_TRISTRIP;
+	}
+
+	if (additive) {
+		state |= BGFX_STATE_BLEND_ADD;
+	}
+	if (fullAlpha) {
+		state |= BGFX_STATE_BLEND_ALPHA | BGFX_STATE_BLEND_INDEPENDENT;
+	}
+	if (!noCull) {
+		state |= BGFX_STATE_CULL_CW;
+	}
+	return state;
+}
 
-static bgfx::UniformHandle uSamplerTexture;
-static bgfx::UniformHandle uMaterialColor;
-static bgfx::UniformHandle uMaterialBits;
-static bgfx::TextureHandle tWhite;
-static bool staticValuesLoaded = false;
+static struct MaterialStates {
+	uint64_t states[16];
+	MaterialStates() {
+		for (int key = 0; key < 16; key++) states[key] = computeState(key);
+	}
+} materialStates;
+
+static const uint64_t colorStates[2] = {
+		BGFX_STATE_RGB_WRITE | BGFX_STATE_ALPHA_WRITE | BGFX_STATE_DEPTH_WRITE | BGFX_STATE_DEPTH_TEST_LESS,
+		BGFX_STATE_RGB_WRITE | BGFX_STATE_ALPHA_WRITE | BGFX_STATE_DEPTH_WRITE | BGFX_STATE_DEPTH_TEST_LESS
+		| BGFX_STATE_PT_TRISTRIP,
+};
+
+static void unpackColor(uint32_t color, float* out) {
+	out[0] = (color & 0xff) / 255.f;
+	out[1] = ((color >> 8) & 0xff) / 255.f;
+	out[2] = ((color >> 16) & 0xff) / 255.f;
+	out[3] = ((color >> 24) & 0xff) / 255.f;
+}
 
-MaterialList::MaterialList(rw::MaterialListChunk* matList, TexDictionary* txd) {
+MaterialList::MaterialList(rw::MaterialListChunk* matList, TexDictionary* txd, MeshKind kind) : txd(txd) {
+	materials.reserve(matList->materials.size());
 	for (auto matChunk : matList->materials) {
 		materials.emplace_back();
 		auto& material = materials.back();
 
-		material.color = matChunk->color;
+		unpackColor(matChunk->color, material.color); // todo: is this RGBA or BGRA?
 		if (matChunk->isTextured) {
 			if (txd) material.texture = txd->getTexture(matChunk->texture->textureName.c_str());
 			else material.texture.idx = 0;
 		} else {
 			material.texture.idx = 0;
 		}
+		if (txd) txd->acquire(material.texture);
+
+		// pick shader variant now, so drawing doesn't need to branch on material properties
+		int variant = material.texture.idx ? VARIANT_TEXTURED : VARIANT_UNTEXTURED;
+		if (kind == MESH_DFF && material.color[3] == 0.0f) {
+			// dff materials with zero alpha are drawn as flat color
+			material.programs[0] = material.programs[1] = renderUniforms.programs[kind][VARIANT_FLAT];
+		} else {
+			material.programs[0] = renderUniforms.programs[kind][variant];
+			material.programs[1] = renderUniforms.programs[kind][variant + 1];
+		}
 	}
 }
 
-static void loadStaticValues() {
-	if (!staticValuesLoaded) {
-		uSamplerTexture = bgfx::createUniform("s_texture", bgfx::UniformType::Int1);
-		uMaterialColor = bgfx::createUniform("u_materialColor", bgfx::UniformType::Vec4);
-		uMaterialBits = bgfx::createUniform("u_materialBits", bgfx::UniformType::Int1);
-		const static u32 W = 0xffffffff;
-		static u32 white_pixels[] = {W, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W};
-		tWhite = bgfx::createTexture2D(4, 4, false, 1, bgfx::TextureFormat::RGBA8,
-							  0, bgfx::makeRef(white_pixels, sizeof(white_pixels)));
-		staticValuesLoaded = true;
+MaterialList::~MaterialList() {
+	if (txd) {
+		for (auto& material : materials) {
+			txd->release(material.texture);
+		}
 	}
 }
 
-void MaterialList::bind(int id, TXCAnimation* txc, int renderBits, bool triList) {
-	// set material
-	loadStaticValues();
+bgfx::ProgramHandle MaterialList::bind(int id, TXCAnimation* txc, int renderBits, bool triList) {
 	const auto& material = materials[id];
 
-	bgfx::setTexture(0, uSamplerTexture, txc ? txc->getTexture(material.texture) : material.texture);
-	float matColor[4];
-	uint32_t color = material.color; // todo: is this RGBA or BGRA?
-	matColor[0] = (color & 0xff) / 255.f;
-	matColor[1] = ((color >> 8) & 0xff) / 255.f;
-	matColor[2] = ((color >> 16) & 0xff) / 255.f;
-	matColor[3] = ((color >> 24) & 0xff) / 255.f;
-	//if (color != 0xffffffff)
-	//	log_info("Material with a color!!");
-	bgfx::setUniform(uMaterialColor, &matColor);
-	uint32_t matBits = 0;
-	if (renderBits & BIT_PUNCH_ALPHA)
-		matBits |= 1;
-	bgfx::setUniform(uMaterialBits, &matBits);
-
-	// set state
-	uint64_t state = BGFX_STATE_RGB_WRITE | BGFX_STATE_MSAA;
-	state |= BGFX_STATE_ALPHA_WRITE;
-
-	if (!((renderBits & BIT_ADDITIVE) || (renderBits & BIT_FULL_ALPHA)))
-		state |= BGFX_STATE_DEPTH_WRITE;
-	state |= BGFX_STATE_DEPTH_TEST_LESS;
-
-	if (triList) {
-		state |= BGFX_STATE_PT_TRISTRIP;
+	// set material
+	if (material.texture.idx) {
+		auto texture = txc ? txc->getTexture(material.texture) : material.texture;
+		bgfx::setTexture(0, renderUniforms.sTexture, TexDictionary::resolve(texture));
 	}
+	bgfx::setUniform(renderUniforms.uMaterialColor, material.color);
 
-	if (renderBits & BIT_ADDITIVE) {
-		state |= BGFX_STATE_BLEND_ADD;
-	}
-	if (renderBits & BIT_FULL_ALPHA) {
-		state |= BGFX_STATE_BLEND_ALPHA | BGFX_STATE_BLEND_INDEPENDENT;
-	}
-	if (!(renderBits & BIT_NO_CULL)) {
-		state |= BGFX_STATE_CULL_CW;
-	}
-	bgfx::setState(state);
+	// set state
+	bgfx::setState(materialStates.states[stateKey(renderBits, triList)]);
 
+	return material.programs[(renderBits & BIT_PUNCH_ALPHA) ? 1 : 0];
 }
 
-void MaterialList::bind_color(u32 color, int triList) {
-// set material
-	loadStaticValues();
-
-	bgfx::setTexture(0, uSamplerTexture, tWhite);
+bgfx::ProgramHandle MaterialList::bind_color(u32 color, int triList) {
+	// set material
 	float matColor[4];
-	matColor[0] = (color & 0xff) / 255.f;
-	matColor[1] = ((color >> 8) & 0xff) / 255.f;
-	matColor[2] = ((color >> 16) & 0xff) / 255.f;
-	matColor[3] = ((color >> 24) & 0xff) / 255.f;
-	//if (color != 0xffffffff)
-	//	log_info("Material with a color!!");
-	bgfx::setUniform(uMaterialColor, &matColor);
-	uint32_t matBits = 0;
-	bgfx::setUniform(uMaterialBits, &matBits);
+	unpackColor(color, matColor);
+	bgfx::setUniform(renderUniforms.uMaterialColor, &matColor);
 
 	// set state
-	uint64_t state = BGFX_STATE_RGB_WRITE;
-	state |= BGFX_STATE_ALPHA_WRITE;
-
-	state |= BGFX_STATE_DEPTH_WRITE;
-	state |= BGFX_STATE_DEPTH_TEST_LESS;
-
-	if (triList) {
-		state |= BGFX_STATE_PT_TRISTRIP;
-	}
-
-	bgfx::setState(state);
+	bgfx::setState(colorStates[triList ? 1 : 0]);
 
+	return renderUniforms.programs[MESH_DFF][VARIANT_FLAT];
 }
 
 int matFlagFromChar(char c) {
@@ -5,6 +5,7 @@
 #include <bigg.hpp>
 #include "render/TexDictionary.hh"
 #include "render/TXCAnimation.hh"
+#include "render/RenderUniforms.hh"
 #include "material.hh"
 
 const int BIT_REFLECTIVE = 1 << 0; // if N is not present
@@ -23,13 +24,19 @@ int matFlagFromChar(char c);
 
 class MaterialList {
 private:
+	// baked on load so binding is just uniform and state submission
 	struct Material {
-		uint32_t color;
-		bgfx::TextureHandle texture;
+		float color[4];
+		TextureRef texture;
+		bgfx::ProgramHandle programs[2]; // without and with punch alpha
 	};
 	std::vector<Material> materials;
+	TexDictionary* txd; // textures are referenced while this list exists
 public:
-	MaterialList(rw::MaterialListChunk* matList, TexDictionary* txd);
-	void bind(int id, TXCAnimation* txc, int renderBits, bool triList);
-	static void bind_color(u32 color, int triList);
+	MaterialList(rw::MaterialListChunk* matList, TexDictionary* txd, MeshKind kind);
+	~MaterialList();
+	/// set material state for draw, returns program to submit with
+	bgfx::ProgramHandle bind(int id, TXCAnimation* txc, int renderBits, bool triList);
+	/// set flat color state for draw (used for picking), returns program to submit with
+	static bgfx::ProgramHandle bind_color(u32 color, int triList);
 };
@@ -0,0 +1,37 @@
+#include "RenderUniforms.hh"
+
+RenderUniforms renderUniforms;
+
+static const char* vertexShaders[MESH_KIND_COUNT] = {
+		"shaders/glsl/vs_bspmesh.bin",
+		"shaders/glsl/vs_dffmesh.bin",
+};
+
+static const char* fragmentShaders[VARIANT_COUNT] = {
+		"shaders/glsl/fs_mesh.bin",
+		"shaders/glsl/fs_mesh_punch.bin",
+		"shaders/glsl/fs_mesh_untextured.bin",
+		"shaders/glsl/fs_mesh_untextured_punch.bin",
+		"shaders/glsl/fs_mesh_flat.bin",
+};
+
+void renderUniformsInit() {
+	renderUniforms.sTexture = bgfx::createUniform("s_texture", bgfx::UniformType::Int1);
+	renderUniforms.uMaterialColor = bgfx::createUniform("u_materialColor", bgfx::UniformType::Vec4);
+
+	for (int kind = 0; kind < MESH_KIND_COUNT; kind++) {
+		for (int variant = 0; variant < VARIANT_COUNT; variant++) {
+			renderUniforms.programs[kind][variant] = bigg::loadProgram(vertexShaders[kind], fragmentShaders[variant]);
+		}
+	}
+}
+
+void renderUniformsShutdown() {
+	for (int kind = 0; kind < MESH_KIND_COUNT; kind++) {
+		for (int variant = 0; variant < VARIANT_COUNT; variant++) {
+			bgfx::destroy(renderUniforms.programs[kind][variant]);
+		}
+	}
+	bgfx::destroy(renderUniforms.sTexture);
+	bgfx::destroy(renderUniforms.uMaterialColor);
+}
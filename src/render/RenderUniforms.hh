@@ -0,0 +1,34 @@
+// Uniforms and programs shared by all model renderers
+
+#pragma once
+#include "common.hh"
+#include <bigg.hpp>
+
+enum MeshKind {
+	MESH_BSP,
+	MESH_DFF,
+	MESH_KIND_COUNT
+};
+
+// fragment shader permutations, see shaders/fs_mesh.sh
+// punch variants directly follow their non-punch counterpart
+enum MeshVariant {
+	VARIANT_TEXTURED,
+	VARIANT_TEXTURED_PUNCH,
+	VARIANT_UNTEXTURED,
+	VARIANT_UNTEXTURED_PUNCH,
+	VARIANT_FLAT,
+	VARIANT_COUNT
+};
+
+struct RenderUniforms {
+	bgfx::UniformHandle sTexture;
+	bgfx::UniformHandle uMaterialColor;
+	bgfx::ProgramHandle programs[MESH_KIND_COUNT][VARIANT_COUNT];
+};
+
+extern RenderUniforms renderUniforms;
+
+// create shared uniforms and programs, must be called once after bgfx is initialized
+void renderUniformsInit();
+void renderUniformsShutdown();
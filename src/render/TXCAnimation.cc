@@ -1,25 +1,29 @@
 #include "util/fspath.hh"
 #include "TXCAnimation.hh"
+#include "util/ByteReader.hh"
+#include <algorithm>
 
-TXCAnimation::TXCAnimation(Buffer& data, TexDictionary* txd) {
-	u32 value;
-	data.read(&value);
-	while (value != 0xffffffff) {
+TXCAnimation::TXCAnimation(Buffer& file, TexDictionary* txd) : txd(txd) {
+	ByteReader data(file.head_ptr(), file.remaining());
+	u32 value = data.read<u32>();
+	while (value != 0xffffffff && data.ok()) {
 		animations.emplace_back();
 		auto& animation = animations.back();
 
 		animation.frameCount = value;
 		log_info("frameCount %d", value);
-		animation.frames.resize(value);
 
-		data.seek(data.tell() + 516);
+		data.skip(516);
 
-		char buffer[32];
+		char buffer[33];
+		buffer[32] = 0;
 		data.read(buffer, 32);
 		animation.replaceTexture = std::string(buffer);
 
 		int replaceIdx = txd->getTexture(buffer).idx;
-		textureLookup.insert(std::make_pair(replaceIdx, (int) (animations.size() - 1)));
+
+		// frames before the first keyframe, or with missing textures, keep showing the previous texture
+		if (value) animation.frames.push_back({0, {(uint16_t) replaceIdx}});
 
 		data.read(buffer, 32);
 		animation.name = std::string(buffer);
@@ -34,8 +38,11 @@ TXCAnimation::TXCAnimation(Buffer& data, TexDictionary* txd) {
 		auto& frameDatas = animation.frameDeltas;
 		while (true) {
 			// read frame
-			FrameData frame;
-			data.read(&frame);
+			if (!data.has(sizeof(FrameData))) {
+				log_warn("unexpected end of txc in texture %s", animation.name.c_str());
+				break;
+			}
+			FrameData frame = data.readUnchecked<FrameData>();
 			if (frame.frameID == 0xffff) break;
 
 			if (frame.frameID >= animation.frameCount || frame.frameID < previousFrameID) {
@@ -46,7 +53,14 @@ TXCAnimation::TXCAnimation(Buffer& data, TexDictionary* txd) {
 			// add frame to optimized storage
 			// todo: generate this afterwards from editor deltas
 			snprintf(bufferEnd, n, ".%d", frame.textureID);
-			animation.frames[frame.frameID] = txd->getTexture(buffer);
+			auto texture = txd->getTexture(buffer);
+			if (texture.idx != 0) {
+				if (animation.frames.back().start == frame.frameID) {
+					animation.frames.back().texture = texture;
+				} else {
+					animation.frames.push_back({frame.frameID, texture});
+				}
+			}
 
 			// add duration to final frame for offset txcs
 			if (frameDatas.size() == 0 && frame.frameID != 0) {
@@ -89,34 +103,56 @@ TXCAnimation::TXCAnimation(Buffer& data, TexDictionary* txd) {
 			}
 		}
 
-		uint16_t lastIndex = replaceIdx;
-		for (int i = 0; i < animation.frameCount; i++) {
-			if (animation.frames[i].idx == 0) {
-				animation.frames[i].idx = lastIndex;
-			}
-			lastIndex = animation.frames[i].idx;
-		}
+		acquireFrames(animation);
+		value = data.read<u32>();
+	}
+
+	recalcMapping(txd);
+}
 
-		data.read(&value);
+TXCAnimation::~TXCAnimation() {
+	for (auto& animation : animations) {
+		releaseFrames(animation);
+	}
+}
+
+void TXCAnimation::acquireFrames(TXCAnimation::AnimatedTexture& animation) {
+	for (auto& frame : animation.frames) {
+		txd->acquire(frame.texture);
+	}
+}
+
+void TXCAnimation::releaseFrames(TXCAnimation::AnimatedTexture& animation) {
+	for (auto& frame : animation.frames) {
+		txd->release(frame.texture);
 	}
 }
 
 void TXCAnimation::setTime(float time) {
 	this->time = time;
+	resolveTextures();
 }
 
 const float FPS = 60.0f;
 
-bgfx::TextureHandle TXCAnimation::getTexture(bgfx::TextureHandle lookup) {
-	auto result = textureLookup.find(lookup.idx);
+TextureRef TXCAnimation::getTexture(TextureRef lookup) {
+	return lookup.idx < resolved.size() ? resolved[lookup.idx] : lookup;
+}
 
-	if (result == textureLookup.end()) {
-		return lookup;
-	} else {
-		auto& animation = animations[result->second];
+TextureRef TXCAnimation::getFrameTexture(TXCAnimation::AnimatedTexture& animation, int frame) {
+	// find last keyframe starting at or before frame
+	auto it = std::upper_bound(animation.frames.begin(), animation.frames.end(), frame,
+							   [](int frame, const Keyframe& key) { return frame < key.start; });
+	if (it == animation.frames.begin()) return {0};
+	return (it - 1)->texture;
+}
+
+void TXCAnimation::resolveTextures() {
+	for (auto& pair : textureLookup) {
+		if (pair.second >= animations.size()) continue; // mapping is stale until recalcMapping
+		auto& animation = animations[pair.second];
 		int animFrame = getCurrentFrameOffset(animation);
-		if (animFrame == -1) return {0};
-		else return animation.frames[animFrame];
+		resolved[pair.first] = animFrame == -1 ? TextureRef {0} : getFrameTexture(animation, animFrame);
 	}
 }
 
@@ -154,6 +190,7 @@ void TXCAnimation::drawUI(TexDictionary* txd) {
 	hint("Adds a new animation");
 	ImGui::SameLine();
 	if (ImGui::Button("delete")) {
+		releaseFrames(animations[listbox_sel]);
 		animations.erase(animations.begin() + listbox_sel);
 		if (listbox_sel >= animations.size()) listbox_sel--;
 		mappingModified = true;
@@ -226,7 +263,7 @@ void TXCAnimation::drawUI(TexDictionary* txd) {
 		};
 		BiggImTexture img;
 		img.s.flags = 0; // unused
-		img.s.handle = getTexture(txd->getTexture(animation.replaceTexture.c_str()));
+		img.s.handle = TexDictionary::resolve(getTexture(txd->getTexture(animation.replaceTexture.c_str())));
 		ImGui::Image(img.ptr, ImVec2(64, 64));
 
 		if (ImGui::InputText("name", name, 30)) {
@@ -313,7 +350,7 @@ void TXCAnimation::drawUI(TexDictionary* txd) {
 				ImGui::BeginTooltip();
 				BiggImTexture img;
 				img.s.flags = 0; // unused
-				img.s.handle = getTextureNumbered(txd, animation, frame.textureID);
+				img.s.handle = TexDictionary::resolve(getTextureNumbered(txd, animation, frame.textureID));
 				ImGui::Image(img.ptr, ImVec2(128,128), ImVec2(0,0), ImVec2(1,1), ImColor(255,255,255,255), ImColor(255,255,255,128));
 				ImGui::EndTooltip();
 			}
@@ -397,7 +434,7 @@ void TXCAnimation::drawUI(TexDictionary* txd) {
 	}
 }
 
-bgfx::TextureHandle TXCAnimation::getTextureNumbered(TexDictionary* txd, TXCAnimation::AnimatedTexture& anim, int number) {
+TextureRef TXCAnimation::getTextureNumbered(TexDictionary* txd, TXCAnimation::AnimatedTexture& anim, int number) {
 	char buffer[32];
 	strncpy(buffer, anim.name.c_str(), 32);
 	char* bufferEnd = buffer + strlen(buffer);
@@ -410,26 +447,23 @@ bgfx::TextureHandle TXCAnimation::getTextureNumbered(TexDictionary* txd, TXCAnim
 void TXCAnimation::recalcFrames(TXCAnimation::AnimatedTexture& animation, TexDictionary* txd) {
 	auto& frameDeltas = animation.frameDeltas;
 	auto& frames = animation.frames;
+	releaseFrames(animation);
+	frames.clear();
 
 	u32 i = 0;
 	for (auto& delta : frameDeltas) {
-		// expand to fit if necessary
-		if (i + delta.duration > frames.size()) {
-			frames.resize((u32) (i + delta.duration));
-		}
-		// set frame textures
-		for (int j = 0; j < delta.duration; j++) {
-			frames[i++] = getTextureNumbered(txd, animation, delta.textureID);
+		auto texture = getTextureNumbered(txd, animation, delta.textureID);
+		if (delta.duration) {
+			frames.push_back({(u16) i, texture});
+			i += delta.duration;
 		}
 		// check errors
-		delta.error = getTextureNumbered(txd, animation, delta.textureID).idx == 0; // test if texture in txd
-	}
-	// shrink if necessary
-	if (i != frames.size()) {
-		frames.resize(i);
+		delta.error = texture.idx == 0; // test if texture in txd
 	}
 
 	animation.frameCount = i;
+	acquireFrames(animation);
+	resolveTextures();
 }
 
 void TXCAnimation::recalcMapping(TexDictionary* txd) {
@@ -441,6 +475,14 @@ void TXCAnimation::recalcMapping(TexDictionary* txd) {
 		textureLookup.insert(std::make_pair(replaceIdx, i));
 		i++;
 	}
+
+	// identity for every handle up to the highest one replaced, so getTexture is a single lookup
+	u32 maxIdx = textureLookup.empty() ? 0 : textureLookup.rbegin()->first;
+	resolved.resize(maxIdx + 1);
+	for (u32 idx = 0; idx <= maxIdx; idx++) {
+		resolved[idx].idx = (uint16_t) idx;
+	}
+	resolveTextures();
 }
 
 int TXCAnimation::getCurrentFrameOffset(TXCAnimation::AnimatedTexture& animation) {
@@ -9,8 +9,10 @@
 
 class TXCAnimation {
 private:
-	float time;
+	float time = 0.0f;
 	int listbox_sel = 0;
+	std::vector<TextureRef> resolved; // current texture for each texture handle idx, updated by setTime
+	TexDictionary* txd; // frame textures are referenced while they are in use
 public:
 	struct FrameData {
 		u16 frameID;
@@ -23,11 +25,16 @@ public:
 		u16 textureID;
 		bool error;
 	};
+	// texture shown from start until the next keyframe
+	struct Keyframe {
+		u16 start;
+		TextureRef texture;
+	};
 	struct AnimatedTexture {
 		std::string name;
 		std::string replaceTexture;
 		u32 frameCount;
-		std::vector<bgfx::TextureHandle> frames; // optimized layout for lookups
+		std::vector<Keyframe> frames; // optimized layout for lookups, sorted by start
 		std::vector<FrameDeltaData> frameDeltas; // used for editing
 
 		// generator params
@@ -39,14 +46,19 @@ public:
 	std::map<u32, int> textureLookup;
 	std::vector<AnimatedTexture> animations;
 
-	TXCAnimation(Buffer& data, TexDictionary* txd);
+	TXCAnimation(Buffer& file, TexDictionary* txd);
+	~TXCAnimation();
 	void setTime(float time);
-	bgfx::TextureHandle getTexture(bgfx::TextureHandle lookup);
+	TextureRef getTexture(TextureRef lookup);
 
 	void drawUI(TexDictionary* txd);
 private:
-	bgfx::TextureHandle getTextureNumbered(TexDictionary* txd, AnimatedTexture& anim, int number);
+	TextureRef getTextureNumbered(TexDictionary* txd, AnimatedTexture& anim, int number);
 	void recalcFrames(AnimatedTexture& animation, TexDictionary* txd);
 	void recalcMapping(TexDictionary* txd);
 	int getCurrentFrameOffset(AnimatedTexture& animation);
+	TextureRef getFrameTexture(AnimatedTexture& animation, int frame);
+	void resolveTextures();
+	void acquireFrames(AnimatedTexture& animation);
+	void releaseFrames(AnimatedTexture& animation);
 };
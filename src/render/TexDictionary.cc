@@ -1,14 +1,258 @@
 #include "TexDictionary.hh"
+#include "util/config.hh"
+#include "util/parallel.hh"
+#include "util/transcode.hh"
+#include "util/bcencode.hh"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <list>
+#include <map>
+#include <mutex>
 
-TexDictionary::TexDictionary(rw::TextureDictionary* txdChunk) {
-	for (auto* texture : txdChunk->textures) {
-		// determine texture format
-		auto format = bgfx::TextureFormat::Unknown;
+// frames a texture with no users must go unused before it is purged
+static const u32 PURGE_DELAY_FRAMES = 300;
+// frames a texture must go unused before mips are dropped from it to fit the budget
+static const u32 SHRINK_DELAY_FRAMES = 60;
+
+// logical handle table shared by all dictionaries, slot 0 means no texture
+// only resized on the main thread, so resolve can read it without locking
+struct TextureSlot {
+	bgfx::TextureHandle actual;
+	u32 lastUsed;
+	TexDictionary* owner;
+	int entry;
+};
+static std::vector<TextureSlot> slots(1, TextureSlot {BGFX_INVALID_HANDLE, 0, nullptr, 0});
+static std::vector<u16> freeSlots;
+static std::mutex slotMutex; // guards slot allocation and reference counts
+static std::vector<TexDictionary*> dictionaries;
+static u32 currentFrame = 0;
+
+static u64 vramBudget;
+static bool compressTextures;
+static u64 encodeCacheBudget;
+static bool staticValuesLoaded = false;
+
+static void loadStaticValues() {
+	if (!staticValuesLoaded) {
+		vramBudget = (u64) config_geti("vram_budget_mb", 256) * 1024 * 1024;
+		compressTextures = config_geti("compress_textures", 0) != 0;
+		encodeCacheBudget = (u64) config_geti("compress_cache_mb", 64) * 1024 * 1024;
+		staticValuesLoaded = true;
+	}
+}
+
+// block compressed textures from this session, keyed by hash of their source pixels
+// so reloads and textures shared between TXDs are only encoded once
+// kept to compress_cache_mb, least recently used first out
+struct EncodedTexture {
+	bgfx::TextureFormat::Enum format;
+	std::vector<std::vector<u8>> mips;
+	u64 error;
+	u64 size;
+};
+struct EncodeCacheEntry {
+	std::shared_ptr<const EncodedTexture> texture;
+	std::list<u64>::iterator lruPosition;
+};
+static std::map<u64, EncodeCacheEntry> encodeCache;
+static std::list<u64> encodeCacheLRU; // most recently used first
+static u64 encodeCacheSize = 0;
+static std::mutex encodeCacheMutex;
+
+static std::shared_ptr<const EncodedTexture> findEncoded(u64 hash) {
+	std::lock_guard<std::mutex> lock(encodeCacheMutex);
+	auto it = encodeCache.find(hash);
+	if (it == encodeCache.end()) return nullptr;
+	encodeCacheLRU.splice(encodeCacheLRU.begin(), encodeCacheLRU, it->second.lruPosition);
+	return it->second.texture;
+}
+
+static void addEncoded(u64 hash, const std::shared_ptr<const EncodedTexture>& texture) {
+	std::lock_guard<std::mutex> lock(encodeCacheMutex);
+	if (encodeCache.count(hash) || texture->size > encodeCacheBudget) return;
+
+	// textures still being copied out keep their data through the shared_ptr
+	while (encodeCacheSize + texture->size > encodeCacheBudget) {
+		auto oldest = encodeCache.find(encodeCacheLRU.back());
+		encodeCacheSize -= oldest->second.texture->size;
+		encodeCache.erase(oldest);
+		encodeCacheLRU.pop_back();
+	}
+	encodeCacheLRU.push_front(hash);
+	encodeCache[hash] = EncodeCacheEntry {texture, encodeCacheLRU.begin()};
+	encodeCacheSize += texture->size;
+}
+
+static u16 allocSlot(TexDictionary* owner, int entry) {
+	std::lock_guard<std::mutex> lock(slotMutex);
+	u16 idx;
+	if (freeSlots.empty()) {
+		idx = (u16) slots.size();
+		slots.emplace_back();
+	} else {
+		idx = freeSlots.back();
+		freeSlots.pop_back();
+	}
+	slots[idx] = TextureSlot {BGFX_INVALID_HANDLE, currentFrame, owner, entry};
+	return idx;
+}
+
+static void freeSlot(u16 idx) {
+	std::lock_guard<std::mutex> lock(slotMutex);
+	slots[idx].owner = nullptr;
+	freeSlots.push_back(idx);
+}
+
+// release callback for mip data handed over to bgfx
+static void releaseMipData(void* ptr, void* userData) {
+	delete[] (u8*) ptr;
+}
+
+// take mip data out of chunk, so bgfx can own it without a copy
+template <typename Mipmap>
+static const bgfx::Memory* takeMip(Mipmap& mipmap) {
+	auto mem = bgfx::makeRef(mipmap.data, mipmap.size, releaseMipData);
+	mipmap.data = nullptr;
+	mipmap.size = 0;
+	return mem;
+}
+
+// pack mips from first onwards into one block, freeing each source mip as soon as it has been copied
+template <typename Mipmaps>
+static const bgfx::Memory* packMips(Mipmaps& mipmaps, int first, u32 totalSize) {
+	auto mem = bgfx::alloc(totalSize);
+	u32 offset = 0;
+	for (int i = first; i < (int) mipmaps.size(); i++) {
+		auto& mipmap = mipmaps[i];
+		memcpy(mem->data + offset, mipmap.data, mipmap.size);
+		offset += mipmap.size;
+		delete[] mipmap.data;
+		mipmap.data = nullptr;
+		mipmap.size = 0;
+	}
+	return mem;
+}
+
+// replace each mip of texture with its BGRA8 conversion, returns false if mip sizes don't match the format
+template <typename Texture>
+static bool transcodeMips(Texture* texture) {
+	const int inSize = transcodeInputSize(texture->format);
+	u32 mipWidth = texture->width;
+	u32 mipHeight = texture->height;
+	for (auto& mipmap : texture->mipmaps) {
+		const u32 count = mipWidth * mipHeight;
+		if (mipmap.size != count * inSize) return false;
+
+		u8* converted = new u8[count * 4];
+		transcodeToBGRA8(texture->format, mipmap.data, converted, count);
+		delete[] mipmap.data;
+		mipmap.data = converted;
+		mipmap.size = count * 4;
+
+		// move to next mipmap
+		if (mipWidth > 1) mipWidth >>= 1;
+		if (mipHeight > 1) mipHeight >>= 1;
+	}
+	return true;
+}
+
+// FNV-1a hash of texture size and pixels
+template <typename Texture>
+static u64 hashTexture(Texture* texture) {
+	u64 hash = 0xcbf29ce484222325ull;
+	auto mix = [&](const u8* data, u32 size) {
+		for (u32 i = 0; i < size; i++) {
+			hash = (hash ^ data[i]) * 0x100000001b3ull;
+		}
+	};
+	u16 dims[2] = {texture->width, texture->height};
+	mix((const u8*) dims, sizeof(dims));
+	for (auto& mipmap : texture->mipmaps) mix(mipmap.data, mipmap.size);
+	return hash;
+}
+
+// replace BGRA8 mips of texture with BC1 (if opaque) or BC3 encoded data, returns false if mip sizes are unexpected
+template <typename Texture>
+static bool compressMips(Texture* texture, bgfx::TextureFormat::Enum& format, u64& error, bool& cached) {
+	u32 mipWidth = texture->width;
+	u32 mipHeight = texture->height;
+	for (auto& mipmap : texture->mipmaps) {
+		if (mipmap.size != mipWidth * mipHeight * 4) return false;
+		if (mipWidth > 1) mipWidth >>= 1;
+		if (mipHeight > 1) mipHeight >>= 1;
+	}
+
+	const u64 hash = hashTexture(texture);
+	std::shared_ptr<const EncodedTexture> encoded = findEncoded(hash);
+	cached = (bool) encoded;
+
+	if (!encoded) {
+		// alpha is only needed if some texel isn't fully opaque
+		const auto& top = texture->mipmaps[0];
+		bool alpha = false;
+		for (u32 i = 3; i < top.size && !alpha; i += 4) alpha = top.data[i] != 0xff;
+
+		auto result = std::make_shared<EncodedTexture>();
+		result->format = alpha ? bgfx::TextureFormat::BC3 : bgfx::TextureFormat::BC1;
+		result->error = 0;
+		result->size = 0;
+		mipWidth = texture->width;
+		mipHeight = texture->height;
+		for (auto& mipmap : texture->mipmaps) {
+			result->mips.emplace_back(bcEncodedSize(mipWidth, mipHeight, alpha));
+			result->error += bcEncode(mipmap.data, mipWidth, mipHeight, alpha, &result->mips.back()[0]);
+			result->size += result->mips.back().size();
+			if (mipWidth > 1) mipWidth >>= 1;
+			if (mipHeight > 1) mipHeight >>= 1;
+		}
+
+		addEncoded(hash, result);
+		encoded = result;
+	}
+
+	// mip data is freed with delete[] once bgfx is done with it, so copy out of the cache
+	for (size_t i = 0; i < texture->mipmaps.size(); i++) {
+		auto& mipmap = texture->mipmaps[i];
+		auto& data = encoded->mips[i];
+		delete[] mipmap.data;
+		mipmap.data = new u8[data.size()];
+		mipmap.size = (u32) data.size();
+		memcpy(mipmap.data, &data[0], data.size());
+	}
+	format = encoded->format;
+	error = encoded->error;
+	return true;
+}
+
+// determine bgfx format of each wanted texture (all if wanted is null), converting those bgfx can't sample
+static void prepareTextures(rw::TextureDictionary* txdChunk, const std::vector<char>* wanted,
+							std::vector<bgfx::TextureFormat::Enum>& formats) {
+	const int textureCount = (int) txdChunk->textures.size();
+	formats.assign(textureCount, bgfx::TextureFormat::Unknown);
+	std::vector<int> transcodeList;
+	for (int i = 0; i < textureCount; i++) {
+		if (wanted && !(*wanted)[i]) continue;
+		auto* texture = txdChunk->textures[i];
+		auto& format = formats[i];
 		if (texture->compression) {
 			switch (texture->compression) {
 				case 1: format = bgfx::TextureFormat::BC1; break; // DXT1
+				case 3: format = bgfx::TextureFormat::BC2; break; // DXT3
+				case 5: format = bgfx::TextureFormat::BC3; break; // DXT5
 				default: rw::util::logger.warn("Compression type %d unsupported", texture->compression);
 			}
+		} else if (texture->format & (rw::TextureRasterFormat::RASTER_PAL8 | rw::TextureRasterFormat::RASTER_PAL4)) {
+			// palette isn't available from the chunk, so only accept textures that were already expanded
+			if (!texture->mipmaps.empty() && texture->mipmaps[0].size == (u32) texture->width * texture->height * 4) {
+				format = bgfx::TextureFormat::BGRA8;
+			} else {
+				rw::util::logger.warn("Palettized texture %s unsupported", texture->name.c_str());
+			}
+		} else if (transcodeInputSize(texture->format)) {
+			format = bgfx::TextureFormat::BGRA8;
+			transcodeList.push_back(i);
 		} else {
 			switch (texture->format & 0x0f00) {
 				case rw::TextureRasterFormat::RASTER_C8888:
@@ -24,80 +268,353 @@ TexDictionary::TexDictionary(rw::TextureDictionary* txdChunk) {
 				}
 			}
 		}
+	}
+
+	// convert 16 bit and luminance textures to BGRA8 across worker threads
+	std::vector<char> transcodeOk(transcodeList.size());
+	parallel_for((int) transcodeList.size(), [&](int i) {
+		transcodeOk[i] = transcodeMips(txdChunk->textures[transcodeList[i]]);
+	});
+	for (size_t i = 0; i < transcodeList.size(); i++) {
+		if (!transcodeOk[i]) {
+			auto* texture = txdChunk->textures[transcodeList[i]];
+			rw::util::logger.warn("Texture %s has unexpected mip sizes for its format", texture->name.c_str());
+			formats[transcodeList[i]] = bgfx::TextureFormat::Unknown;
+		}
+	}
+
+	// optionally block compress all uncompressed textures
+	loadStaticValues();
+	if (!compressTextures) return;
+
+	std::vector<int> compressList;
+	for (int i = 0; i < textureCount; i++) {
+		if (formats[i] == bgfx::TextureFormat::BGRA8) compressList.push_back(i);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<bgfx::TextureFormat::Enum> compressFormats(compressList.size());
+	std::vector<u64> compressError(compressList.size());
+	std::vector<char> compressCached(compressList.size());
+	std::vector<char> compressOk(compressList.size());
+	parallel_for((int) compressList.size(), [&](int i) {
+		bool cached;
+		compressOk[i] = compressMips(txdChunk->textures[compressList[i]], compressFormats[i], compressError[i], cached);
+		compressCached[i] = cached;
+	});
+	auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	// report speed and quality (rmse per 8 bit channel over all mips)
+	int encodedCount = 0, cachedCount = 0;
+	u64 totalError = 0, totalTexels = 0;
+	for (size_t i = 0; i < compressList.size(); i++) {
+		if (!compressOk[i]) continue;
+		formats[compressList[i]] = compressFormats[i];
+		if (compressCached[i]) cachedCount++;
+		else encodedCount++;
+		totalError += compressError[i];
+		for (auto& mipmap : txdChunk->textures[compressList[i]]->mipmaps) {
+			totalTexels += mipmap.size * (compressFormats[i] == bgfx::TextureFormat::BC1 ? 2 : 1);
+		}
+	}
+	if (encodedCount || cachedCount) {
+		log_info("compressed %d textures (%d from cache) in %.1f ms, rmse %.2f", encodedCount + cachedCount, cachedCount,
+				 elapsed, totalTexels ? sqrt(totalError / (double) (totalTexels * 4)) : 0.0);
+	}
+}
+
+TexDictionary::TexDictionary(rw::TextureDictionary* txdChunk) : reloadDone(false) {
+	load(txdChunk);
+	dictionaries.push_back(this);
+}
 
-		// if unsupported format set to error texture
-		if (format == bgfx::TextureFormat::Unknown) {
-			TextureEntry e;
-			e.handle = bgfx::TextureHandle();
-			e.name = texture->name;
-			e.width = texture->width;
-			e.height = texture->height;
-			textures.push_back(e);
+TexDictionary::TexDictionary(FSPath path) : sourcePath(path.str), reloadDone(false) {
+	Buffer data = path.read();
+	rw::Chunk* root = rw::readChunk(data);
+	load((rw::TextureDictionary*) root);
+	delete root;
+	dictionaries.push_back(this);
+}
+
+void TexDictionary::load(rw::TextureDictionary* txdChunk) {
+	std::vector<bgfx::TextureFormat::Enum> formats;
+	prepareTextures(txdChunk, nullptr, formats);
+
+	const int textureCount = (int) txdChunk->textures.size();
+	textures.resize(textureCount);
+	for (int i = 0; i < textureCount; i++) {
+		auto* texture = txdChunk->textures[i];
+		auto& entry = textures[i];
+		entry.name = texture->name;
+		entry.width = texture->width;
+		entry.height = texture->height;
+		entry.mipCount = (int) texture->mipmaps.size();
+		entry.format = formats[i];
+
+		// unsupported formats get no logical handle, same as missing textures
+		if (entry.format == bgfx::TextureFormat::Unknown) {
+			entry.handle.idx = 0;
 			continue;
 		}
 
-		// create empty texture
-		auto bgfxTexHandle = bgfx::createTexture2D(
-				texture->width, texture->height, texture->mipmaps.size() > 1, 1, format, 0,
-				nullptr
-		);
+		entry.handle.idx = allocSlot(this, i);
+		upload(entry, txdChunk, i, entry.format);
+	}
+}
+
+void TexDictionary::upload(TextureEntry& entry, rw::TextureDictionary* txdChunk, int index,
+						   bgfx::TextureFormat::Enum format) {
+	auto* texture = txdChunk->textures[index];
+	auto& mipmaps = texture->mipmaps;
+	const int mipCount = (int) mipmaps.size();
+	if (!mipCount) return;
+
+	// leave out top mips if the budget wants them dropped
+	const int skip = std::max(0, std::min(entry.targetDroppedMips, mipCount - 1));
+	const u16 width = (u16) std::max(1, texture->width >> skip);
+	const u16 height = (u16) std::max(1, texture->height >> skip);
+	const bool hasMips = mipCount - skip > 1;
+
+	// upload texture, passing mip data on to bgfx rather than copying it where possible
+	bgfx::TextureInfo info;
+	bgfx::calcTextureSize(info, width, height, 1, false, hasMips, 1, format);
+
+	u32 totalSize = 0;
+	for (int i = skip; i < mipCount; i++) totalSize += mipmaps[i].size;
+
+	bgfx::TextureHandle bgfxTexHandle;
+	if (!hasMips && totalSize == info.storageSize) {
+		bgfxTexHandle = bgfx::createTexture2D(width, height, false, 1, format, 0, takeMip(mipmaps[skip]));
+	} else if (hasMips && totalSize == info.storageSize) {
+		// bgfx expects the whole chain in one block
+		bgfxTexHandle = bgfx::createTexture2D(width, height, true, 1, format, 0, packMips(mipmaps, skip, totalSize));
+	} else {
+		// partial mip chain, create empty texture and set mips individually
+		bgfxTexHandle = bgfx::createTexture2D(width, height, hasMips, 1, format, 0, nullptr);
 
-		// set mips
 		u8 mip = 0;
-		u16 mipWidth = texture->width;
-		u16 mipHeight = texture->height;
-		for (auto& mipmap : texture->mipmaps) {
-			// copy texture mip data, bgfx will clear it
-			auto size = texture->mipmaps[mip].size;
-			auto mem = bgfx::alloc(size);
-			memcpy(mem->data, texture->mipmaps[mip].data, size);
-			bgfx::updateTexture2D(bgfxTexHandle, 0, mip, 0, 0, mipWidth, mipHeight, mem);
+		u16 mipWidth = width;
+		u16 mipHeight = height;
+		for (int i = skip; i < mipCount; i++) {
+			bgfx::updateTexture2D(bgfxTexHandle, 0, mip, 0, 0, mipWidth, mipHeight, takeMip(mipmaps[i]));
 
 			// move to next mipmap
 			mip++;
 			mipWidth >>= 1;
 			mipHeight >>= 1;
 		}
-
-		TextureEntry e; // todo: make constructor and use emplace_back
-		e.handle = bgfxTexHandle;
-		e.name = texture->name;
-		e.width = texture->width;
-		e.height = texture->height;
-		textures.push_back(e);
 	}
+
+	entry.resident = true;
+	entry.droppedMips = skip;
+	entry.vramSize = info.storageSize;
+	slots[entry.handle.idx].actual = bgfxTexHandle;
+}
+
+void TexDictionary::unload(TextureEntry& entry) {
+	if (!entry.resident) return;
+	auto& slot = slots[entry.handle.idx];
+	bgfx::destroy(slot.actual);
+	slot.actual = BGFX_INVALID_HANDLE;
+	entry.resident = false;
+	entry.vramSize = 0;
 }
 
 TexDictionary::~TexDictionary() {
+	if (reloadThread.joinable()) reloadThread.join();
+	delete reloadChunk;
+
 	for (auto& texture : textures) {
-		bgfx::destroy(texture.handle);
+		if (!texture.handle.idx) continue;
+		unload(texture);
+		freeSlot(texture.handle.idx);
 	}
+	dictionaries.erase(std::remove(dictionaries.begin(), dictionaries.end(), this), dictionaries.end());
 }
 
-bgfx::TextureHandle TexDictionary::getTexture(const char* name) {
+TextureRef TexDictionary::getTexture(const char* name) {
 	std::string nameStr(name);
 	for (auto& tex : textures) {
 		if (tex.name == nameStr) {
 			return tex.handle;
 		}
 	}
-	return bgfx::TextureHandle();
+	return TextureRef {0};
+}
+
+void TexDictionary::acquire(TextureRef handle) {
+	if (!handle.idx) return;
+	std::lock_guard<std::mutex> lock(slotMutex);
+	auto& slot = slots[handle.idx];
+	if (slot.owner == this) textures[slot.entry].refs++;
+}
+
+void TexDictionary::release(TextureRef handle) {
+	if (!handle.idx) return;
+	std::lock_guard<std::mutex> lock(slotMutex);
+	auto& slot = slots[handle.idx];
+	if (slot.owner == this) textures[slot.entry].refs--;
+}
+
+bgfx::TextureHandle TexDictionary::resolve(TextureRef handle) {
+	if (handle.idx >= slots.size()) return BGFX_INVALID_HANDLE;
+	auto& slot = slots[handle.idx];
+	slot.lastUsed = currentFrame;
+	return slot.actual;
+}
+
+bool TexDictionary::needsReload(const TextureEntry& entry) {
+	if (!entry.handle.idx) return false;
+	const bool wanted = entry.refs > 0 || currentFrame - slots[entry.handle.idx].lastUsed < PURGE_DELAY_FRAMES;
+	return wanted && (!entry.resident || entry.droppedMips != entry.targetDroppedMips);
+}
+
+void TexDictionary::startReload() {
+	// called with slotMutex held, so the set of wanted textures can be read here
+	reloadWanted.assign(textures.size(), 0);
+	for (size_t i = 0; i < textures.size(); i++) reloadWanted[i] = needsReload(textures[i]);
+
+	reloading = true;
+	reloadDone = false;
+	reloadThread = std::thread([this]() {
+		// read, parse and convert off the main thread, leaving only the upload for finishReload
+		FSPath path(sourcePath);
+		Buffer data = path.read();
+		auto chunk = data.size() ? (rw::TextureDictionary*) rw::readChunk(data) : nullptr;
+		if (chunk) {
+			// names are never changed after load, so they can be compared from this thread
+			for (size_t i = 0; i < reloadWanted.size(); i++) {
+				reloadWanted[i] = reloadWanted[i] && i < chunk->textures.size() &&
+								  chunk->textures[i]->name == textures[i].name;
+			}
+			reloadWanted.resize(chunk->textures.size());
+			prepareTextures(chunk, &reloadWanted, reloadFormats);
+		}
+		reloadChunk = chunk;
+		reloadDone = true;
+	});
+}
+
+void TexDictionary::finishReload() {
+	reloadThread.join();
+	reloading = false;
+
+	if (!reloadChunk) {
+		// keep what is resident, and don't re-read the file every frame while it stays unreadable
+		log_warn("Couldn't read %s to stream textures in", sourcePath.c_str());
+		reloadRetryFrame = currentFrame + PURGE_DELAY_FRAMES;
+		return;
+	}
+
+	for (size_t i = 0; i < reloadWanted.size(); i++) {
+		if (!reloadWanted[i] || reloadFormats[i] != textures[i].format) continue;
+		unload(textures[i]);
+		upload(textures[i], reloadChunk, (int) i, reloadFormats[i]);
+	}
+
+	delete reloadChunk;
+	reloadChunk = nullptr;
+}
+
+void TexDictionary::update(u32 frame, u64& vramUsed) {
+	if (reloading && reloadDone) finishReload();
+
+	bool wantReload = false;
+	std::lock_guard<std::mutex> lock(slotMutex);
+	for (auto& entry : textures) {
+		if (!entry.handle.idx) continue;
+
+		// purge textures nothing has used for a while, if they can be read again later
+		if (!sourcePath.empty() && entry.resident && entry.refs <= 0 && frame - slots[entry.handle.idx].lastUsed > PURGE_DELAY_FRAMES) {
+			unload(entry);
+		}
+		vramUsed += entry.vramSize;
+		if (needsReload(entry)) wantReload = true;
+	}
+
+	if (wantReload && !reloading && !sourcePath.empty() && (i32) (frame - reloadRetryFrame) >= 0) startReload();
+}
+
+void TexDictionary::updateAll() {
+	loadStaticValues();
+	currentFrame++;
+
+	u64 vramUsed = 0;
+	for (auto txd : dictionaries) {
+		txd->update(currentFrame, vramUsed);
+	}
+	if (!vramBudget) return;
+
+	// order resident textures from least to most recently used, skipping those that couldn't be restored
+	std::vector<std::pair<u32, TextureEntry*>> resident;
+	for (auto txd : dictionaries) {
+		if (txd->sourcePath.empty()) continue;
+		for (auto& entry : txd->textures) {
+			if (entry.resident) resident.push_back(std::make_pair(slots[entry.handle.idx].lastUsed, &entry));
+		}
+	}
+	std::sort(resident.begin(), resident.end(),
+			  [](const std::pair<u32, TextureEntry*>& a, const std::pair<u32, TextureEntry*>& b) { return a.first < b.first; });
+
+	if (vramUsed > vramBudget) {
+		// over budget, drop a top mip from stale textures, each of which saves about 3/4 of its size
+		for (auto& pair : resident) {
+			if (vramUsed <= vramBudget || currentFrame - pair.first < SHRINK_DELAY_FRAMES) break;
+			auto& entry = *pair.second;
+			if (entry.targetDroppedMips != entry.droppedMips || entry.targetDroppedMips >= entry.mipCount - 1) continue;
+			entry.targetDroppedMips++;
+			vramUsed -= entry.vramSize * 3 / 4;
+		}
+	} else {
+		// stream full resolution back in for shrunk textures that are being used again, if they fit
+		const u64 headroom = vramBudget - vramBudget / 8;
+		for (auto it = resident.rbegin(); it != resident.rend(); ++it) {
+			if (currentFrame - it->first >= SHRINK_DELAY_FRAMES) break;
+			auto& entry = *it->second;
+			if (!entry.targetDroppedMips || entry.targetDroppedMips != entry.droppedMips) continue;
+			const u64 growth = ((u64) entry.vramSize << (2 * entry.droppedMips)) - entry.vramSize;
+			if (vramUsed + growth > headroom) continue;
+			entry.targetDroppedMips = 0;
+			vramUsed += growth;
+		}
+	}
 }
 
 void TexDictionary::drawUI() {
+	// residency summary
+	u64 vramUsed = 0;
+	int residentCount = 0;
+	for (auto& tex : textures) {
+		vramUsed += tex.vramSize;
+		if (tex.resident) residentCount++;
+	}
+	ImGui::Text("%d / %d textures resident, %.1f MB", residentCount, (int) textures.size(), vramUsed / (1024.0f * 1024.0f));
+	loadStaticValues();
+	if (vramBudget) ImGui::Text("Budget %.0f MB for all TXDs", vramBudget / (1024.0f * 1024.0f));
+	if (reloading) ImGui::Text("Streaming textures...");
+
+	if (textures.empty()) return;
+
 	std::vector<const char*> listbox_items;
 	for (auto& tex : textures) {
 		listbox_items.push_back(tex.name.c_str());
 	}
 
 	static int listbox_item_current = 0;
+	if (listbox_item_current >= (int) textures.size()) listbox_item_current = 0;
 	ImGui::ListBox("listbox\n(single select)", &listbox_item_current, &listbox_items[0], listbox_items.size(), 6);
 
 	auto& current = textures[listbox_item_current];
 	union BiggImTexture { ImTextureID ptr; struct { uint16_t flags; bgfx::TextureHandle handle; } s; };
 	BiggImTexture img;
 	img.s.flags = 0; // unused
-	img.s.handle = current.handle;
-	ImGui::Image(img.ptr, ImVec2(current.width, current.height));
+	img.s.handle = resolve(current.handle); // also requests it be streamed back in if purged
+	if (current.resident) {
+		ImGui::Image(img.ptr, ImVec2(current.width, current.height));
+	}
 	ImGui::LabelText("handle", "%d", current.handle.idx);
+	ImGui::LabelText("users", "%d", current.refs);
+	ImGui::LabelText("resident", "%s", current.resident ? "yes" : "no");
+	ImGui::LabelText("mips dropped", "%d / %d", current.droppedMips, current.mipCount);
+	ImGui::LabelText("vram", "%.1f KB", current.vramSize / 1024.0f);
 }
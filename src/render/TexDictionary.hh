@@ -1,26 +1,78 @@
 // Represents a RenderWare TXD file
+// Textures are given out as logical handles, which stay valid while the bgfx texture behind them is purged,
+// streamed back in, or recreated with fewer mips to fit the vram budget
 
 #pragma once
 
 #include "common.hh"
 #include "texture.hh"
+#include "util/fspath.hh"
 #include <bigg.hpp>
+#include <atomic>
+#include <thread>
+
+/// logical texture handle, turned into the bgfx texture currently behind it by TexDictionary::resolve
+/// kept distinct from bgfx::TextureHandle so one can't be bound in place of the other
+struct TextureRef {
+	u16 idx; // 0 for no texture
+};
 
 class TexDictionary {
 	struct TextureEntry {
-		bgfx::TextureHandle handle;
+		TextureRef handle; // idx 0 if format is unsupported
 		std::string name;
 		int width, height;
+		int mipCount;
+		bgfx::TextureFormat::Enum format;
+		int refs = 0; // materials and animations using this texture
+		bool resident = false;
+		int droppedMips = 0; // top mips left out of the uploaded texture
+		int targetDroppedMips = 0; // droppedMips wanted by the budget, applied on next reload
+		u32 vramSize = 0;
 	};
 	std::vector<TextureEntry> textures;
 	int listbox_item_current = 0;
+
+	// source for streaming textures back in, empty if constructed from a chunk
+	std::string sourcePath;
+	std::thread reloadThread;
+	std::atomic<bool> reloadDone;
+	bool reloading = false;
+	u32 reloadRetryFrame = 0; // after a failed reload, don't try again before this frame
+	// written by the reload thread, read once reloadDone is set
+	rw::TextureDictionary* reloadChunk = nullptr; // null if the file couldn't be read
+	std::vector<char> reloadWanted; // textures to upload, already converted to reloadFormats
+	std::vector<bgfx::TextureFormat::Enum> reloadFormats;
+
+	void load(rw::TextureDictionary* txdChunk);
+	void upload(TextureEntry& entry, rw::TextureDictionary* txdChunk, int index, bgfx::TextureFormat::Enum format);
+	void unload(TextureEntry& entry);
+	bool needsReload(const TextureEntry& entry);
+	void startReload();
+	void finishReload();
+	void update(u32 frame, u64& vramUsed);
 public:
 	/// load textures from rw::TextureDictionary chunk
+	/// mip data is moved out of the chunk and handed to bgfx, leaving the chunk's mipmaps empty
 	TexDictionary(rw::TextureDictionary* txdChunk);
+	/// load textures from a .txd file, which is read again when purged textures are needed
+	TexDictionary(FSPath path);
 	/// frees resources
 	~TexDictionary();
 
-	bgfx::TextureHandle getTexture(const char* name);
+	/// returns logical handle of texture, or idx 0 if not found
+	TextureRef getTexture(const char* name);
+
+	/// count a user of texture, so it isn't purged (safe to call from any thread)
+	void acquire(TextureRef handle);
+	void release(TextureRef handle);
+
+	/// get bgfx texture currently behind logical handle, marking it as used this frame
+	/// returns an invalid handle if the texture is not resident
+	static bgfx::TextureHandle resolve(TextureRef handle);
+
+	/// purge unused textures and fit all dictionaries to the vram budget, call once per frame
+	static void updateAll();
 
 	void drawUI();
 };
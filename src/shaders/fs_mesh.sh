@@ -0,0 +1,26 @@
+// Shared fragment shader body for bsp and dff meshes
+// Each fs_mesh*.sc variant defines which features are compiled in:
+//   MESH_TEXTURED    - multiply by s_texture
+//   MESH_PUNCH_ALPHA - discard fragments below the punch-through alpha threshold
+//   MESH_FLAT        - output the material color only (pick colors, and dff materials with zero alpha)
+
+#include <bgfx_shader.sh>
+
+#ifdef MESH_TEXTURED
+SAMPLER2D(s_texture, 0);
+#endif
+uniform vec4 u_materialColor;
+
+void main()
+{
+#if defined(MESH_FLAT)
+	gl_FragColor = vec4(u_materialColor.r, u_materialColor.g, u_materialColor.b, 1.0f);
+#elif defined(MESH_TEXTURED)
+	gl_FragColor = v_color0 * u_materialColor * texture2D(s_texture, v_texcoord0);
+#else
+	gl_FragColor = v_color0 * u_materialColor;
+#endif
+#ifdef MESH_PUNCH_ALPHA
+	if (gl_FragColor.a < 0.75f) discard;
+#endif
+}
@@ -0,0 +1,5 @@
+$input v_color0, v_texcoord0
+
+#define MESH_FLAT
+
+#include "fs_mesh.sh"
@@ -0,0 +1,6 @@
+$input v_color0, v_texcoord0
+
+#define MESH_TEXTURED
+#define MESH_PUNCH_ALPHA
+
+#include "fs_mesh.sh"
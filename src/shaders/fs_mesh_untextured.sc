@@ -0,0 +1,3 @@
+$input v_color0, v_texcoord0
+
+#include "fs_mesh.sh"
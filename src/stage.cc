@@ -2,25 +2,47 @@
 #include "stage.hh"
 #include <../extern/bigg/deps/bgfx.cmake/bgfx/examples/common/debugdraw/debugdraw.h>
 #include "render/Camera.hh"
+#include "util/config.hh"
+#include "util/BigEndian.hh"
+#include "util/ByteReader.hh"
+#include "render/DrawScript.hh"
+#include <algorithm>
+#include <chrono>
 
 Stage::~Stage() {
 	models.clear();
 
+	if (cache) {
+		if (layout_db) layout_db->releaseCaches(cache);
+		if (layout_pb) layout_pb->releaseCaches(cache);
+		if (layout_p1) layout_p1->releaseCaches(cache);
+	}
 	if (layout_db) delete layout_db;
 	if (layout_pb) delete layout_pb;
 	if (layout_p1) delete layout_p1;
 	if (cache) delete cache;
-	delete objdb;
 }
 
 void Stage::fromArchive(ONEArchive* archive, TexDictionary* txd) { // todo: unique_ptr?
 	int count = archive->getFileCount();
+	double decodeMs = 0.0;
+	auto start = std::chrono::steady_clock::now();
 	for (int i = 0; i < count; i++) {
 		models.emplace_back();
 
 		const auto bspName = archive->getFileName(i);
 		log_info("opening file %s", bspName);
+		auto decodeStart = std::chrono::steady_clock::now();
 		auto x = archive->readFile(i);
+		decodeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - decodeStart).count();
+
+		// read geometry in place when possible, rather than through a full chunk tree
+		const u8* data = (const u8*) x.base_ptr();
+		RWChunkView world;
+		bool viewed = RWChunkView::read(data, data + x.size(), world) &&
+					  models.back().setFromWorldView(bspName, world, txd, loadArena);
+		loadArena.reset();
+		if (viewed) continue;
 
 		sk::Buffer sk_x(x.base_ptr(), x.size(), false); // convert buffer utility classes
 		rw::Chunk* root = rw::readChunk(sk_x);
@@ -32,6 +54,9 @@ void Stage::fromArchive(ONEArchive* archive, TexDictionary* txd) { // todo: uniq
 
 		delete root;
 	}
+
+	auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	log_info("Loaded %d BSP files in %.1f ms (%.1f ms decompressing)", count, elapsed, decodeMs);
 }
 
 void Stage::readVisibility(FSPath& blkFile) {
@@ -45,22 +70,20 @@ static int obSel = 0;
 
 Camera* getCamera();
 
-void Stage::draw(glm::vec3 camPos, TXCAnimation* txc, bool picking) {
+void Stage::draw(glm::vec3 camPos, TXCAnimation* txc) {
+	if (cache && cache->update()) pickDirty = true;
+
 	for (auto& model : models) {
 		if (visibilityManager.isVisible(model.getId(), camPos)) {
 			model.draw(txc);
 		}
 	}
 
-	if (layout_db) layout_db->draw(camPos, cache, objdb, 0);
-	if (layout_pb) layout_pb->draw(camPos, cache, objdb, 0);
-	if (layout_p1) layout_p1->draw(camPos, cache, objdb, 0);
-
-	if (picking) {
-		if (layout_db) layout_db->draw(camPos, cache, objdb, 1);
-		if (layout_pb) layout_pb->draw(camPos, cache, objdb, 2);
-		if (layout_p1) layout_p1->draw(camPos, cache, objdb, 3);
-	}
+	if (objdb->pollReload(reloadedTypes)) reloadObjectTypes(reloadedTypes);
+	if (cache) rebuildObjectCaches(camPos);
+	if (layout_db) layout_db->draw(camPos);
+	if (layout_pb) layout_pb->draw(camPos);
+	if (layout_p1) layout_p1->draw(camPos);
 
 	ObjectLayout::ObjectInstance* ob = nullptr;
 	if (listSel == 1) {
@@ -125,23 +148,121 @@ void Stage::drawDebug(glm::vec3 camPos) {
 	visibilityManager.drawDebug(camPos);
 }
 
+void Stage::updatePickBVH() {
+	ObjectLayout* layouts[] = {layout_db, layout_pb, layout_p1};
+
+	for (auto layout : layouts) {
+		if (layout && layout->boundsDirty) {
+			layout->boundsDirty = false;
+			pickDirty = true;
+		}
+	}
+
+	// rebuild hierarchy over all objects; ids are packed as (list << 16) | index like the gpu pick colors
+	if (pickDirty) {
+		std::vector<BVH::Item> items;
+		for (int i = 0; i < 3; i++) {
+			if (!layouts[i]) continue;
+			const int count = layouts[i]->getObjectCount();
+			for (int j = 0; j < count; j++) {
+				BVH::Item item;
+				layouts[i]->getObjectBounds(j, item.low, item.high);
+				item.id = ((i + 1) << 16) | j;
+				items.push_back(item);
+			}
+		}
+		pickBVH.build(move(items));
+		pickDirty = false;
+	}
+}
+
+bool Stage::pick(const Ray& ray, glm::vec3 camPos, int& list, int& index) {
+	ObjectLayout* layouts[] = {layout_db, layout_pb, layout_p1};
+	updatePickBVH();
+
+	int hit = pickBVH.raycast(ray, [&](int id, float& t) {
+		auto layout = layouts[(id >> 16) - 1];
+		return layout->intersectObject(id & 0xffff, ray, camPos, t);
+	});
+	if (hit == -1) return false;
+
+	list = hit >> 16;
+	index = hit & 0xffff;
+	return true;
+}
+
+void Stage::drawPicking(const Ray& ray, glm::vec3 camPos) {
+	ObjectLayout* layouts[] = {layout_db, layout_pb, layout_p1};
+	updatePickBVH();
+
+	// only objects along the ray can cover the center of the pick view
+	std::vector<int> ids;
+	pickBVH.collect(ray, ids);
+	for (int id : ids) {
+		layouts[(id >> 16) - 1]->drawPicking(id & 0xffff, camPos, id >> 16);
+	}
+}
+
+void Stage::drawCacheUI() {
+	if (cache) cache->drawUI();
+	else ImGui::TextColored(ImVec4(1.0f, 0.25f, 0.0f, 1.0f), "No DFF cache is loaded");
+}
+
 void Stage::readLayout(const char* dvdroot, const char* stgname) {
 	char buffer[512];
 
 	sprintf(buffer, "%s/%s_DB.bin", dvdroot, stgname);
 	FSPath path_db(buffer);
 	layout_db = new ObjectLayout();
-	layout_db->read(path_db);
+	layout_db->read(path_db, loadArena);
+	loadArena.reset();
 
 	sprintf(buffer, "%s/%s_PB.bin", dvdroot, stgname);
 	FSPath path_pb(buffer);
 	layout_pb = new ObjectLayout();
-	layout_pb->read(path_pb);
+	layout_pb->read(path_pb, loadArena);
+	loadArena.reset();
 
 	sprintf(buffer, "%s/%s_P1.bin", dvdroot, stgname);
 	FSPath path_p1(buffer);
 	layout_p1 = new ObjectLayout();
-	layout_p1->read(path_p1);
+	layout_p1->read(path_p1, loadArena);
+	loadArena.reset();
+	log_info("Stage load scratch peak %.1f KB (%.1f KB reserved)", loadArena.getPeak() / 1024.0,
+			 loadArena.getCapacity() / 1024.0);
+
+	// build object caches now rather than stalling the first frame that draws them
+	if (cache) {
+		auto start = std::chrono::steady_clock::now();
+		layout_db->buildCaches(cache, objdb);
+		layout_pb->buildCaches(cache, objdb);
+		layout_p1->buildCaches(cache, objdb);
+		auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		log_info("Built object caches in %.1f ms", elapsed);
+	}
+}
+
+void Stage::rebuildObjectCaches(glm::vec3 camPos) {
+	static float budgetMs = -1.0f;
+	if (budgetMs < 0.0f) budgetMs = config_getf("cache_build_budget_ms", 4.0f);
+
+	rebuildQueue.clear();
+	if (layout_db) layout_db->collectRebuilds(camPos, rebuildQueue);
+	if (layout_pb) layout_pb->collectRebuilds(camPos, rebuildQueue);
+	if (layout_p1) layout_p1->collectRebuilds(camPos, rebuildQueue);
+	if (rebuildQueue.empty()) return;
+
+	// nearest first, the rest keep drawing as boxes until a later frame gets to them
+	std::sort(rebuildQueue.begin(), rebuildQueue.end(), [](const CacheRebuild& a, const CacheRebuild& b) {
+		return a.distance < b.distance;
+	});
+	auto start = std::chrono::steady_clock::now();
+	for (auto& rebuild : rebuildQueue) {
+		rebuild.layout->rebuildCache(rebuild.id, cache, objdb);
+		// always does at least one, so a tiny budget still makes progress
+		auto elapsed = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+		if (elapsed >= budgetMs) break;
+	}
 }
 
 void Stage::readCache(FSPath& oneFile, TexDictionary* txd) {
@@ -149,6 +270,8 @@ void Stage::readCache(FSPath& oneFile, TexDictionary* txd) {
 	cache->addFromArchive(oneFile, txd);
 }
 
+static void drawProfileUI(ObjectList* objdb);
+
 void Stage::drawLayoutUI(glm::vec3 camPos) {
 	ImGui::Combo("Layout", &listSel, "None\0DB\0PB\0P1\0");
 	if (listSel == 1) {
@@ -161,11 +284,12 @@ void Stage::drawLayoutUI(glm::vec3 camPos) {
 
 	// todo: choose layout
 	else ImGui::TextColored(ImVec4(1.0f, 0.25f, 0.0f, 1.0f), "No stage is loaded");
+
+	if (ImGui::CollapsingHeader("Draw block profile")) drawProfileUI(objdb);
 }
 
 Stage::Stage() {
-	objdb = new ObjectList();
-	objdb->readFile("ObjectList.ini");
+	objdb = ObjectList::shared();
 }
 
 bool VisibilityManager::isVisible(int chunkId, glm::vec3 camPos) {
@@ -183,59 +307,30 @@ bool VisibilityManager::isVisible(int chunkId, glm::vec3 camPos) {
 	return false;
 }
 
-static u32 swapEndianness(u32* value) {
-	union IntBytes {
-		u32 as_int;
-		u8 bytes[4];
-	};
-	IntBytes tmp = *(IntBytes*)value;
-	IntBytes* out = (IntBytes*)value;
-	out->bytes[0] = tmp.bytes[3];
-	out->bytes[1] = tmp.bytes[2];
-	out->bytes[2] = tmp.bytes[1];
-	out->bytes[3] = tmp.bytes[0];
-
-	return *value;
-}
-
-static u16 swapEndianness(u16* value) {
-	u16 tmp = (u8) *value;
-	*value = *value >> 8;
-	*value |= tmp << 8;
-
-	return *value;
-}
-
-static float swapEndianness(float* value) {
-	swapEndianness((u32*) value);
-
-	return *value;
-}
-
 void VisibilityManager::read(FSPath& blkFile) {
+	typedef BERecord<VisibilityBlock,
+		BE_FIELD(VisibilityBlock, chunk),
+		BE_FIELD(VisibilityBlock, low_x), BE_FIELD(VisibilityBlock, low_y), BE_FIELD(VisibilityBlock, low_z),
+		BE_FIELD(VisibilityBlock, high_x), BE_FIELD(VisibilityBlock, high_y), BE_FIELD(VisibilityBlock, high_z)
+	> VisibilityBlockBE;
+
 	Buffer b = blkFile.read();
 	fileExists = true;
 
-	for (int i = 0; i < 64; i++) {
-		if (b.remaining() < sizeof(VisibilityBlock)) {
-			logger.warn("unexpected EoF in %s", blkFile.str.c_str());
-			break;
-		}
-		VisibilityBlock block;
-		b.read(&block);
-
-		swapEndianness((u32*) &block.chunk);
-		swapEndianness((u32*) &block.low_x);
-		swapEndianness((u32*) &block.low_y);
-		swapEndianness((u32*) &block.low_z);
-		swapEndianness((u32*) &block.high_x);
-		swapEndianness((u32*) &block.high_y);
-		swapEndianness((u32*) &block.high_z);
-
-		blocks.push_back(block);
+	u32 count = b.size() / sizeof(VisibilityBlock);
+	if (count < 64) {
+		logger.warn("unexpected EoF in %s", blkFile.str.c_str());
+	} else {
+		if (b.size() > 64 * sizeof(VisibilityBlock)) logger.warn("excess data in %s", blkFile.str.c_str());
+		count = 64;
 	}
-	if (b.remaining()) {
-		logger.warn("excess data in %s", blkFile.str.c_str());
+
+	ByteReader in(b.base_ptr(), b.size());
+	size_t first = blocks.size();
+	blocks.resize(first + count);
+	if (count) {
+		in.read(&blocks[first], count * sizeof(VisibilityBlock));
+		VisibilityBlockBE::swapArray(&blocks[first], count);
 	}
 }
 
@@ -286,38 +381,201 @@ void VisibilityManager::drawDebug(glm::vec3 camPos) {
 	}
 }
 
+DFFCache::DFFCache() {
+	memoryBudget = (size_t) config_geti("dff_cache_budget_mb", 256) * 1024 * 1024;
+	worker = std::thread(&DFFCache::workerMain, this);
+}
+
 DFFCache::~DFFCache() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		workerQuit = true;
+	}
+	workerSignal.notify_one();
+	worker.join();
+
 	for (auto& entry : cache) {
-		delete entry.second;
+		delete entry.second.data;
+		delete entry.second.clump;
+		delete entry.second.model;
+	}
+	for (auto archive : archives) {
+		delete archive;
 	}
 }
 
 void DFFCache::addFromArchive(FSPath& onePath, TexDictionary* txd) {
 	ONEArchive* one = new ONEArchive(onePath);
+	archives.push_back(one);
 
+	// only index the archive here, models are read on first use
 	const auto fileCount = one->getFileCount();
 	for (int i = 0; i < fileCount; i++) {
 		const auto fileName = one->getFileName(i);
 		const auto fileNameLen = strlen(fileName);
 
-		if (fileName[fileNameLen-4] == '.' && fileName[fileNameLen-3] == 'D' && fileName[fileNameLen-2] == 'F' && fileName[fileNameLen-1] == 'F') {
-			DFFModel* dff = new DFFModel();
-			Buffer b = one->readFile(i);
-			rw::ClumpChunk* clump = (rw::ClumpChunk*) rw::readChunk(b);
-			dff->setFromClump(clump, txd);
-			delete clump;
+		if (fileNameLen > 4 && fileName[fileNameLen-4] == '.' && fileName[fileNameLen-3] == 'D' && fileName[fileNameLen-2] == 'F' && fileName[fileNameLen-1] == 'F') {
+			auto& entry = cache[std::string(fileName)];
+			if (entry.state != EntryState::Unloaded || entry.model) continue; // already indexed and in use
+			entry.archive = one;
+			entry.fileIndex = i;
+			entry.txd = txd;
+		}
+	}
+}
 
-			cache[std::string(fileName)] = dff;
+void DFFCache::workerMain() {
+	while (true) {
+		Entry* entry;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			workerSignal.wait(lock, [this] { return workerQuit || !loadQueue.empty(); });
+			if (workerQuit) return;
+			entry = loadQueue.front();
+			loadQueue.pop_front();
 		}
+
+		// decompress and parse off the main thread, bgfx resources are created in update()
+		// files that chunk views can read are kept as is, anything else is parsed into a chunk tree
+		Buffer b = entry->archive->readFile(entry->fileIndex);
+		const u8* data = (const u8*) b.base_ptr();
+		RWChunkView clumpChunk;
+		RWClumpView clumpView;
+		bool viewed = RWChunkView::read(data, data + b.size(), clumpChunk) && clumpView.parse(clumpChunk, workerScratch);
+		workerScratch.reset();
+
+		Buffer* viewData = nullptr;
+		rw::ClumpChunk* clump = nullptr;
+		if (viewed) {
+			viewData = new Buffer(std::move(b));
+		} else {
+			clump = (rw::ClumpChunk*) rw::readChunk(b);
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		entry->data = viewData;
+		entry->clump = clump;
+		entry->state = EntryState::Parsed;
+		parsedList.push_back(entry);
 	}
+}
 
-	delete one;
+void DFFCache::requestLoad(Entry& entry) {
+	if (!entry.model) {
+		entry.model = new DFFModel();
+		modelEntries[entry.model] = &entry;
+	}
+	if (entry.state != EntryState::Unloaded) return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		entry.state = EntryState::Queued;
+		loadQueue.push_back(&entry);
+	}
+	workerSignal.notify_one();
 }
 
 DFFModel* DFFCache::getDFF(const char* name) {
 	auto result = cache.find(std::string(name));
 	if (result == cache.end()) return nullptr;
-	else return result->second;
+
+	requestLoad(result->second);
+	return result->second.model;
+}
+
+DFFModel* DFFCache::acquire(const char* name) {
+	auto result = cache.find(std::string(name));
+	if (result == cache.end()) return nullptr;
+
+	requestLoad(result->second);
+	result->second.refs++;
+	return result->second.model;
+}
+
+void DFFCache::release(DFFModel* model) {
+	if (!model) return;
+	auto result = modelEntries.find(model);
+	if (result == modelEntries.end()) return;
+
+	auto entry = result->second;
+	if (entry->refs > 0 && --entry->refs == 0) {
+		entry->releasedFrame = frame;
+	}
+}
+
+bool DFFCache::update() {
+	frame++;
+
+	// upload models parsed by the worker
+	std::vector<Entry*> parsed;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		parsed.swap(parsedList);
+	}
+	for (auto entry : parsed) {
+		if (entry->data) {
+			const u8* data = (const u8*) entry->data->base_ptr();
+			RWChunkView clumpChunk;
+			if (!RWChunkView::read(data, data + entry->data->size(), clumpChunk) ||
+				!entry->model->setFromClumpView(clumpChunk, entry->txd, uploadScratch)) {
+				logger.warn("Invalid DFF file in ONE archive (index %d)", entry->fileIndex);
+			}
+			memoryUsed += entry->model->getMemoryUsage();
+		} else if (entry->clump) {
+			entry->model->setFromClump(entry->clump, entry->txd, 0, &uploadScratch);
+			memoryUsed += entry->model->getMemoryUsage();
+		} else {
+			logger.warn("Invalid DFF file in ONE archive (index %d)", entry->fileIndex);
+		}
+		uploadScratch.reset();
+		delete entry->data;
+		entry->data = nullptr;
+		delete entry->clump;
+		entry->clump = nullptr;
+		entry->state = EntryState::Ready;
+	}
+
+	if (memoryUsed > memoryBudget) evict();
+	return !parsed.empty();
+}
+
+void DFFCache::evict() {
+	// collect loaded models nothing references, least recently released first
+	std::vector<Entry*> candidates;
+	for (auto& entry : cache) {
+		if (entry.second.state == EntryState::Ready && entry.second.refs == 0 && entry.second.model->isLoaded()) {
+			candidates.push_back(&entry.second);
+		}
+	}
+	std::sort(candidates.begin(), candidates.end(), [](Entry* a, Entry* b) {
+		return a->releasedFrame < b->releasedFrame;
+	});
+
+	for (auto entry : candidates) {
+		if (memoryUsed <= memoryBudget) break;
+		memoryUsed -= entry->model->getMemoryUsage();
+		entry->model->clear(); // keep the (now empty) model so outstanding pointers stay valid
+		entry->state = EntryState::Unloaded;
+	}
+}
+
+void DFFCache::drawUI() {
+	int loaded = 0, pending = 0, referenced = 0;
+	for (auto& entry : cache) {
+		if (entry.second.state == EntryState::Ready && entry.second.model->isLoaded()) loaded++;
+		if (entry.second.state == EntryState::Queued || entry.second.state == EntryState::Parsed) pending++;
+		if (entry.second.refs) referenced++;
+	}
+	ImGui::Text("%d models indexed", (int) cache.size());
+	ImGui::Text("%d loaded, %d pending, %d referenced", loaded, pending, referenced);
+	ImGui::Text("Memory: %.1f / %.1f MB", memoryUsed / (1024.0 * 1024.0), memoryBudget / (1024.0 * 1024.0));
+	ImGui::Text("Upload scratch peak: %.1f KB", uploadScratch.getPeak() / 1024.0);
+
+	int budgetMB = (int) (memoryBudget / (1024 * 1024));
+	if (ImGui::DragInt("Budget (MB)", &budgetMB, 1.0f, 16, 4096)) {
+		memoryBudget = (size_t) budgetMB * 1024 * 1024;
+		config_seti("dff_cache_budget_mb", budgetMB);
+	}
 }
 
 struct InstanceData {
@@ -335,60 +593,65 @@ struct InstanceData {
 	u16 miscID;
 };
 
-void ObjectLayout::read(FSPath& binFile) {
-	Buffer b = binFile.read();
-	b.seek(0);
-
-	if (b.size() == 0) return;
-
-	for (int i = 0; i < 2048; i++) {
-		// check can read
-		if (b.remaining() < sizeof(InstanceData)) {
-			rw::util::logger.error("Invalid object layout file (unexpected EOF reading format)");
-			break;
-		}
+typedef BERecord<InstanceData,
+	BE_FIELD(InstanceData, x), BE_FIELD(InstanceData, y), BE_FIELD(InstanceData, z),
+	BE_FIELD(InstanceData, rx), BE_FIELD(InstanceData, ry), BE_FIELD(InstanceData, rz),
+	BE_FIELD(InstanceData, unused_1), BE_FIELD(InstanceData, unused_2), BE_FIELD(InstanceData, unused_repeat),
+	BE_FIELD(InstanceData, type), BE_FIELD(InstanceData, unused_3), BE_FIELD(InstanceData, miscID)
+> InstanceDataBE;
 
-		// read data
-		InstanceData instance;
-		b.read(&instance);
+static const u32 INSTANCE_COUNT = 2048;
+static const u32 MISC_OFFSET = 0x18000; // INSTANCE_COUNT * sizeof(InstanceData)
+static const u32 MISC_SIZE = 0x24; // u32 header followed by 32 bytes of misc data
 
-		if (instance.type) {
-			objects.emplace_back();
-			auto& obj = objects.back();
+void ObjectLayout::read(FSPath& binFile, Arena& scratch) {
+	Buffer b = binFile.read();
 
-			obj.pos_x = swapEndianness(&instance.x);
-			obj.pos_y = swapEndianness(&instance.y);
-			obj.pos_z = swapEndianness(&instance.z);
-			obj.rot_x = i32(swapEndianness(&instance.rx)) * 0.0054931641f;
-			obj.rot_y = i32(swapEndianness(&instance.ry)) * 0.0054931641f;
-			obj.rot_z = i32(swapEndianness(&instance.rz)) * 0.0054931641f;
-			obj.type = swapEndianness(&instance.type);
-			obj.linkID = instance.linkID;
-			obj.radius = instance.radius;
-			swapEndianness(&instance.miscID);
+	if (b.size() == 0) return;
 
-			auto returnOffs = b.tell();
-			b.seek(0x18000u + 0x24 * instance.miscID + 0x04);
-			if (((int) b.remaining()) >= 32) // todo: Buffer::remaining() should return signed (or clamp min to zero)
-				b.read(obj.misc, 32);
-			else
-				rw::util::logger.warn("Invalid miscID for object %d", i);
-			b.seek(returnOffs);
-		}
+	// convert the whole instance table at once
+	u32 count = std::min(b.size() / (u32) sizeof(InstanceData), INSTANCE_COUNT);
+	if (count < INSTANCE_COUNT) rw::util::logger.error("Invalid object layout file (unexpected EOF reading format)");
+	ByteReader in(b.base_ptr(), b.size());
+	InstanceData* instances = scratch.allocArray<InstanceData>(count);
+	if (count) in.read(instances, count * sizeof(InstanceData));
+	InstanceDataBE::swapArray(instances, count);
+
+	for (u32 i = 0; i < count; i++) {
+		auto& instance = instances[i];
+		if (!instance.type) continue;
+
+		objects.emplace_back();
+		auto& obj = objects.back();
+
+		obj.pos_x = instance.x;
+		obj.pos_y = instance.y;
+		obj.pos_z = instance.z;
+		obj.rot_x = i32(instance.rx) * 0.0054931641f;
+		obj.rot_y = i32(instance.ry) * 0.0054931641f;
+		obj.rot_z = i32(instance.rz) * 0.0054931641f;
+		obj.type = instance.type;
+		obj.linkID = instance.linkID;
+		obj.radius = instance.radius;
+
+		in.seek(MISC_OFFSET + MISC_SIZE * instance.miscID + 0x04);
+		if (!in.read(obj.misc, 32)) rw::util::logger.warn("Invalid miscID for object %d", i);
 	}
 }
 
 void ObjectLayout::write(FSPath& binFile) {
 	// create buffer to hold contents
-	Buffer b(2048 * sizeof(InstanceData) + this->objects.size() * 36, true);
+	Buffer b(MISC_OFFSET + this->objects.size() * MISC_SIZE, true);
 
 	// todo: check validity (i.e. object count)
 
 	// write layout
+	std::vector<InstanceData> instances(this->objects.size());
 	int miscID = 0;
-	for (auto& object : this->objects) {
+	for (int i = 0; i < this->objects.size(); i++) {
+		auto& object = this->objects[i];
 		// set struct values
-		InstanceData data;
+		InstanceData& data = instances[i];
 		data.x = object.pos_x;
 		data.y = object.pos_y;
 		data.z = object.pos_z;
@@ -405,23 +668,14 @@ void ObjectLayout::write(FSPath& binFile) {
 		data.radius = object.radius;
 		data.unused_3 = 0;
 		data.miscID = miscID++;
-
-		// fix endianness
-		swapEndianness(&data.x);
-		swapEndianness(&data.y);
-		swapEndianness(&data.z);
-		swapEndianness(&data.rx);
-		swapEndianness(&data.ry);
-		swapEndianness(&data.rz);
-		swapEndianness(&data.type);
-		swapEndianness(&data.miscID);
-
-		// write to file
-		b.write(data);
 	}
 
+	// fix endianness
+	InstanceDataBE::swapArray(instances.data(), instances.size());
+	if (!instances.empty()) b.write(instances.data(), (u32) (instances.size() * sizeof(InstanceData)));
+
 	// seek to beginning of misc entries
-	b.seek(0x18000);
+	b.seek(MISC_OFFSET);
 
 	// write misc
 	for (auto& object : this->objects) {
@@ -450,27 +704,154 @@ extern "C" {
 }
 
 #include <unordered_map>
+#include <unordered_set>
+#include <mutex>
 #include <glm/gtc/matrix_transform.hpp>
+#include "util/parallel.hh"
 
-static bool lua_was_init = false;
-static lua_State* L;
-static std::unordered_map<int, int> object_draw_fns;
+typedef DrawScript::DrawCall DrawCall;
 
-struct DrawCall {
-	glm::mat4 transform;
-	int renderBits;
-	std::string modelName;
+// draw blocks are compiled to native ops where possible, lua is only used for the rest
+struct DrawFunction {
+	DrawScript* script = nullptr;
+	bool hasSource = false;
+};
+static std::mutex draw_fns_mutex;
+static std::unordered_map<int, DrawFunction> object_draw_fns;
+
+// state of the draw block being run by a lua state, passed to rclua functions as an upvalue
+struct DrawContext {
+	int instancesLeft; // draw calls left in the budget, counting each instance
+	int instructionsLeft;
+	std::chrono::steady_clock::time_point deadline;
+	std::vector<DrawCall> draw_calls;
+	DrawCall current_dc;
+	ObjectLayout::ObjectInstance* instance_data;
+	ObjectList::ObjectTypeData* object_data;
+	std::vector<glm::mat4> transformStack;
 };
-static std::vector<DrawCall> draw_calls;
-static DrawCall current_dc;
-static ObjectLayout::ObjectInstance* instance_data;
-static ObjectList::ObjectTypeData* object_data;
-static std::vector<glm::mat4> transformStack;
+
+// each thread building caches takes its own lua state from the pool
+struct LuaDrawState {
+	lua_State* L;
+	DrawContext context;
+	std::unordered_map<int, int> chunks; // object type to registry reference of compiled block
+};
+static std::mutex lua_pool_mutex;
+static std::vector<LuaDrawState*> lua_pool;
+
+static DrawContext* getContext(lua_State* L) {
+	return (DrawContext*) lua_touserdata(L, lua_upvalueindex(1));
+}
+
+// limits for a single object's draw block, so a bad block (or bad misc data) can't stall the editor
+struct DrawBudget {
+	int maxInstructions;
+	int maxCalls;
+	float maxMs;
+};
+
+static const DrawBudget& getDrawBudget() {
+	static const DrawBudget budget = {
+		config_geti("draw_block_max_instructions", 1000000),
+		config_geti("draw_block_max_calls", 1024),
+		config_getf("draw_block_max_ms", 50.0f)
+	};
+	return budget;
+}
+
+// time spent and draw calls made by the draw blocks of each object type
+struct DrawProfile {
+	int runs = 0;
+	int luaRuns = 0;
+	int failures = 0;
+	double totalMs = 0.0;
+	double maxMs = 0.0;
+	u64 drawCalls = 0;
+};
+static std::mutex profile_mutex;
+static std::unordered_map<int, DrawProfile> draw_profiles;
+
+static const char* CONTEXT_KEY = "railcanyon_draw_context";
+static const int HOOK_INTERVAL = 1000; // instructions between budget checks
+
+static void rclua_budget_hook(lua_State* L, lua_Debug* ar) {
+	lua_getfield(L, LUA_REGISTRYINDEX, CONTEXT_KEY);
+	auto ctx = (DrawContext*) lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	ctx->instructionsLeft -= HOOK_INTERVAL;
+	if (ctx->instructionsLeft < 0) luaL_error(L, "draw block exceeded instruction budget");
+	if (std::chrono::steady_clock::now() > ctx->deadline) luaL_error(L, "draw block exceeded time budget");
+}
+
+static void pushDraw(lua_State* L, DrawContext* ctx, const char* model, const DrawScript::Instancing& instancing) {
+	ctx->instancesLeft -= instancing.count;
+	if (ctx->instancesLeft < 0) luaL_error(L, "draw block exceeded draw call budget");
+	ctx->draw_calls.push_back(ctx->current_dc);
+	auto& dc = ctx->draw_calls.back();
+	dc.modelName = model ? model : "";
+	dc.instancing = instancing;
+}
 
 static int rclua_draw(lua_State* L) {
-	const char* c = lua_tostring(L, -1);
-	current_dc.modelName = c ? c : "";
-	draw_calls.push_back(current_dc);
+	auto ctx = getContext(L);
+	pushDraw(L, ctx, lua_tostring(L, -1), DrawScript::Instancing());
+	return 0;
+}
+
+// draw_line(model, count, dx, dy, dz): count instances, each offset by (dx, dy, dz) from the last
+static int rclua_draw_line(lua_State* L) {
+	auto ctx = getContext(L);
+	DrawScript::Instancing instancing;
+	instancing.kind = DrawScript::Instancing::LINE;
+	instancing.count = (int) luaL_checknumber(L, 2);
+	instancing.param = glm::vec3((float) luaL_checknumber(L, 3), (float) luaL_checknumber(L, 4),
+								 (float) luaL_checknumber(L, 5));
+	if (instancing.count > 0) pushDraw(L, ctx, lua_tostring(L, 1), instancing);
+	return 0;
+}
+
+// draw_circle(model, count, radius[, step]): count instances around the y axis, step degrees apart (default evenly spaced)
+static int rclua_draw_circle(lua_State* L) {
+	auto ctx = getContext(L);
+	DrawScript::Instancing instancing;
+	instancing.kind = DrawScript::Instancing::CIRCLE;
+	instancing.count = (int) luaL_checknumber(L, 2);
+	if (instancing.count <= 0) return 0;
+	float radius = (float) luaL_checknumber(L, 3);
+	float step = lua_gettop(L) >= 4 ? (float) luaL_checknumber(L, 4) : 360.0f / instancing.count;
+	instancing.param = glm::vec3(radius, step, 0.0f);
+	pushDraw(L, ctx, lua_tostring(L, 1), instancing);
+	return 0;
+}
+
+// draw_array(model, transforms): an instance for each {x, y, z[, angle]} in transforms, angle rotating around y
+static int rclua_draw_array(lua_State* L) {
+	auto ctx = getContext(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	auto transforms = std::make_shared<std::vector<glm::mat4>>();
+	int count = (int) lua_rawlen(L, 2);
+	if (count > ctx->instancesLeft) luaL_error(L, "draw block exceeded draw call budget");
+	for (int i = 1; i <= count; i++) {
+		lua_rawgeti(L, 2, i);
+		luaL_checktype(L, -1, LUA_TTABLE);
+		float v[4] = {0, 0, 0, 0};
+		for (int j = 0; j < 4; j++) {
+			lua_rawgeti(L, -1, j + 1);
+			v[j] = (float) lua_tonumber(L, -1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		mat4 transform = glm::translate(mat4(1.0f), vec3(v[0], v[1], v[2]));
+		transforms->push_back(glm::rotate(transform, glm::radians(v[3]), vec3(0, 1, 0)));
+	}
+	if (!count) return 0;
+
+	DrawScript::Instancing instancing;
+	instancing.kind = DrawScript::Instancing::ARRAY;
+	instancing.count = count;
+	instancing.transforms = transforms;
+	pushDraw(L, ctx, lua_tostring(L, 1), instancing);
 	return 0;
 }
 
@@ -505,14 +886,16 @@ static void _put_vec3(lua_State* L, glm::vec3 v) {
 }
 
 static int rclua_translate(lua_State* L) {
+	auto ctx = getContext(L);
 	float fx = (float) lua_tonumber(L, -3);
 	float fy = (float) lua_tonumber(L, -2);
 	float fz = (float) lua_tonumber(L, -1);
-	current_dc.transform = glm::translate(current_dc.transform, glm::vec3(fx, fy, fz));
+	ctx->current_dc.transform = glm::translate(ctx->current_dc.transform, glm::vec3(fx, fy, fz));
 	return 0;
 }
 
 static int rclua_rotate(lua_State* L) {
+	auto ctx = getContext(L);
 	const char* format = lua_tostring(L, 1);
 	for (int i = 0; i < strlen(format); i++) {
 		glm::vec3 axis;
@@ -542,17 +925,18 @@ static int rclua_rotate(lua_State* L) {
 			glm::vec3 rot = _get_vec3(L);
 			f = axis_id ? (axis_id == 1 ? rot.y : rot.z) : rot.x;
 		}
-		current_dc.transform = glm::rotate(current_dc.transform, glm::radians(f), axis);
+		ctx->current_dc.transform = glm::rotate(ctx->current_dc.transform, glm::radians(f), axis);
 	}
 	return 0;
 }
 
 static int rclua_scale(lua_State* L) {
+	auto ctx = getContext(L);
 	int argc = lua_gettop(L);
 	if (argc == 1) {
 		if (lua_isnumber(L, -1)) {
 			float factor = (float) lua_tonumber(L, -1);
-			current_dc.transform = glm::scale(current_dc.transform, glm::vec3(factor, factor, factor));
+			ctx->current_dc.transform = glm::scale(ctx->current_dc.transform, glm::vec3(factor, factor, factor));
 		} else {
 			// todo: handle vec3 type
 		}
@@ -560,7 +944,7 @@ static int rclua_scale(lua_State* L) {
 		float fx = (float) lua_tonumber(L, -3);
 		float fy = (float) lua_tonumber(L, -2);
 		float fz = (float) lua_tonumber(L, -1);
-		current_dc.transform = glm::scale(current_dc.transform, glm::vec3(fx, fy, fz));
+		ctx->current_dc.transform = glm::scale(ctx->current_dc.transform, glm::vec3(fx, fy, fz));
 	} else {
 		luaL_error(L, "Invalid number of arguments to scale() (got %d)", argc);
 	}
@@ -568,218 +952,168 @@ static int rclua_scale(lua_State* L) {
 }
 
 static int rclua_push(lua_State* L) {
-	transformStack.push_back(current_dc.transform);
+	auto ctx = getContext(L);
+	ctx->transformStack.push_back(ctx->current_dc.transform);
 	return 0;
 }
 
 static int rclua_pop(lua_State* L) {
-	current_dc.transform = transformStack.back();
-	transformStack.pop_back();
+	auto ctx = getContext(L);
+	if (ctx->transformStack.empty()) luaL_error(L, "pop() without matching push()");
+	ctx->current_dc.transform = ctx->transformStack.back();
+	ctx->transformStack.pop_back();
 	return 0;
 }
 
 static int rclua_material(lua_State* L) {
+	auto ctx = getContext(L);
 	if (lua_isnumber(L, -1)) {
-		current_dc.renderBits = (int) lua_tonumber(L, -1);
+		ctx->current_dc.renderBits = (int) lua_tonumber(L, -1);
 	} else {
 		const char* flags = lua_tostring(L, -1);
-		current_dc.renderBits = 0;
+		ctx->current_dc.renderBits = 0;
 		if (flags) for (const char* p = flags; *p; p++) {
-			current_dc.renderBits |= matFlagFromChar(*p);
+			ctx->current_dc.renderBits |= matFlagFromChar(*p);
 		}
-		current_dc.renderBits ^= BIT_REFLECTIVE;
+		ctx->current_dc.renderBits ^= BIT_REFLECTIVE;
 	}
 	return 0;
 }
 
-static int align(int i, int alignment) {
-	while (i % alignment) i++;
-	return i;
-}
-
 static int rclua_property(lua_State* L) {
+	auto ctx = getContext(L);
 	int property = 0;
 	// get property index
 	if (lua_isnumber(L, -1)) {
 		property = (int) lua_tonumber(L, -1);
-		if (property < 1 || property > strlen(object_data->miscProperties)) {
+		if (property < 1 || property > ctx->object_data->properties.size()) {
 			luaL_error(L, "Invalid property index %d", property);
 		}
 		property--; // make 0 indexed
 	} else {
 		const char* prop_name = lua_tostring(L, -1);
-		int max_prop = (int) strlen(object_data->miscFormat);
-		const char* p = object_data->miscProperties;
-		property = -1;
-		for (int i = 0; i < max_prop; i++) {
-			int len = 0;
-			while (p[len] != ';') len++;
-			if (strlen(prop_name) == len && !strncmp(p, prop_name, len)) {
-				property = i;
-				break;
-			}
-			p += len+1;
-		}
+		property = ctx->object_data->findProperty(prop_name ? prop_name : "");
 		if (property == -1) {
 			luaL_error(L, "No such property as %s found", prop_name);
 		}
 	}
 
-	// find offset into misc
-	int misc_offs = 0;
-	for (int i = 0; i < property; i++) {
-		switch (object_data->miscFormat[i]) {
-			case 'c':
-			case 'C': {
-				misc_offs += 1;
-			} break;
-			case 's':
-			case 'S': {
-				misc_offs = align(misc_offs, 2);
-				misc_offs += 2;
-			} break;
-			case 'x':
-			case 'X':
-			case 'i':
-			case 'I': {
-				misc_offs = align(misc_offs, 4);
-				misc_offs += 4;
-			} break;
-			case 'f':
-			case 'F': {
-				misc_offs = align(misc_offs, 4);
-				misc_offs += 4;
-			} break;
-			default: {
-				log_error("Invalid format option %c", object_data->miscFormat[i]);
-				misc_offs += 4;
-			}
-		}
-	}
-
-	switch (object_data->miscFormat[property]) {
-		case 'c':
-		case 'C': {
-			u8 value = instance_data->misc[misc_offs];
-			lua_pushnumber(L, value);
-		} break;
-		case 's':
-		case 'S': {
-			misc_offs = align(misc_offs, 2);
-			u16 value = *((u16*) &instance_data->misc[misc_offs]);
-			swapEndianness(&value);
-			lua_pushnumber(L, value);
-		} break;
-		case 'x':
-		case 'X':
-		case 'i':
-		case 'I': {
-			misc_offs = align(misc_offs, 4);
-			u32 value = *((u32*) &instance_data->misc[misc_offs]);
-			swapEndianness(&value);
-			lua_pushnumber(L, value);
-		} break;
-		case 'f':
-		case 'F': {
-			misc_offs = align(misc_offs, 4);
-			float value = *((float*) (instance_data->misc+misc_offs));
-			swapEndianness(&value);
-			lua_pushnumber(L, value);
-		} break;
-		default: {
-			log_error("Invalid format option %c", object_data->miscFormat[property]);
-			lua_pushnil(L);
-		}
+	double value;
+	if (ctx->object_data->readProperty(property, ctx->instance_data->misc, value)) {
+		lua_pushnumber(L, value);
+	} else {
+		lua_pushnil(L);
 	}
 
 	return 1;
 }
 
 static int rclua_rotation(lua_State* L) {
-	_put_vec3(L, glm::vec3(instance_data->rot_x, instance_data->rot_y, instance_data->rot_z));
+	auto ctx = getContext(L);
+	_put_vec3(L, glm::vec3(ctx->instance_data->rot_x, ctx->instance_data->rot_y, ctx->instance_data->rot_z));
 	return 1;
 }
 
-static void register_fn(lua_State* L, int (*fn)(lua_State*), const char* name) {
-	lua_pushcfunction(L, fn);
+static void register_fn(lua_State* L, int (*fn)(lua_State*), const char* name, DrawContext* context) {
+	lua_pushlightuserdata(L, context);
+	lua_pushcclosure(L, fn, 1);
 	lua_setglobal(L, name);
 }
 
-void ObjectLayout::buildObjectCache(ObjectInstance& object, DFFCache* cache, ObjectList* objdb, int id) {
-	// lazy initialize lua state
-	if (!lua_was_init) {
-		// setup lua interpreter
-		L = luaL_newstate();
-		luaL_openlibs(L);
-
-		// setup rclua functions
-		register_fn(L, rclua_draw, "draw");
-		register_fn(L, rclua_translate, "translate");
-		register_fn(L, rclua_rotate, "rotate");
-		register_fn(L, rclua_scale, "scale");
-		register_fn(L, rclua_push, "push");
-		register_fn(L, rclua_pop, "pop");
-		register_fn(L, rclua_material, "material");
-		register_fn(L, rclua_property, "property");
-		register_fn(L, rclua_rotation, "rotation");
-
-		// mark lua as loaded
-		lua_was_init = true;
+static LuaDrawState* createLuaState() {
+	// setup lua interpreter
+	auto state = new LuaDrawState();
+	lua_State* L = luaL_newstate();
+	luaL_openlibs(L);
+	state->L = L;
+
+	// setup rclua functions
+	DrawContext* context = &state->context;
+	register_fn(L, rclua_draw, "draw", context);
+	register_fn(L, rclua_draw_line, "draw_line", context);
+	register_fn(L, rclua_draw_circle, "draw_circle", context);
+	register_fn(L, rclua_draw_array, "draw_array", context);
+	register_fn(L, rclua_translate, "translate", context);
+	register_fn(L, rclua_rotate, "rotate", context);
+	register_fn(L, rclua_scale, "scale", context);
+	register_fn(L, rclua_push, "push", context);
+	register_fn(L, rclua_pop, "pop", context);
+	register_fn(L, rclua_material, "material", context);
+	register_fn(L, rclua_property, "property", context);
+	register_fn(L, rclua_rotation, "rotation", context);
+
+	// hooks don't get upvalues, so the context is also kept in the registry
+	lua_pushlightuserdata(L, context);
+	lua_setfield(L, LUA_REGISTRYINDEX, CONTEXT_KEY);
+	lua_sethook(L, rclua_budget_hook, LUA_MASKCOUNT, HOOK_INTERVAL);
+
+	return state;
+}
+
+static LuaDrawState* acquireLuaState() {
+	{
+		std::lock_guard<std::mutex> lock(lua_pool_mutex);
+		if (!lua_pool.empty()) {
+			auto state = lua_pool.back();
+			lua_pool.pop_back();
+			return state;
+		}
 	}
+	return createLuaState();
+}
 
-	// find object data from ObjectList.ini
-	auto objdata = objdb->getObjectData(u8(object.type >> 8), u8(object.type & 0xff));
+static void releaseLuaState(LuaDrawState* state) {
+	std::lock_guard<std::mutex> lock(lua_pool_mutex);
+	lua_pool.push_back(state);
+}
 
-	// get reference to chunk
-	auto mapIterator = object_draw_fns.find(object.type);
-	int draw_fn;
+static DrawFunction getDrawFunction(int type, ObjectList::ObjectTypeData* objdata) {
+	std::lock_guard<std::mutex> lock(draw_fns_mutex);
+	auto mapIterator = object_draw_fns.find(type);
 	if (mapIterator == object_draw_fns.end()) {
-		// check if object is known
-		if (objdata) {
-			// determine chunk name
-			char buffer[32];
-			snprintf(buffer, 32, "%s(%d)::Draw", objdata->debugName, id);
-
-			// get chunk source
-			const char* src;
-			src = objdata->blockDraw;
-
-			if (src) {
-				// compile and get reference
-				luaL_loadbuffer(L, src, strlen(src), buffer);
-				draw_fn = luaL_ref(L, LUA_REGISTRYINDEX);
-			} else {
-				// indicate that this object has no source
-				draw_fn = LUA_NOREF;
-			}
-		} else {
-			// indicate object unknown
-			draw_fn = LUA_NOREF;
+		DrawFunction fn;
+		// check if object is known and has source
+		if (objdata && objdata->blockDraw) {
+			fn.hasSource = true;
+			fn.script = DrawScript::compile(objdata);
 		}
-
-		// store cached value
-		object_draw_fns[object.type] = draw_fn;
-	} else {
-		// get value from object_draw_fns cache
-		draw_fn = mapIterator->second;
+		mapIterator = object_draw_fns.emplace(type, fn).first;
 	}
+	return mapIterator->second;
+}
 
-	// set object as debug cube if lacking draw function
-	if (draw_fn == LUA_NOREF) {
-		object.fallback_render = true;
-		return;
+static void runLuaDrawFn(LuaDrawState* state, ObjectLayout::ObjectInstance& object,
+						 ObjectList::ObjectTypeData* objdata, int id, std::vector<DrawCall>& calls) {
+	lua_State* L = state->L;
+
+	// get reference to chunk, compiling it the first time this state sees the type
+	auto chunk = state->chunks.find(object.type);
+	if (chunk == state->chunks.end()) {
+		// determine chunk name
+		char buffer[32];
+		snprintf(buffer, 32, "%s(%d)::Draw", objdata->debugName, id);
+
+		const char* src = objdata->blockDraw;
+		luaL_loadbuffer(L, src, strlen(src), buffer);
+		chunk = state->chunks.emplace(object.type, luaL_ref(L, LUA_REGISTRYINDEX)).first;
 	}
 
-	// setup globals
-	current_dc.transform = mat4();
-	current_dc.renderBits = 0;
-	current_dc.modelName = "";
-	instance_data = &object;
-	object_data = objdata;
-	draw_calls.clear();
+	// setup context
+	auto& budget = getDrawBudget();
+	auto& ctx = state->context;
+	ctx.instancesLeft = budget.maxCalls;
+	ctx.instructionsLeft = budget.maxInstructions;
+	ctx.deadline = std::chrono::steady_clock::now() + std::chrono::microseconds((long long) (budget.maxMs * 1000.0f));
+	ctx.current_dc.transform = mat4(1.0f);
+	ctx.current_dc.renderBits = 0;
+	ctx.current_dc.modelName = "";
+	ctx.instance_data = &object;
+	ctx.object_data = objdata;
+	ctx.transformStack.clear();
+	ctx.draw_calls.clear();
 
 	// execute chunk
-	lua_rawgeti(L, LUA_REGISTRYINDEX, draw_fn);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, chunk->second);
 	int result = lua_pcall(L, 0, 0, 0);
 
 	// check for errors
@@ -787,60 +1121,402 @@ void ObjectLayout::buildObjectCache(ObjectInstance& object, DFFCache* cache, Obj
 		auto err = lua_tostring(L, -1);
 		log_error("INTERNAL LUA ERROR: %s", err);
 		lua_pop(L, 1);
-		draw_calls.clear();
 		object.fallback_render = true;
 	} else {
-		log_info("LUA OK");
+		calls.swap(ctx.draw_calls);
+	}
+}
+
+// run object's draw block, safe to call from several threads for different objects
+static void runDrawBlock(ObjectLayout::ObjectInstance& object, ObjectList::ObjectTypeData* objdata, int id,
+						 std::vector<DrawCall>& calls) {
+	DrawFunction fn = getDrawFunction(object.type, objdata);
+
+	// set object as debug cube if lacking draw function
+	if (!fn.hasSource) {
+		object.fallback_render = true;
+		return;
 	}
 
-	// set object cache
-	for (auto& draw_call : draw_calls) {
-		object.cache.emplace_back();
-		auto& cacheModel = object.cache.back();
+	auto& budget = getDrawBudget();
+	auto start = std::chrono::steady_clock::now();
+	DrawScript::Result result = DrawScript::UNSUPPORTED;
+	if (fn.script) {
+		vec3 rotation(object.rot_x, object.rot_y, object.rot_z);
+		result = fn.script->run(rotation, object.misc, budget.maxInstructions, budget.maxCalls, calls);
+		if (result == DrawScript::OVER_BUDGET) {
+			log_error("%s(%d): draw block exceeded budget", objdata->debugName, id);
+			object.fallback_render = true;
+		}
+	}
+	// not compiled, or the instance needs something only lua handles (eg. concatenating a number)
+	if (result == DrawScript::UNSUPPORTED) {
+		auto state = acquireLuaState();
+		runLuaDrawFn(state, object, objdata, id, calls);
+		releaseLuaState(state);
+	}
+	auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	std::lock_guard<std::mutex> lock(profile_mutex);
+	auto& profile = draw_profiles[object.type];
+	profile.runs++;
+	if (result == DrawScript::UNSUPPORTED) profile.luaRuns++;
+	if (object.fallback_render) profile.failures++;
+	profile.totalMs += elapsed;
+	if (elapsed > profile.maxMs) profile.maxMs = elapsed;
+	for (auto& call : calls) profile.drawCalls += call.instancing.count;
+}
+
+// forget compiled draw blocks after the object list was reloaded, must not run while caches are being built
+static void invalidateDrawFunctions(const std::vector<int>& changedTypes) {
+	{
+		// native scripts point at type data that the reload replaced, so all of them are recompiled on next use
+		std::lock_guard<std::mutex> lock(draw_fns_mutex);
+		for (auto& entry : object_draw_fns) delete entry.second.script;
+		object_draw_fns.clear();
+	}
+	{
+		// lua chunks only depend on the source, so only changed ones are dropped
+		std::lock_guard<std::mutex> lock(lua_pool_mutex);
+		for (auto state : lua_pool) {
+			for (int type : changedTypes) {
+				auto chunk = state->chunks.find(type);
+				if (chunk == state->chunks.end()) continue;
+				luaL_unref(state->L, LUA_REGISTRYINDEX, chunk->second);
+				state->chunks.erase(chunk);
+			}
+		}
+	}
+	std::lock_guard<std::mutex> lock(profile_mutex);
+	for (int type : changedTypes) draw_profiles.erase(type);
+}
+
+void Stage::reloadObjectTypes(const std::vector<int>& changedTypes) {
+	invalidateDrawFunctions(changedTypes);
+	if (changedTypes.empty()) return;
+
+	std::unordered_set<int> types(changedTypes.begin(), changedTypes.end());
+	if (layout_db) layout_db->invalidateTypes(types);
+	if (layout_pb) layout_pb->invalidateTypes(types);
+	if (layout_p1) layout_p1->invalidateTypes(types);
+	pickDirty = true;
+}
+
+static void drawProfileUI(ObjectList* objdb) {
+	std::vector<std::pair<int, DrawProfile>> profiles;
+	{
+		std::lock_guard<std::mutex> lock(profile_mutex);
+		profiles.assign(draw_profiles.begin(), draw_profiles.end());
+	}
+	std::sort(profiles.begin(), profiles.end(), [](const std::pair<int, DrawProfile>& a, const std::pair<int, DrawProfile>& b) {
+		return a.second.totalMs > b.second.totalMs;
+	});
+
+	if (ImGui::Button("Reset")) {
+		std::lock_guard<std::mutex> lock(profile_mutex);
+		draw_profiles.clear();
+	}
+	ImGui::Columns(5);
+	ImGui::TextUnformatted("Type");
+	ImGui::NextColumn();
+	ImGui::TextUnformatted("Runs (lua)");
+	ImGui::NextColumn();
+	ImGui::TextUnformatted("Total ms");
+	ImGui::NextColumn();
+	ImGui::TextUnformatted("Max ms");
+	ImGui::NextColumn();
+	ImGui::TextUnformatted("Draws/run");
+	ImGui::NextColumn();
+	ImGui::Separator();
+	for (auto& entry : profiles) {
+		auto& profile = entry.second;
+		auto objdata = objdb->getObjectData(u8(entry.first >> 8), u8(entry.first & 0xff));
+		ImGui::Text("[%02x][%02x]", entry.first >> 8, entry.first & 0xff);
+		if (objdata && objdata->debugName && ImGui::IsItemHovered()) ImGui::SetTooltip("%s", objdata->debugName);
+		ImGui::NextColumn();
+		if (profile.failures) {
+			ImGui::TextColored(ImVec4(1.0f, 0.25f, 0.0f, 1.0f), "%d (%d), %d failed", profile.runs, profile.luaRuns, profile.failures);
+		} else {
+			ImGui::Text("%d (%d)", profile.runs, profile.luaRuns);
+		}
+		ImGui::NextColumn();
+		ImGui::Text("%.2f", profile.totalMs);
+		ImGui::NextColumn();
+		ImGui::Text("%.3f", profile.maxMs);
+		ImGui::NextColumn();
+		ImGui::Text("%.1f", profile.runs ? (double) profile.drawCalls / profile.runs : 0.0);
+		ImGui::NextColumn();
+	}
+	ImGui::Columns(1);
+}
+
+ObjectLayout::CachedDrawList::~CachedDrawList() {
+	for (auto& cached : models) {
+		dffCache->release(cached.model);
+	}
+}
+
+ObjectLayout::DrawKey::DrawKey(const ObjectInstance& object) {
+	type = object.type;
+	rot[0] = object.rot_x;
+	rot[1] = object.rot_y;
+	rot[2] = object.rot_z;
+	memcpy(misc, object.misc, sizeof(misc));
+}
+
+size_t ObjectLayout::DrawKeyHash::operator()(const DrawKey& key) const {
+	// FNV-1a
+	const u8* p = (const u8*) &key;
+	u64 hash = 14695981039346656037ull;
+	for (size_t i = 0; i < sizeof(DrawKey); i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ull;
+	}
+	return (size_t) hash;
+}
+
+shared_ptr<const ObjectLayout::CachedDrawList> ObjectLayout::findMemo(const DrawKey& key) {
+	auto it = drawMemo.find(key);
+	if (it == drawMemo.end()) return nullptr;
+	auto list = it->second.lock();
+	if (!list) drawMemo.erase(it);
+	return list;
+}
+
+// resolve draw calls to models, main thread only as DFFCache isn't thread safe
+static shared_ptr<const ObjectLayout::CachedDrawList> makeDrawList(DFFCache* cache, const std::vector<DrawCall>& calls) {
+	auto list = std::make_shared<ObjectLayout::CachedDrawList>();
+	list->dffCache = cache;
+	list->models.reserve(calls.size());
+	for (auto& draw_call : calls) {
+		list->models.emplace_back();
+		auto& cacheModel = list->models.back();
 		cacheModel.transform = draw_call.transform;
 		cacheModel.renderBits = draw_call.renderBits;
-		cacheModel.model = cache->getDFF(draw_call.modelName.c_str());
+		cacheModel.instancing = draw_call.instancing;
+		cacheModel.model = cache->acquire(draw_call.modelName.c_str());
+	}
+	return list;
+}
+
+void ObjectLayout::buildObjectCache(ObjectInstance& object, DFFCache* cache, ObjectList* objdb, int id) {
+	// reuse the list of an identical object
+	DrawKey key(object);
+	object.cache = findMemo(key);
+	if (object.cache) return;
+
+	// find object data from ObjectList.ini
+	auto objdata = objdb->getObjectData(u8(object.type >> 8), u8(object.type & 0xff));
+
+	std::vector<DrawCall> calls;
+	runDrawBlock(object, objdata, id, calls);
+	if (object.fallback_render) return;
+	object.cache = makeDrawList(cache, calls);
+	drawMemo[key] = object.cache;
+}
+
+static bool isInDrawRange(const ObjectLayout::ObjectInstance& object, glm::vec3 camPos) {
+	vec3 delta = camPos - vec3(object.pos_x,object.pos_y,object.pos_z);
+	return delta.x*delta.x + delta.y*delta.y + delta.z*delta.z <= object.radius*object.radius*10000;
+}
+
+void ObjectLayout::collectRebuilds(glm::vec3 camPos, std::vector<CacheRebuild>& out) {
+	for (int id = 0; id < objects.size(); id++) {
+		auto& object = objects[id];
+		if (!object.cache_invalid || object.fallback_render || !isInDrawRange(object, camPos)) continue;
+		vec3 delta = camPos - vec3(object.pos_x, object.pos_y, object.pos_z);
+		out.push_back({glm::dot(delta, delta), this, id});
 	}
 }
 
-void ObjectLayout::draw(glm::vec3 camPos, DFFCache* cache, ObjectList* objdb, int picking) {
+void ObjectLayout::rebuildCache(int id, DFFCache* cache, ObjectList* objdb) {
+	auto& object = objects[id];
+	clearObjectCache(object);
+	buildObjectCache(object, cache, objdb, id);
+	object.cache_invalid = false;
+	boundsDirty = true;
+}
+
+void ObjectLayout::buildCaches(DFFCache* cache, ObjectList* objdb) {
+	// only the first of each set of identical objects runs its draw block
+	std::vector<int> ids;
+	std::vector<int> duplicates;
+	std::unordered_set<DrawKey, DrawKeyHash> pending;
+	for (int id = 0; id < objects.size(); id++) {
+		auto& object = objects[id];
+		if (!object.cache_invalid || object.fallback_render) continue;
+		clearObjectCache(object);
+		DrawKey key(object);
+		if ((object.cache = findMemo(key))) {
+			object.cache_invalid = false;
+		} else if (pending.insert(key).second) {
+			ids.push_back(id);
+		} else {
+			duplicates.push_back(id);
+		}
+	}
+
+	// run draw blocks on worker threads
+	std::vector<std::vector<DrawCall>> results(ids.size());
+	parallel_for((int) ids.size(), [&](int i) {
+		auto& object = objects[ids[i]];
+		auto objdata = objdb->getObjectData(u8(object.type >> 8), u8(object.type & 0xff));
+		runDrawBlock(object, objdata, ids[i], results[i]);
+	});
+
+	for (int i = 0; i < ids.size(); i++) {
+		auto& object = objects[ids[i]];
+		if (!object.fallback_render) {
+			object.cache = makeDrawList(cache, results[i]);
+			drawMemo[DrawKey(object)] = object.cache;
+		}
+		object.cache_invalid = false;
+	}
+	for (int id : duplicates) {
+		auto& object = objects[id];
+		object.cache = findMemo(DrawKey(object));
+		if (object.cache) {
+			object.cache_invalid = false;
+		} else {
+			// the object it was identical to failed, which this one would too
+			object.fallback_render = true;
+		}
+	}
+	boundsDirty = true;
+}
+
+void ObjectLayout::clearObjectCache(ObjectInstance& object) {
+	object.cache.reset();
+}
+
+void ObjectLayout::invalidateTypes(const std::unordered_set<int>& types) {
+	for (auto& object : objects) {
+		if (!types.count(object.type)) continue;
+		object.cache_invalid = true;
+		object.fallback_render = false; // the new draw block may not fail
+	}
+	for (auto it = drawMemo.begin(); it != drawMemo.end(); ) {
+		if (types.count(it->first.type)) it = drawMemo.erase(it);
+		else ++it;
+	}
+}
+
+void ObjectLayout::releaseCaches(DFFCache* cache) {
+	for (auto& object : objects) {
+		clearObjectCache(object);
+		object.cache_invalid = true;
+	}
+	drawMemo.clear();
+}
+
+// world transform of one instance of a cached model
+static mat4 instanceTransform(const mat4& model_transform, const ObjectLayout::CachedModel& cached, int i) {
+	if (cached.instancing.kind == DrawScript::Instancing::SINGLE) return model_transform * cached.transform;
+	return model_transform * cached.transform * cached.instancing.get(i);
+}
+
+// half size of the debug box drawn for objects without a model
+static const float FALLBACK_BOX_SIZE = 5.0f;
+
+void ObjectLayout::getObjectBounds(int id, glm::vec3& low, glm::vec3& high) {
+	auto& object = objects[id];
+	const vec3 position(object.pos_x, object.pos_y, object.pos_z);
+	low = position - vec3(FALLBACK_BOX_SIZE);
+	high = position + vec3(FALLBACK_BOX_SIZE);
+
+	const mat4 model_transform = glm::translate(glm::mat4(), position);
+	if (object.cache) for (auto& cached : object.cache->models) {
+		vec3 modelLow(-FALLBACK_BOX_SIZE), modelHigh(FALLBACK_BOX_SIZE);
+		if (cached.model && cached.model->isLoaded()) cached.model->getBounds(modelLow, modelHigh);
+
+		for (int i = 0; i < cached.instancing.count; i++) {
+			vec3 worldLow, worldHigh;
+			transformAabb(instanceTransform(model_transform, cached, i), modelLow, modelHigh, worldLow, worldHigh);
+			low = glm::min(low, worldLow);
+			high = glm::max(high, worldHigh);
+		}
+	}
+}
+
+bool ObjectLayout::intersectObject(int id, const Ray& ray, glm::vec3 camPos, float& t) {
+	auto& object = objects[id];
+	if (!isInDrawRange(object, camPos)) return false;
+
+	const vec3 position(object.pos_x, object.pos_y, object.pos_z);
+	const vec3 boxSize(FALLBACK_BOX_SIZE);
+	if (object.fallback_render || object.cache_invalid) {
+		return rayIntersectAabb(ray, position - boxSize, position + boxSize, t);
+	}
+
+	bool hit = false;
+	const mat4 model_transform = glm::translate(glm::mat4(), position);
+	if (object.cache) for (auto& cached : object.cache->models) {
+		for (int i = 0; i < cached.instancing.count; i++) {
+			float modelT;
+			bool modelHit;
+			if (cached.model && cached.model->isLoaded()) {
+				modelHit = cached.model->intersect(instanceTransform(model_transform, cached, i), ray, modelT);
+			} else {
+				modelHit = rayIntersectAabb(ray, position - boxSize, position + boxSize, modelT);
+			}
+			if (modelHit && (!hit || modelT < t)) {
+				t = modelT;
+				hit = true;
+			}
+		}
+	}
+	return hit;
+}
+
+void ObjectLayout::drawPicking(int id, glm::vec3 camPos, int list) {
+	auto& object = objects[id];
+	if (!isInDrawRange(object, camPos)) return;
+
+	const u32 pick_color = (u8(list) << 16) | (u16(id));
+	const vec3 position(object.pos_x, object.pos_y, object.pos_z);
+	if (object.fallback_render || object.cache_invalid) {
+		DFFModel::draw_solid_box(position, pick_color | 0xff000000, 1);
+		return;
+	}
+
+	const mat4 model_transform = glm::translate(glm::mat4(), position);
+	if (object.cache) for (auto& cached : object.cache->models) {
+		if (cached.model && cached.model->isLoaded()) {
+			for (int i = 0; i < cached.instancing.count; i++) {
+				cached.model->draw(instanceTransform(model_transform, cached, i), cached.renderBits, pick_color);
+			}
+		} else {
+			DFFModel::draw_solid_box(position, pick_color | 0xff000000, 1);
+		}
+	}
+}
+
+void ObjectLayout::draw(glm::vec3 camPos) {
 	const Aabb box = {
-			{-5, -5, -5},
-			{5, 5, 5},
+			{-FALLBACK_BOX_SIZE, -FALLBACK_BOX_SIZE, -FALLBACK_BOX_SIZE},
+			{FALLBACK_BOX_SIZE, FALLBACK_BOX_SIZE, FALLBACK_BOX_SIZE},
 	};
 	int id = 0;
 	for (auto& object : objects) {
-		vec3 delta = camPos - vec3(object.pos_x,object.pos_y,object.pos_z);
-		if (delta.x*delta.x + delta.y*delta.y + delta.z*delta.z > object.radius*object.radius*10000) {
+		if (!isInDrawRange(object, camPos)) {
 			id++; continue;
 		}
-		u32 pick_color = (u8(picking) << 16) | (u16(id));
-		if (object.fallback_render) {
-			// debug cube render for objects without any defined render
-			if (picking) {
-				DFFModel::draw_solid_box(vec3(object.pos_x, object.pos_y, object.pos_z), pick_color | 0xff000000, 1);
-			} else {
-				ddPush();
-				ddSetTranslate(object.pos_x, object.pos_y, object.pos_z);
-				ddSetState(true, true, false);
-				ddDraw(box);
-				ddPop();
-			}
+		if (object.fallback_render || object.cache_invalid) {
+			// debug cube render for objects without any defined render, or waiting for their cache to be rebuilt
+			ddPush();
+			ddSetTranslate(object.pos_x, object.pos_y, object.pos_z);
+			ddSetState(true, true, false);
+			ddDraw(box);
+			ddPop();
 		} else {
-			if (object.cache_invalid) {
-				object.cache.clear();
-				buildObjectCache(object, cache, objdb, id);
-				object.cache_invalid = false;
-			}
-			for (auto& cached : object.cache) {
-				mat4 transform = cached.transform;
-				mat4 model_transform = glm::translate(glm::mat4(), glm::vec3(object.pos_x, object.pos_y, object.pos_z));
-				if (cached.model) {
-					cached.model->draw(model_transform * transform, cached.renderBits, picking ? pick_color : 0);
-				} else {
-					if (picking) {
-						DFFModel::draw_solid_box(vec3(object.pos_x, object.pos_y, object.pos_z), pick_color | 0xff000000, 1);
+			mat4 model_transform = glm::translate(glm::mat4(), glm::vec3(object.pos_x, object.pos_y, object.pos_z));
+			if (object.cache) for (auto& cached : object.cache->models) {
+				for (int i = 0; i < cached.instancing.count; i++) {
+					mat4 transform = instanceTransform(model_transform, cached, i);
+					if (cached.model && cached.model->isLoaded()) {
+						cached.model->draw(transform, cached.renderBits);
 					} else {
+						// missing model, or placeholder while the cache is still loading it
 						ddPush();
 						ddSetTransform(&transform);
 						ddSetState(true, true, false);
@@ -855,30 +1531,6 @@ void ObjectLayout::draw(glm::vec3 camPos, DFFCache* cache, ObjectList* objdb, in
 	}
 }
 
-static char* propNameCurrent(const char* p) {
-	static char buffer[32];
-	int i = 0;
-	while (i < 32 && p[i] && p[i] != ';') {
-		buffer[i] = p[i];
-		i++;
-	}
-	buffer[i] = 0;
-	return buffer;
-}
-
-static const char* propNameAdvance(const char* p) {
-	const char* result = p;
-	while (*result && *result != ';') result++;
-	if (*result) result++;
-	return result;
-}
-
-static u8* align(u8* ptr, int alignment) {
-	uptr ptr_int = (uptr) ptr;
-	while (ptr_int % alignment) ptr_int++;
-	return (u8*) ptr_int;
-}
-
 Camera* getCamera();
 const char* getOutPath();
 const char* getStageFilename();
@@ -890,6 +1542,9 @@ void setSelectedObject(int list, int ob) {
 
 void ObjectLayout::drawUI(glm::vec3 camPos, ObjectList* objdb) {
 	ImGui::Text("Layout contains %d instances", objects.size());
+	int sharedLists = 0;
+	for (auto& memo : drawMemo) if (!memo.second.expired()) sharedLists++;
+	ImGui::TextDisabled("%d unique draw lists", sharedLists);
 	ImGui::DragInt("instance", &obSel, 1.0f, 0, objects.size() - 1);
 	if (ImGui::Button("Save")) {
 		FSPath outDVDRoot(getOutPath());
@@ -907,7 +1562,10 @@ void ObjectLayout::drawUI(glm::vec3 camPos, ObjectList* objdb) {
 		ImGui::Text("Type: [%02x][%02x] (%s)", obj.type >> 8, obj.type & 0xff, objdata ? objdata->debugName : "<unknown>");
 
 		if (ImGui::DragInt("Type", &obj.type, 1.0f, 0, 0xffff)) obj.cache_invalid = true;
-		if (ImGui::DragFloat3("Position", &obj.pos_x)) obj.cache_invalid = true;
+		if (ImGui::DragFloat3("Position", &obj.pos_x)) {
+			obj.cache_invalid = true;
+			boundsDirty = true;
+		}
 		if (ImGui::DragFloat3("Rotation", &obj.rot_x)) obj.cache_invalid = true;
 		ImGui::InputInt("LinkID", &obj.linkID);
 		ImGui::DragInt("Radius", &obj.radius);
@@ -923,76 +1581,43 @@ void ObjectLayout::drawUI(glm::vec3 camPos, ObjectList* objdb) {
 		ImGui::Text("Misc");
 		ImGui::TextDisabled("format %s", objdata && objdata->miscFormat ? objdata->miscFormat : "unknown");
 
-		if (objdata && objdata->miscFormat && objdata->miscProperties) {
-			int propertyCount = strlen(objdata->miscFormat);
-			u8* ptr = obj.misc;
-			const char* propNamePtr = objdata->miscProperties;
-
-			for (int i = 0; i < propertyCount; i++) {
-				const char* propName = propNameCurrent(propNamePtr);
+		if (objdata && !objdata->properties.empty()) {
+			for (int i = 0; i < objdata->properties.size(); i++) {
+				auto& property = objdata->properties[i];
+				const char* propName = property.name.c_str();
 				ImGui::PushID(i);
-				switch (objdata->miscFormat[i]) {
-					case 'c':
-					case 'C': {
-						int value = *ptr;
-						if (ImGui::DragInt(propName, &value, 1.0f, 0x00, 0xff)) {
-							*ptr = (u8) value;
+				double value;
+				objdata->readProperty(i, obj.misc, value);
+				switch (property.type) {
+					case ObjectList::PROPERTY_U8:
+					case ObjectList::PROPERTY_U16: {
+						int max = property.type == ObjectList::PROPERTY_U8 ? 0xff : 0xffff;
+						int intValue = (int) value;
+						if (ImGui::DragInt(propName, &intValue, 1.0f, 0, max)) {
+							objdata->writeProperty(i, obj.misc, intValue);
 							obj.cache_invalid = true;
 						}
-						ptr += sizeof(u8);
-					}
-						break;
-					case 's':
-					case 'S': {
-						ptr = align(ptr, 2);
-						u16 value16 = *(u16*) ptr;
-						swapEndianness(&value16);
-						int value = value16;
-						if (ImGui::DragInt(propName, &value, 1.0f, 0x0000, 0xffff)) {
-							value16 = (u16) value;
-							swapEndianness(&value16);
-							*(u16*) ptr = value16;
+					} break;
+					case ObjectList::PROPERTY_U32: {
+						i32 intValue = (i32) (u32) value;
+						if (ImGui::DragInt(propName, &intValue, 1.0f)) {
+							objdata->writeProperty(i, obj.misc, (u32) intValue);
 							obj.cache_invalid = true;
 						}
-						ptr += sizeof(u16);
-					}
-						break;
-					case 'x':
-					case 'X':
-					case 'i':
-					case 'I': {
-						ptr = align(ptr, 4);
-						u32 value = *(u32*) ptr;
-						swapEndianness(&value);
-						if (ImGui::DragInt(propName, (i32*) &value, 1.0f)) {
-							swapEndianness(&value);
-							*(u32*) ptr = (u32) value;
+					} break;
+					case ObjectList::PROPERTY_FLOAT: {
+						float floatValue = (float) value;
+						if (ImGui::DragFloat(propName, &floatValue, 1.0f)) {
+							objdata->writeProperty(i, obj.misc, floatValue);
 							obj.cache_invalid = true;
 						}
-						ptr += sizeof(u32);
-					}
-						break;
-					case 'f':
-					case 'F': {
-						ptr = align(ptr, 4);
-						float value = *(float*) ptr;
-						swapEndianness(&value);
-						if (ImGui::DragFloat(propName, &value, 1.0f)) {
-							swapEndianness(&value);
-							*(float*) ptr = value;
-							obj.cache_invalid = true;
-						}
-						ptr += sizeof(float);
-					}
-						break;
+					} break;
 					default: {
 						ImGui::TextColored(ImVec4(1, 0, 0, 1), "ERROR: Unknown format %c, please report",
-										   objdata->miscFormat[i]);
+										   property.format);
 					}
 				}
 				ImGui::PopID();
-
-				propNamePtr = propNameAdvance(propNamePtr);
 			}
 		} else {
 			ImGui::TextDisabled("Cannot display property editor");
@@ -3,11 +3,22 @@
 #include "render/BSPModel.hh"
 #include "io/ONEArchive.hh"
 #include <list>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <bigg.hpp>
 #include "render/TexDictionary.hh"
 #include "render/TXCAnimation.hh"
 #include "render/DFFModel.hh"
 #include "util/ObjectList.hh"
+#include "render/DrawScript.hh"
+#include "util/BVH.hh"
+#include "util/Arena.hh"
 
 class VisibilityManager {
 	struct VisibilityBlock {
@@ -42,13 +53,73 @@ public:
 	void drawDebug(glm::vec3 camPos);
 };
 
+// Lazily loaded set of DFF models from one or more ONE archives
+// Archives are only indexed when added; each model is decompressed and parsed on a worker thread the first
+// time it is requested, and uploaded on the main thread during update(). Until then the returned model is an
+// empty placeholder (DFFModel::isLoaded() returns false). Unreferenced models are evicted once the memory
+// budget is exceeded.
 class DFFCache {
 private:
-	std::map<std::string, DFFModel*> cache;
+	enum class EntryState {
+		Unloaded, Queued, Parsed, Ready
+	};
+	struct Entry {
+		ONEArchive* archive;
+		int fileIndex;
+		TexDictionary* txd;
+		DFFModel* model = nullptr;
+		Buffer* data = nullptr; // decompressed file the worker could read through chunk views, waiting for upload
+		rw::ClumpChunk* clump = nullptr; // result of worker parse otherwise, waiting for upload
+		std::atomic<EntryState> state{EntryState::Unloaded}; // written by both threads, read by the main thread without mutex
+		int refs = 0;
+		u32 releasedFrame = 0;
+	};
+	std::map<std::string, Entry> cache;
+	std::unordered_map<DFFModel*, Entry*> modelEntries;
+	std::vector<ONEArchive*> archives;
+
+	// worker thread state, mutex guards loadQueue, parsedList, workerQuit and the data and clump of queued entries
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable workerSignal;
+	std::deque<Entry*> loadQueue;
+	std::vector<Entry*> parsedList;
+	bool workerQuit = false;
+	Arena workerScratch{16 << 10}; // only used by workerMain, on the worker thread
+
+	size_t memoryUsed = 0;
+	size_t memoryBudget;
+	u32 frame = 0;
+	Arena uploadScratch{64 << 10}; // only used by update, on the main thread
+
+	void workerMain();
+	void requestLoad(Entry& entry);
+	void evict();
 public:
+	DFFCache();
 	~DFFCache();
 	void addFromArchive(FSPath& onePath, TexDictionary* txd);
+
+	/// get model by name without taking a reference (nullptr if not in any archive)
 	DFFModel* getDFF(const char* name);
+	/// get model by name and hold a reference to it, preventing eviction
+	DFFModel* acquire(const char* name);
+	/// release a reference taken by acquire
+	void release(DFFModel* model);
+
+	/// upload models finished by the worker and evict unused models over budget (call once per frame)
+	/// returns true if any models finished loading
+	bool update();
+	void drawUI();
+};
+
+class ObjectLayout;
+
+// object waiting for its cache to be rebuilt
+struct CacheRebuild {
+	float distance; // squared distance to camera
+	ObjectLayout* layout;
+	int id;
 };
 
 class ObjectLayout {
@@ -57,6 +128,13 @@ public:
 		glm::mat4 transform;
 		DFFModel* model;
 		int renderBits;
+		DrawScript::Instancing instancing;
+	};
+	// draw result shared by every object with the same type, rotation and misc data
+	struct CachedDrawList {
+		std::vector<CachedModel> models;
+		DFFCache* dffCache; // models are released back to this when the last object drops the list
+		~CachedDrawList();
 	};
 	struct ObjectInstance {
 		float pos_x;
@@ -71,17 +149,51 @@ public:
 		u8 misc[32];
 		bool cache_invalid = true;
 		bool fallback_render = false;
-		std::vector<CachedModel> cache;
+		shared_ptr<const CachedDrawList> cache;
 	};
 private:
 	std::vector<ObjectInstance> objects;
+
+	// draw lists of live objects by what their draw block depends on
+	struct DrawKey {
+		int type;
+		float rot[3];
+		u8 misc[32];
+		DrawKey(const ObjectInstance& object);
+		bool operator==(const DrawKey& other) const { return !memcmp(this, &other, sizeof(DrawKey)); }
+	};
+	struct DrawKeyHash {
+		size_t operator()(const DrawKey& key) const;
+	};
+	std::unordered_map<DrawKey, std::weak_ptr<const CachedDrawList>, DrawKeyHash> drawMemo;
+	shared_ptr<const CachedDrawList> findMemo(const DrawKey& key);
+
 	void buildObjectCache(ObjectInstance& object, DFFCache* cache, ObjectList* objdb, int id);
+	void clearObjectCache(ObjectInstance& object);
 public:
-	void read(FSPath& binFile);
+	/// read layout, with temporaries allocated from scratch
+	void read(FSPath& binFile, Arena& scratch);
 	void write(FSPath& binFile);
 
-	void draw(glm::vec3 camPos, DFFCache* cache, ObjectList* objdb, int picking);
+	/// draw objects in range, objects with invalid caches are drawn as boxes
+	void draw(glm::vec3 camPos);
+	/// draw a single object to the gpu pick view with its id as color
+	void drawPicking(int id, glm::vec3 camPos, int list);
 	void drawUI(glm::vec3 camPos, ObjectList* objdb);
+	void releaseCaches(DFFCache* cache);
+	/// invalidate caches of objects with the given types, after their definitions were reloaded
+	void invalidateTypes(const std::unordered_set<int>& types);
+	/// build caches of all invalid objects, running their draw blocks in parallel
+	void buildCaches(DFFCache* cache, ObjectList* objdb);
+	/// add objects in draw range with invalid caches to out
+	void collectRebuilds(glm::vec3 camPos, std::vector<CacheRebuild>& out);
+	void rebuildCache(int id, DFFCache* cache, ObjectList* objdb);
+
+	// set when object caches are rebuilt, cleared by whoever consumes the bounds
+	bool boundsDirty = true;
+	int getObjectCount() { return (int) objects.size(); }
+	void getObjectBounds(int id, glm::vec3& low, glm::vec3& high);
+	bool intersectObject(int id, const Ray& ray, glm::vec3 camPos, float& t);
 
 	ObjectInstance* get(int id);
 };
@@ -96,17 +208,34 @@ class Stage {
 	ObjectLayout* layout_p1 = nullptr;
 	DFFCache* cache = nullptr;
 	ObjectList* objdb = nullptr;
+	BVH pickBVH;
+	bool pickDirty = true;
+	void updatePickBVH();
+	std::vector<CacheRebuild> rebuildQueue;
+	/// rebuild invalid object caches within the per-frame budget
+	void rebuildObjectCaches(glm::vec3 camPos);
+	std::vector<int> reloadedTypes;
+	/// drop compiled draw blocks and caches of object types changed by an ObjectList.ini reload
+	void reloadObjectTypes(const std::vector<int>& changedTypes);
+	/// scratch memory for reading stage files, reset after each file
+	Arena loadArena{256 << 10};
 public:
 	Stage();
 	~Stage();
 	void fromArchive(ONEArchive* x, TexDictionary* txd);
 	void readVisibility(FSPath& blkFile);
 	void readLayout(const char* dvdroot, const char* stgname);
-	void draw(glm::vec3 camPos, TXCAnimation* txc, bool picking);
+	void draw(glm::vec3 camPos, TXCAnimation* txc);
 	void drawUI(glm::vec3 camPos);
 	void drawVisibilityUI(glm::vec3 camPos);
 	void drawLayoutUI(glm::vec3 camPos);
 	void drawDebug(glm::vec3 camPos);
+	void drawCacheUI();
+
+	// cast ray against objects in all layouts, returns false if nothing was hit
+	bool pick(const Ray& ray, glm::vec3 camPos, int& list, int& index);
+	// draw objects whose bounds are hit by ray to the gpu pick view
+	void drawPicking(const Ray& ray, glm::vec3 camPos);
 
 	void readCache(FSPath& oneFile, TexDictionary* txd);
 };
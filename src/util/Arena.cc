@@ -0,0 +1,58 @@
+#include "Arena.hh"
+#include <stdlib.h>
+
+Arena::Arena(size_t blockSize) : blockSize(blockSize) {}
+
+Arena::~Arena() {
+	for (auto& block : blocks) free(block.data);
+}
+
+void Arena::nextBlock(size_t size) {
+	// move on to the next kept block if it's big enough, otherwise insert a new one there
+	if (!blocks.empty()) blockIndex++;
+	if (blockIndex < blocks.size() && blocks[blockIndex].size >= size) {
+		blockUsed = 0;
+		return;
+	}
+	Block block;
+	block.size = size > blockSize ? size : blockSize;
+	block.data = (u8*) malloc(block.size);
+	if (!block.data) {
+		log_error("Arena failed to allocate %zu bytes", block.size);
+		abort();
+	}
+	blocks.insert(blocks.begin() + blockIndex, block);
+	blockUsed = 0;
+}
+
+void* Arena::alloc(size_t size, size_t align) {
+	size_t offset = 0;
+	if (blockIndex < blocks.size()) {
+		offset = (blockUsed + align - 1) & ~(align - 1);
+	}
+	if (blockIndex >= blocks.size() || offset + size > blocks[blockIndex].size) {
+		// malloc aligns new blocks for anything up to std::max_align_t
+		nextBlock(size);
+		offset = 0;
+	}
+
+	used += offset - blockUsed + size;
+	if (used > peak) peak = used;
+	blockUsed = offset + size;
+	return blocks[blockIndex].data + offset;
+}
+
+void Arena::reset() {
+	// larger blocks from a big load are given back, the first one is enough for typical use
+	for (size_t i = 1; i < blocks.size(); i++) free(blocks[i].data);
+	if (blocks.size() > 1) blocks.resize(1);
+	blockIndex = 0;
+	blockUsed = 0;
+	used = 0;
+}
+
+size_t Arena::getCapacity() const {
+	size_t capacity = 0;
+	for (auto& block : blocks) capacity += block.size;
+	return capacity;
+}
@@ -0,0 +1,45 @@
+// Arena.hh: Bump allocator for short-lived scratch memory
+// Allocations are never freed one by one, the whole arena is reset once the work using it is done
+
+#pragma once
+#include "common.hh"
+#include <cstddef>
+
+class Arena {
+	struct Block {
+		u8* data;
+		size_t size;
+	};
+	std::vector<Block> blocks;
+	size_t blockIndex = 0; // block being allocated from
+	size_t blockUsed = 0; // bytes used in that block
+	size_t blockSize;
+
+	size_t used = 0; // bytes handed out since the last reset, including alignment
+	size_t peak = 0;
+
+	void nextBlock(size_t size);
+public:
+	/// blocks are allocated blockSize bytes at a time, or larger for allocations that don't fit
+	Arena(size_t blockSize = 1 << 20);
+	~Arena();
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	/// get size bytes aligned to align, valid until the next reset
+	void* alloc(size_t size, size_t align = alignof(std::max_align_t));
+
+	/// get uninitialised space for count objects of T, which must be trivially destructible
+	template<typename T>
+	T* allocArray(size_t count) {
+		return (T*) alloc(count * sizeof(T), alignof(T));
+	}
+
+	/// free everything allocated, keeping the first block for reuse
+	void reset();
+
+	size_t getUsed() const { return used; }
+	size_t getPeak() const { return peak; }
+	/// bytes currently reserved from the heap
+	size_t getCapacity() const;
+};
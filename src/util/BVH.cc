@@ -0,0 +1,172 @@
+#include "BVH.hh"
+#include <algorithm>
+#include <float.h>
+
+bool rayIntersectAabb(const Ray& ray, const glm::vec3& low, const glm::vec3& high, float& t) {
+	float tmin = 0.0f;
+	float tmax = FLT_MAX;
+	for (int axis = 0; axis < 3; axis++) {
+		float inv = 1.0f / ray.dir[axis];
+		float t0 = (low[axis] - ray.origin[axis]) * inv;
+		float t1 = (high[axis] - ray.origin[axis]) * inv;
+		if (t0 > t1) std::swap(t0, t1);
+		if (t0 > tmin) tmin = t0;
+		if (t1 < tmax) tmax = t1;
+		if (tmin > tmax) return false;
+	}
+	t = tmin;
+	return true;
+}
+
+bool rayIntersectTriangle(const Ray& ray, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, float& t) {
+	// Moller-Trumbore
+	const float EPSILON = 1e-7f;
+	glm::vec3 edge1 = b - a;
+	glm::vec3 edge2 = c - a;
+	glm::vec3 p = glm::cross(ray.dir, edge2);
+	float det = glm::dot(edge1, p);
+	if (det > -EPSILON && det < EPSILON) return false;
+
+	float invDet = 1.0f / det;
+	glm::vec3 s = ray.origin - a;
+	float u = glm::dot(s, p) * invDet;
+	if (u < 0.0f || u > 1.0f) return false;
+
+	glm::vec3 q = glm::cross(s, edge1);
+	float v = glm::dot(ray.dir, q) * invDet;
+	if (v < 0.0f || u + v > 1.0f) return false;
+
+	float dist = glm::dot(edge2, q) * invDet;
+	if (dist < 0.0f) return false;
+	t = dist;
+	return true;
+}
+
+Ray transformRay(const glm::mat4& transform, const Ray& ray) {
+	Ray out;
+	out.origin = glm::vec3(transform * glm::vec4(ray.origin, 1.0f));
+	out.dir = glm::vec3(transform * glm::vec4(ray.dir, 0.0f)); // not normalized so distances are preserved
+	return out;
+}
+
+void transformAabb(const glm::mat4& transform, const glm::vec3& low, const glm::vec3& high,
+				   glm::vec3& outLow, glm::vec3& outHigh) {
+	outLow = glm::vec3(FLT_MAX);
+	outHigh = glm::vec3(-FLT_MAX);
+	for (int i = 0; i < 8; i++) {
+		glm::vec3 corner(i & 1 ? high.x : low.x, i & 2 ? high.y : low.y, i & 4 ? high.z : low.z);
+		glm::vec3 p = glm::vec3(transform * glm::vec4(corner, 1.0f));
+		outLow = glm::min(outLow, p);
+		outHigh = glm::max(outHigh, p);
+	}
+}
+
+void BVH::build(std::vector<Item> items) {
+	clear();
+	this->items = move(items);
+	if (this->items.empty()) return;
+
+	nodes.reserve(this->items.size() * 2);
+	nodes.emplace_back();
+	// median splits keep depth near log2(items / 4), so this can't be reached by any real layout
+	int depth = buildNode(0, 0, (int) this->items.size());
+	assert(depth < STACK_SIZE, "BVH too deep for traversal stack");
+}
+
+void BVH::clear() {
+	nodes.clear();
+	items.clear();
+}
+
+int BVH::buildNode(int index, int begin, int end) {
+	glm::vec3 low(FLT_MAX);
+	glm::vec3 high(-FLT_MAX);
+	for (int i = begin; i < end; i++) {
+		low = glm::min(low, items[i].low);
+		high = glm::max(high, items[i].high);
+	}
+	nodes[index].low = low;
+	nodes[index].high = high;
+
+	const int LEAF_SIZE = 4;
+	if (end - begin <= LEAF_SIZE) {
+		nodes[index].first = begin;
+		nodes[index].count = end - begin;
+		return 1;
+	}
+
+	// split at median centroid along longest axis
+	glm::vec3 extent = high - low;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	int mid = (begin + end) / 2;
+	std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end, [axis](const Item& a, const Item& b) {
+		return a.low[axis] + a.high[axis] < b.low[axis] + b.high[axis];
+	});
+
+	// allocate both children before building either, so the right child is always first + 1
+	int left = (int) nodes.size();
+	nodes.resize(left + 2);
+	nodes[index].first = left;
+	nodes[index].count = 0;
+	int leftDepth = buildNode(left, begin, mid);
+	int rightDepth = buildNode(left + 1, mid, end);
+	return std::max(leftDepth, rightDepth) + 1;
+}
+
+int BVH::raycast(const Ray& ray, const std::function<bool(int id, float& t)>& test, float* distance) {
+	if (nodes.empty()) return -1;
+
+	int bestId = -1;
+	float bestT = FLT_MAX;
+
+	int stack[STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize) {
+		const Node& node = nodes[stack[--stackSize]];
+		float t;
+		if (!rayIntersectAabb(ray, node.low, node.high, t) || t > bestT) continue;
+
+		if (node.count) {
+			for (int i = node.first; i < node.first + node.count; i++) {
+				const Item& item = items[i];
+				if (!rayIntersectAabb(ray, item.low, item.high, t) || t > bestT) continue;
+				if (test(item.id, t) && t < bestT) {
+					bestT = t;
+					bestId = item.id;
+				}
+			}
+		} else {
+			stack[stackSize++] = node.first + 1;
+			stack[stackSize++] = node.first;
+		}
+	}
+
+	if (distance) *distance = bestT;
+	return bestId;
+}
+
+void BVH::collect(const Ray& ray, std::vector<int>& ids) {
+	if (nodes.empty()) return;
+
+	int stack[STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize) {
+		const Node& node = nodes[stack[--stackSize]];
+		float t;
+		if (!rayIntersectAabb(ray, node.low, node.high, t)) continue;
+
+		if (node.count) {
+			for (int i = node.first; i < node.first + node.count; i++) {
+				const Item& item = items[i];
+				if (rayIntersectAabb(ray, item.low, item.high, t)) ids.push_back(item.id);
+			}
+		} else {
+			stack[stackSize++] = node.first + 1;
+			stack[stackSize++] = node.first;
+		}
+	}
+}
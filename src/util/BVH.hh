@@ -0,0 +1,60 @@
+// Bounding volume hierarchy over axis aligned boxes, used for ray picking
+
+#pragma once
+#include "common.hh"
+#include <bigg.hpp>
+#include <functional>
+
+struct Ray {
+	glm::vec3 origin;
+	glm::vec3 dir;
+};
+
+// test ray against box, t is set to the entry distance (zero if the origin is inside)
+bool rayIntersectAabb(const Ray& ray, const glm::vec3& low, const glm::vec3& high, float& t);
+
+// test ray against triangle (both windings), t is set to the hit distance
+bool rayIntersectTriangle(const Ray& ray, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, float& t);
+
+// transform ray by matrix; distances along the result are the same as along the original ray
+Ray transformRay(const glm::mat4& transform, const Ray& ray);
+
+// get the box containing a transformed box
+void transformAabb(const glm::mat4& transform, const glm::vec3& low, const glm::vec3& high,
+				   glm::vec3& outLow, glm::vec3& outHigh);
+
+class BVH {
+public:
+	struct Item {
+		glm::vec3 low;
+		glm::vec3 high;
+		int id;
+	};
+private:
+	struct Node {
+		glm::vec3 low;
+		glm::vec3 high;
+		int first; // left child node (right is first + 1), or first item if leaf
+		int count; // item count if leaf, 0 otherwise
+	};
+	std::vector<Node> nodes;
+	std::vector<Item> items;
+
+	// traversal keeps one pending sibling per level, so the stack needs depth + 1 entries
+	static const int STACK_SIZE = 64;
+
+	/// fill in node from items begin to end, appending its children, returns depth of the subtree
+	int buildNode(int index, int begin, int end);
+public:
+	void build(std::vector<Item> items);
+	void clear();
+	bool empty() { return nodes.empty(); }
+
+	/// cast ray, calling test for each item whose box is hit nearer than the best exact hit so far
+	/// test should return true and set t if the item is actually hit
+	/// returns id of nearest item hit, or -1 if none
+	int raycast(const Ray& ray, const std::function<bool(int id, float& t)>& test, float* distance = nullptr);
+
+	/// append ids of all items whose box is hit by ray
+	void collect(const Ray& ray, std::vector<int>& ids);
+};
@@ -0,0 +1,132 @@
+// BigEndian.hh: Convert records between the gamecube's big endian file layout and native byte order
+// A record is described once as a list of its multi-byte fields, from which both per-record swap code
+// and a bulk converter for whole tables are generated
+
+#pragma once
+#include "common.hh"
+#include <string.h>
+#include <stddef.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BIGENDIAN_SSE2
+#include <emmintrin.h>
+#endif
+
+inline u16 byteSwap16(u16 v) { return (u16) (v << 8 | v >> 8); }
+inline u32 byteSwap32(u32 v) {
+#if defined(__GNUC__)
+	return __builtin_bswap32(v);
+#else
+	return v << 24 | (v & 0xff00) << 8 | (v >> 8 & 0xff00) | v >> 24;
+#endif
+}
+inline u64 byteSwap64(u64 v) { return (u64) byteSwap32((u32) v) << 32 | byteSwap32((u32) (v >> 32)); }
+
+/// swap the byte order of the size byte value at p
+template<size_t Size> struct ByteSwapper;
+template<> struct ByteSwapper<1> { static void swap(u8*) {} };
+template<> struct ByteSwapper<2> {
+	static void swap(u8* p) { u16 v; memcpy(&v, p, 2); v = byteSwap16(v); memcpy(p, &v, 2); }
+};
+template<> struct ByteSwapper<4> {
+	static void swap(u8* p) { u32 v; memcpy(&v, p, 4); v = byteSwap32(v); memcpy(p, &v, 4); }
+};
+template<> struct ByteSwapper<8> {
+	static void swap(u8* p) { u64 v; memcpy(&v, p, 8); v = byteSwap64(v); memcpy(p, &v, 8); }
+};
+
+/// field of a big endian record, use through BE_FIELD
+template<typename T, size_t Offset>
+struct BEField {
+	static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8, "unsupported field size");
+	static const size_t offset = Offset;
+	static const size_t size = sizeof(T);
+	static void swap(u8* record) { ByteSwapper<sizeof(T)>::swap(record + Offset); }
+};
+#define BE_FIELD(Record, member) BEField<decltype(Record::member), offsetof(Record, member)>
+
+/// record made of big endian Fields, fields left out (padding, single bytes) are kept as they are
+template<typename Record, typename... Fields>
+struct BERecord {
+	/// swap fields of one record in place, works in both directions
+	static void swap(Record& record) {
+		u8* p = (u8*) &record;
+		int expand[] = {0, (Fields::swap(p), 0)...};
+		(void) expand;
+	}
+
+	/// swap fields of count records in place
+	static void swapArray(Record* records, size_t count) {
+#ifdef BIGENDIAN_SSE2
+		auto& masks = getMasks();
+		if (masks.usable) {
+			swapArraySSE2(masks, (u8*) records, count);
+			return;
+		}
+#endif
+		for (size_t i = 0; i < count; i++) swap(records[i]);
+	}
+
+private:
+#ifdef BIGENDIAN_SSE2
+	static const size_t LANES = sizeof(Record) / 16;
+
+	// per byte of the record, which swapped copy of its 16 byte lane it's taken from
+	struct Masks {
+		bool usable = false;
+		__m128i swap16[LANES ? LANES : 1], swap32[LANES ? LANES : 1], swap64[LANES ? LANES : 1];
+		__m128i keep[LANES ? LANES : 1];
+	};
+
+	static const Masks& getMasks() {
+		static const Masks masks = buildMasks();
+		return masks;
+	}
+
+	static Masks buildMasks() {
+		Masks masks;
+		// fields must not cross lanes and be aligned to their size, so swapping inside a lane swaps the field
+		size_t offsets[] = {Fields::offset...};
+		size_t sizes[] = {Fields::size...};
+		if (sizeof(Record) % 16) return masks;
+		u8 width[sizeof(Record)] = {};
+		for (size_t i = 0; i < sizeof...(Fields); i++) {
+			if (offsets[i] % sizes[i]) return masks;
+			for (size_t j = 0; j < sizes[i]; j++) width[offsets[i] + j] = (u8) sizes[i];
+		}
+		for (size_t lane = 0; lane < LANES; lane++) {
+			u8 m16[16], m32[16], m64[16], keep[16];
+			for (int j = 0; j < 16; j++) {
+				u8 w = width[lane * 16 + j];
+				m16[j] = w == 2 ? 0xff : 0;
+				m32[j] = w == 4 ? 0xff : 0;
+				m64[j] = w == 8 ? 0xff : 0;
+				keep[j] = w < 2 ? 0xff : 0;
+			}
+			masks.swap16[lane] = _mm_loadu_si128((const __m128i*) m16);
+			masks.swap32[lane] = _mm_loadu_si128((const __m128i*) m32);
+			masks.swap64[lane] = _mm_loadu_si128((const __m128i*) m64);
+			masks.keep[lane] = _mm_loadu_si128((const __m128i*) keep);
+		}
+		masks.usable = true;
+		return masks;
+	}
+
+	// swap every 16, 32 and 64 bit unit of each lane, then pick the right one for each byte
+	static void swapArraySSE2(const Masks& masks, u8* p, size_t count) {
+		for (size_t i = 0; i < count; i++) {
+			for (size_t lane = 0; lane < LANES; lane++, p += 16) {
+				__m128i v = _mm_loadu_si128((const __m128i*) p);
+				__m128i s16 = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+				__m128i s32 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xb1), 0xb1);
+				__m128i s64 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0x1b), 0x1b);
+				__m128i r = _mm_and_si128(v, masks.keep[lane]);
+				r = _mm_or_si128(r, _mm_and_si128(s16, masks.swap16[lane]));
+				r = _mm_or_si128(r, _mm_and_si128(s32, masks.swap32[lane]));
+				r = _mm_or_si128(r, _mm_and_si128(s64, masks.swap64[lane]));
+				_mm_storeu_si128((__m128i*) p, r);
+			}
+		}
+	}
+#endif
+};
@@ -0,0 +1,137 @@
+// ByteReader.hh: Inline reading and writing of binary data in memory
+// Reads are range checked and return zero past the end, setting a flag instead of failing;
+// unchecked variants are for loops that checked the whole range they use up front
+
+#pragma once
+#include "common.hh"
+#include "util/BigEndian.hh"
+#include <string.h>
+#include <stdlib.h>
+
+class ByteReader {
+	const u8* data;
+	size_t len;
+	size_t pos = 0;
+	bool overrun = false;
+public:
+	ByteReader(const void* data, size_t len) : data((const u8*) data), len(len) {}
+
+	size_t size() const { return len; }
+	size_t tell() const { return pos; }
+	size_t remaining() const { return pos < len ? len - pos : 0; }
+	/// true if no read went past the end
+	bool ok() const { return !overrun; }
+	/// true if n more bytes can be read
+	bool has(size_t n) const { return n <= remaining(); }
+	/// pointer to the current position
+	const u8* ptr() const { return data + pos; }
+
+	void seek(size_t offset) { pos = offset; }
+	void skip(size_t n) { pos += n; }
+
+	template<typename T> T readUnchecked() {
+		T value;
+		memcpy(&value, data + pos, sizeof(T));
+		pos += sizeof(T);
+		return value;
+	}
+	template<typename T> T readBEUnchecked() {
+		T value = readUnchecked<T>();
+		ByteSwapper<sizeof(T)>::swap((u8*) &value);
+		return value;
+	}
+	u8 readU8Unchecked() { return data[pos++]; }
+
+	template<typename T> T read() {
+		if (!has(sizeof(T))) return fail<T>();
+		return readUnchecked<T>();
+	}
+	template<typename T> T readBE() {
+		if (!has(sizeof(T))) return fail<T>();
+		return readBEUnchecked<T>();
+	}
+	u8 readU8() {
+		if (pos >= len) return fail<u8>();
+		return data[pos++];
+	}
+
+	/// copy n bytes to out, or zero out and return false if there aren't enough
+	bool read(void* out, size_t n) {
+		if (!has(n)) {
+			memset(out, 0, n);
+			fail<u8>();
+			return false;
+		}
+		memcpy(out, data + pos, n);
+		pos += n;
+		return true;
+	}
+
+private:
+	template<typename T> T fail() {
+		overrun = true;
+		pos = len;
+		T value;
+		memset(&value, 0, sizeof(T));
+		return value;
+	}
+};
+
+class ByteWriter {
+	u8* data = nullptr; // allocated with malloc, so it can be handed to Buffer
+	size_t len = 0;
+	size_t capacity = 0;
+
+	void grow(size_t needed) {
+		size_t newCapacity = capacity ? capacity : 256;
+		while (newCapacity < needed) newCapacity *= 2;
+		data = (u8*) realloc(data, newCapacity);
+		capacity = newCapacity;
+	}
+public:
+	ByteWriter(size_t reserveSize = 0) { if (reserveSize) grow(reserveSize); }
+	~ByteWriter() { free(data); }
+	ByteWriter(const ByteWriter&) = delete;
+	ByteWriter& operator=(const ByteWriter&) = delete;
+
+	size_t size() const { return len; }
+	u8* ptr() { return data; }
+
+	/// make room for n more bytes, so the next n bytes of writes don't reallocate
+	void reserve(size_t n) { if (len + n > capacity) grow(len + n); }
+
+	void writeU8(u8 value) {
+		reserve(1);
+		data[len++] = value;
+	}
+	void write(const void* p, size_t n) {
+		reserve(n);
+		memcpy(data + len, p, n);
+		len += n;
+	}
+	template<typename T> void write(T value) { write(&value, sizeof(T)); }
+	template<typename T> void writeBE(T value) {
+		ByteSwapper<sizeof(T)>::swap((u8*) &value);
+		write(&value, sizeof(T));
+	}
+
+	/// append n bytes copied from distance bytes back, byte by byte so the ranges may overlap
+	/// returns false if distance reaches before the start
+	bool copyBack(size_t distance, size_t n) {
+		if (!distance || distance > len) return false;
+		reserve(n);
+		u8* out = data + len;
+		const u8* in = out - distance;
+		for (size_t i = 0; i < n; i++) out[i] = in[i];
+		len += n;
+		return true;
+	}
+
+	/// give up ownership of the written data, free it with free()
+	u8* release() {
+		u8* result = data;
+		data = nullptr;
+		len = capacity = 0;
+		return result;
+	}
+};
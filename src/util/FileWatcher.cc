@@ -0,0 +1,69 @@
+#include "util/FileWatcher.hh"
+
+#ifdef PLATFORM_LINUX
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// how often to stat the file when inotify isn't available
+static const int POLL_INTERVAL_MS = 500;
+
+FileWatcher::FileWatcher(const FSPath& path) : path(path) {
+	lastModified = FSPath(path.str).lastModifiedTime();
+	nextPoll = std::chrono::steady_clock::now();
+
+#ifdef PLATFORM_LINUX
+	// watch the directory rather than the file, editors often save by replacing the file
+	std::string dir = ".";
+	auto separator = path.str.rfind(PATH_SEPARATOR);
+	if (separator != std::string::npos) dir = path.str.substr(0, separator + 1);
+
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd >= 0 && inotify_add_watch(inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+		close(inotifyFd);
+		inotifyFd = -1;
+	}
+	if (inotifyFd < 0) log_warn("inotify unavailable for %s, polling it instead", path.str.c_str());
+#endif
+}
+
+FileWatcher::~FileWatcher() {
+#ifdef PLATFORM_LINUX
+	if (inotifyFd >= 0) close(inotifyFd);
+#endif
+}
+
+bool FileWatcher::pollModifiedTime() {
+	auto now = std::chrono::steady_clock::now();
+	if (now < nextPoll) return false;
+	nextPoll = now + std::chrono::milliseconds(POLL_INTERVAL_MS);
+
+	// fresh FSPath, since it caches the result of stat
+	u64 modified = FSPath(path.str).lastModifiedTime();
+	if (modified == lastModified) return false;
+	lastModified = modified;
+	return true;
+}
+
+bool FileWatcher::poll() {
+#ifdef PLATFORM_LINUX
+	if (inotifyFd >= 0) {
+		// FSPath::fileName expects a separator, which relative paths like "ObjectList.ini" don't have
+		auto separator = path.str.rfind(PATH_SEPARATOR);
+		const char* name = path.str.c_str() + (separator == std::string::npos ? 0 : separator + 1);
+		bool changed = false;
+		alignas(struct inotify_event) char buffer[4096];
+		while (true) {
+			ssize_t len = read(inotifyFd, buffer, sizeof(buffer));
+			if (len <= 0) break; // EAGAIN once all events are read
+			for (char* p = buffer; p < buffer + len; ) {
+				auto event = (struct inotify_event*) p;
+				if (event->len && !strcmp(event->name, name)) changed = true;
+				p += sizeof(struct inotify_event) + event->len;
+			}
+		}
+		return changed;
+	}
+#endif
+	return pollModifiedTime();
+}
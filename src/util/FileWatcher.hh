@@ -0,0 +1,28 @@
+// FileWatcher.hh: Notice when a file on the user's filesystem is written
+// Uses inotify on linux, and polls the file's modification time elsewhere
+
+#pragma once
+#include "common.hh"
+#include "util/fspath.hh"
+#include <chrono>
+
+class FileWatcher {
+	FSPath path;
+	u64 lastModified;
+	std::chrono::steady_clock::time_point nextPoll;
+#ifdef PLATFORM_LINUX
+	int inotifyFd = -1;
+#endif
+
+	bool pollModifiedTime();
+public:
+	/// start watching path, changes made before this are ignored
+	FileWatcher(const FSPath& path);
+	~FileWatcher();
+
+	FileWatcher(const FileWatcher&) = delete;
+	FileWatcher& operator=(const FileWatcher&) = delete;
+
+	/// returns true if the file was written since the last call, cheap enough to call every frame
+	bool poll();
+};
@@ -1,5 +1,9 @@
 #include "ObjectList.hh"
 #include "util/fspath.hh"
+#include "util/config.hh"
+#include "util/FileWatcher.hh"
+#include <chrono>
+#include <unordered_map>
 
 static void advanceToNextLine(char** p) {
 	while (**p && **p != '\n') (*p)++; // advance to next newline or eof
@@ -17,16 +21,12 @@ void ObjectList::readFile(const char* file) {
 
 	// read file to buffer
 	Buffer tmp = path.read();
-	// todo: add a 'transfer' method to Buffer class to move ownership of memory from one to another
-	// (NOTE: also do something about the null terminator)
-	data.setStretchy(true);
 	data.resize(tmp.size()+1);
-	data.setStretchy(false);
-	tmp.read(data.base_ptr(), tmp.size());
-	*((u8*) data.base_ptr() + tmp.size()) = 0; // null terminate copy
+	tmp.read(&data[0], tmp.size());
+	data[tmp.size()] = 0; // null terminate copy
 
 	// pointer for parsing through text
-	char* p = (char*) data.base_ptr();
+	char* p = &data[0];
 
 	// store current object's data
 	ObjectTypeData* current = nullptr;
@@ -44,11 +44,7 @@ void ObjectList::readFile(const char* file) {
 				typeID = hexCharValue(*(p+5)) * 0x10 + hexCharValue(*(p+6));
 			}
 
-			db.emplace_back();
-			current = &db.back();
-
-			current->listID = (u8) listID;
-			current->typeID = (u8) typeID;
+			current = addObjectData((u8) listID, (u8) typeID);
 
 			advanceToNextLine(&p);
 		} else if (*p == '#') {
@@ -57,12 +53,15 @@ void ObjectList::readFile(const char* file) {
 			char* type = p + 7;
 			advanceToNextLine(&p);
 			char* block_begin = p;
-			while (strncmp(p, "RCEnd", 5)) advanceToNextLine(&p);
+			while (*p && strncmp(p, "RCEnd", 5)) advanceToNextLine(&p);
+			if (!*p) logger.error("Missing RCEnd in %s", file);
 			char* block_end = p;
 			advanceToNextLine(&p);
 			*block_end = 0;
 
-			if (!strncmp(type, "Draw", 4)) {
+			if (!current) {
+				logger.warn("Block outside of object definition in %s", file);
+			} else if (!strncmp(type, "Draw", 4)) {
 				current->blockDraw = block_begin;
 			} else {
 				logger.warn("Unsupported block property in %s: 'RCBegin%s'", file, type);
@@ -105,6 +104,8 @@ void ObjectList::readFile(const char* file) {
 			advanceToNextLine(&p);
 		}
 	}
+
+	for (auto& object : db) object.buildProperties();
 }
 
 void ObjectList::writeFile(const char* file) {
@@ -125,12 +126,398 @@ void ObjectList::writeFile(const char* file) {
 	fclose(f);
 }
 
-ObjectList::ObjectTypeData* ObjectList::getObjectData(u8 listID, u8 typeID) {
-	for (int i = 0; i < db.size(); i++) {
-		auto object = &db[i];
-		if (object->listID == listID && object->typeID == typeID) return object;
+const u16 ObjectList::NO_OBJECT;
+
+ObjectList* ObjectList::shared() {
+	// initialised once, even if stages are opened from several threads
+	static ObjectList* instance = [] {
+		auto list = new ObjectList();
+		list->load("ObjectList.ini");
+		return list;
+	}();
+	return instance;
+}
+
+// compiled database is kept next to its source, ObjectList.ini -> ObjectList.bin
+static std::string binaryPath(const std::string& source) {
+	std::string path = source;
+	auto dot = path.rfind('.');
+	if (dot != std::string::npos) path.resize(dot);
+	return path + ".bin";
+}
+
+ObjectList::~ObjectList() {
+	delete watcher;
+}
+
+void ObjectList::clear() {
+	db.clear();
+	std::fill(lookup.begin(), lookup.end(), NO_OBJECT);
+}
+
+void ObjectList::load(const char* file) {
+	auto start = std::chrono::steady_clock::now();
+	sourceFile = file;
+	delete watcher;
+	watcher = new FileWatcher(FSPath(file));
+
+	std::string binFile = binaryPath(sourceFile);
+	bool useBinary = config_geti("objectlist_binary_cache", 1) != 0;
+	u64 sourceTime = FSPath(file).lastModifiedTime();
+	if (useBinary && readBinary(binFile.c_str(), sourceTime)) {
+		log_info("Read %s in %.1f ms", binFile.c_str(),
+				 std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		return;
 	}
-	return nullptr;
+
+	readFile(file);
+	if (useBinary && !writeBinary(binFile.c_str(), sourceTime)) log_warn("Couldn't write %s", binFile.c_str());
+	log_info("Read %s in %.1f ms", file,
+			 std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+static bool sameString(const char* a, const char* b) {
+	if (!a || !b) return a == b;
+	return !strcmp(a, b);
+}
+
+bool ObjectList::pollReload(std::vector<int>& changedTypes) {
+	changedTypes.clear();
+	if (!watcher || !watcher->poll()) return false;
+
+	// parse into a separate list first, so a half-saved file doesn't wipe out the loaded types
+	ObjectList next;
+	next.readFile(sourceFile.c_str());
+	if (next.db.empty()) {
+		log_warn("%s has no object types, not reloading it", sourceFile.c_str());
+		return false;
+	}
+
+	for (int type = 0; type < 0x10000; type++) {
+		auto before = getObjectData(u8(type >> 8), u8(type & 0xff));
+		auto after = next.getObjectData(u8(type >> 8), u8(type & 0xff));
+		if (!before && !after) continue;
+		if (!before || !after || !sameString(before->blockDraw, after->blockDraw) ||
+			!sameString(before->miscFormat, after->miscFormat) ||
+			!sameString(before->miscProperties, after->miscProperties)) {
+			changedTypes.push_back(type);
+		}
+	}
+
+	// install the list that was checked and diffed, type data keeps pointing into the swapped text
+	db.swap(next.db);
+	lookup.swap(next.lookup);
+	data.swap(next.data);
+	if (config_geti("objectlist_binary_cache", 1)) {
+		writeBinary(binaryPath(sourceFile).c_str(), FSPath(sourceFile).lastModifiedTime());
+	}
+	log_info("Reloaded %s, %d object types changed", sourceFile.c_str(), (int) changedTypes.size());
+	return true;
+}
+
+// ObjectList.bin layout: header, types, properties, then a pool of null terminated strings
+static const u32 BINARY_MAGIC = 0x4c4f4352; // "RCOL"
+static const u32 BINARY_VERSION = 1;
+static const u32 NO_STRING = 0xffffffff;
+
+struct BinaryHeader {
+	u32 magic;
+	u32 version;
+	u64 sourceTime;
+	u32 typeCount;
+	u32 propertyCount;
+	u32 poolSize;
+	u32 unused;
+};
+
+struct BinaryType {
+	u32 name, debugName, description, rotation, miscFormat, miscProperties, blockDraw; // pool offsets
+	u32 firstProperty;
+	u16 propertyCount;
+	u8 listID;
+	u8 typeID;
+};
+
+struct BinaryProperty {
+	u32 nameHash;
+	u32 name; // pool offset
+	u8 offset;
+	u8 type;
+	char format;
+	u8 bigEndian;
+};
+
+bool ObjectList::writeBinary(const char* file, u64 sourceTime) {
+	std::string pool;
+	std::unordered_map<std::string, u32> pooled;
+	auto poolString = [&](const char* str) -> u32 {
+		if (!str) return NO_STRING;
+		auto it = pooled.find(str);
+		if (it != pooled.end()) return it->second;
+		u32 offset = (u32) pool.size();
+		pool.append(str);
+		pool.push_back(0);
+		pooled[str] = offset;
+		return offset;
+	};
+
+	std::vector<BinaryType> types;
+	std::vector<BinaryProperty> properties;
+	for (auto& object : db) {
+		BinaryType type;
+		type.name = poolString(object.name);
+		type.debugName = poolString(object.debugName);
+		type.description = poolString(object.description);
+		type.rotation = poolString(object.rotation);
+		type.miscFormat = poolString(object.miscFormat);
+		type.miscProperties = poolString(object.miscProperties);
+		type.blockDraw = poolString(object.blockDraw);
+		type.firstProperty = (u32) properties.size();
+		type.propertyCount = (u16) object.properties.size();
+		type.listID = object.listID;
+		type.typeID = object.typeID;
+		types.push_back(type);
+
+		for (auto& property : object.properties) {
+			BinaryProperty out;
+			out.nameHash = property.nameHash;
+			out.name = poolString(property.name.c_str());
+			out.offset = property.offset;
+			out.type = property.type;
+			out.format = property.format;
+			out.bigEndian = property.bigEndian;
+			properties.push_back(out);
+		}
+	}
+
+	BinaryHeader header = {};
+	header.magic = BINARY_MAGIC;
+	header.version = BINARY_VERSION;
+	header.sourceTime = sourceTime;
+	header.typeCount = (u32) types.size();
+	header.propertyCount = (u32) properties.size();
+	header.poolSize = (u32) pool.size();
+
+	Buffer b((u32) (sizeof(header) + types.size() * sizeof(BinaryType) +
+					properties.size() * sizeof(BinaryProperty) + pool.size()), true);
+	b.write(header);
+	if (!types.empty()) b.write(types.data(), (u32) (types.size() * sizeof(BinaryType)));
+	if (!properties.empty()) b.write(properties.data(), (u32) (properties.size() * sizeof(BinaryProperty)));
+	b.write(pool.data(), (u32) pool.size());
+	return FSPath(file).write(b);
+}
+
+bool ObjectList::readBinary(const char* file, u64 sourceTime) {
+	FSPath path(file);
+	if (!path.exists()) return false;
+	Buffer tmp = path.read();
+
+	BinaryHeader header;
+	if (tmp.size() < sizeof(header)) return false;
+	tmp.read(&header);
+	if (header.magic != BINARY_MAGIC || header.version != BINARY_VERSION) return false;
+	if (header.sourceTime != sourceTime) return false;
+	u64 expectedSize = sizeof(header) + (u64) header.typeCount * sizeof(BinaryType) +
+					   (u64) header.propertyCount * sizeof(BinaryProperty) + header.poolSize;
+	if (tmp.size() != expectedSize || header.typeCount >= NO_OBJECT) return false;
+
+	std::vector<BinaryType> types(header.typeCount);
+	std::vector<BinaryProperty> properties(header.propertyCount);
+	if (!types.empty()) tmp.read(types.data(), (u32) (types.size() * sizeof(BinaryType)));
+	if (!properties.empty()) tmp.read(properties.data(), (u32) (properties.size() * sizeof(BinaryProperty)));
+	for (auto& type : types) {
+		if (type.firstProperty + (u64) type.propertyCount > properties.size()) return false;
+	}
+
+	// the string pool becomes the backing data all names point into
+	data.resize(header.poolSize + 1);
+	tmp.read(&data[0], header.poolSize);
+	const char* pool = &data[0];
+	data[header.poolSize] = 0;
+	auto poolString = [&](u32 offset) -> const char* {
+		return offset < header.poolSize ? pool + offset : nullptr;
+	};
+
+	clear();
+	db.reserve(types.size());
+	for (auto& type : types) {
+		auto object = addObjectData(type.listID, type.typeID);
+		object->name = poolString(type.name);
+		object->debugName = poolString(type.debugName);
+		object->description = poolString(type.description);
+		object->rotation = poolString(type.rotation);
+		object->miscFormat = poolString(type.miscFormat);
+		object->miscProperties = poolString(type.miscProperties);
+		object->blockDraw = poolString(type.blockDraw);
+
+		object->properties.resize(type.propertyCount);
+		for (int i = 0; i < type.propertyCount; i++) {
+			auto& in = properties[type.firstProperty + i];
+			auto& property = object->properties[i];
+			const char* name = poolString(in.name);
+			property.nameHash = in.nameHash;
+			property.name = name ? name : "";
+			property.offset = in.offset;
+			property.type = in.type < PROPERTY_INVALID ? (PropertyType) in.type : PROPERTY_INVALID;
+			property.format = in.format;
+			property.bigEndian = in.bigEndian != 0;
+		}
+	}
+	return true;
+}
+
+ObjectList::ObjectTypeData* ObjectList::addObjectData(u8 listID, u8 typeID) {
+	u16& index = lookup[listID << 8 | typeID];
+	// first definition of a type wins lookups, as it did with the linear search
+	if (index == NO_OBJECT) index = (u16) db.size();
+
+	db.emplace_back();
+	ObjectTypeData* object = &db.back();
+	object->listID = listID;
+	object->typeID = typeID;
+	return object;
+}
+
+static u32 hashName(const char* name, size_t len) {
+	// FNV-1a
+	u32 hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (u8) name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int align(int i, int alignment) {
+	while (i % alignment) i++;
+	return i;
+}
+
+void ObjectList::ObjectTypeData::buildProperties() {
+	properties.clear();
+	if (!miscFormat) return;
+
+	const char* names = miscProperties ? miscProperties : "";
+	int misc_offs = 0;
+	for (const char* f = miscFormat; *f; f++) {
+		Property property;
+		property.format = *f;
+		property.bigEndian = true; // misc data is stored as the gamecube version has it
+
+		int size;
+		switch (*f) {
+			case 'c':
+			case 'C': {
+				property.type = PROPERTY_U8;
+				size = 1;
+			} break;
+			case 's':
+			case 'S': {
+				property.type = PROPERTY_U16;
+				size = 2;
+			} break;
+			case 'x':
+			case 'X':
+			case 'i':
+			case 'I': {
+				property.type = PROPERTY_U32;
+				size = 4;
+			} break;
+			case 'f':
+			case 'F': {
+				property.type = PROPERTY_FLOAT;
+				size = 4;
+			} break;
+			default: {
+				log_error("Invalid format option %c in [%02x][%02x]", *f, listID, typeID);
+				property.type = PROPERTY_INVALID;
+				size = 4;
+			}
+		}
+		misc_offs = align(misc_offs, size);
+		if (misc_offs + size > 32) {
+			log_error("MiscFormat %s of [%02x][%02x] doesn't fit in misc data", miscFormat, listID, typeID);
+			break;
+		}
+		property.offset = (u8) misc_offs;
+		misc_offs += size;
+
+		// names are separated by ';'
+		size_t len = 0;
+		while (names[len] && names[len] != ';') len++;
+		property.name.assign(names, len);
+		property.nameHash = hashName(names, len);
+		names += len;
+		if (*names) names++;
+
+		properties.push_back(property);
+	}
+}
+
+int ObjectList::ObjectTypeData::findProperty(const char* name) const {
+	size_t len = strlen(name);
+	u32 hash = hashName(name, len);
+	for (int i = 0; i < properties.size(); i++) {
+		if (properties[i].nameHash == hash && properties[i].name == name) return i;
+	}
+	return -1;
+}
+
+static u32 loadProperty(const ObjectList::Property& property, const u8* misc) {
+	const u8* p = misc + property.offset;
+	if (property.type == ObjectList::PROPERTY_U8) return p[0];
+	if (property.type == ObjectList::PROPERTY_U16) {
+		return property.bigEndian ? (u32) (p[0] << 8 | p[1]) : (u32) (p[1] << 8 | p[0]);
+	}
+	if (property.bigEndian) return (u32) p[0] << 24 | (u32) p[1] << 16 | (u32) p[2] << 8 | p[3];
+	return (u32) p[3] << 24 | (u32) p[2] << 16 | (u32) p[1] << 8 | p[0];
+}
+
+static void storeProperty(const ObjectList::Property& property, u8* misc, u32 value) {
+	u8* p = misc + property.offset;
+	int size = property.type == ObjectList::PROPERTY_U8 ? 1 : (property.type == ObjectList::PROPERTY_U16 ? 2 : 4);
+	for (int i = 0; i < size; i++) {
+		int shift = property.bigEndian ? (size - 1 - i) * 8 : i * 8;
+		p[i] = (u8) (value >> shift);
+	}
+}
+
+bool ObjectList::ObjectTypeData::readProperty(int index, const u8* misc, double& value) const {
+	auto& property = properties[index];
+	switch (property.type) {
+		case PROPERTY_U8:
+		case PROPERTY_U16:
+		case PROPERTY_U32: {
+			value = loadProperty(property, misc);
+		} break;
+		case PROPERTY_FLOAT: {
+			u32 bits = loadProperty(property, misc);
+			float f;
+			memcpy(&f, &bits, sizeof(f));
+			value = f;
+		} break;
+		default: return false;
+	}
+	return true;
+}
+
+bool ObjectList::ObjectTypeData::writeProperty(int index, u8* misc, double value) const {
+	auto& property = properties[index];
+	switch (property.type) {
+		case PROPERTY_U8:
+		case PROPERTY_U16:
+		case PROPERTY_U32: {
+			storeProperty(property, misc, (u32) (i64) value);
+		} break;
+		case PROPERTY_FLOAT: {
+			float f = (float) value;
+			u32 bits;
+			memcpy(&bits, &f, sizeof(bits));
+			storeProperty(property, misc, bits);
+		} break;
+		default: return false;
+	}
+	return true;
 }
 
 static const char* getString(Buffer& b) {
@@ -176,12 +563,7 @@ void ObjectList::readEXE(const char* file) {
 		exe.read(&loader);
 
 		ObjectTypeData* typedata = getObjectData(loader.listID, loader.typeID);
-		if (!typedata) {
-			db.emplace_back();
-			typedata = &db.back();
-			typedata->listID = loader.listID;
-			typedata->typeID = loader.typeID;
-		}
+		if (!typedata) typedata = addObjectData(loader.listID, loader.typeID);
 
 		exe.seek(loader.debugName - ADDR_OFFS);
 		typedata->debugName = getString(exe);
@@ -217,6 +599,7 @@ void ObjectList::readEXE(const char* file) {
 			typedata->miscProperties = "";
 		}
 
+		typedata->buildProperties();
 		offset += 4;
 	}
 }
@@ -3,8 +3,28 @@
 #pragma once
 #include "common.hh"
 
+class FileWatcher;
+
 class ObjectList {
 public:
+	enum PropertyType : u8 {
+		PROPERTY_U8,
+		PROPERTY_U16,
+		PROPERTY_U32,
+		PROPERTY_FLOAT,
+		PROPERTY_INVALID // unknown format character
+	};
+
+	/// layout of one misc property, compiled from miscFormat/miscProperties on load
+	struct Property {
+		u32 nameHash;
+		std::string name;
+		u8 offset; // into instance misc data
+		PropertyType type;
+		char format; // character from miscFormat
+		bool bigEndian;
+	};
+
 	struct ObjectTypeData {
 		u8 typeID = 0;
 		u8 listID = 0;
@@ -15,17 +35,60 @@ public:
 		const char* miscFormat = nullptr;
 		const char* miscProperties = nullptr;
 		const char* blockDraw = nullptr;
+
+		std::vector<Property> properties;
+
+		/// build properties from miscFormat and miscProperties
+		void buildProperties();
+		/// get index of named property, or -1 if not found
+		int findProperty(const char* name) const;
+		/// read property from an object's misc data, returns false if its format is invalid
+		bool readProperty(int index, const u8* misc, double& value) const;
+		/// write property to an object's misc data, returns false if its format is invalid
+		bool writeProperty(int index, u8* misc, double value) const;
 	};
 
-	Buffer data;
+	// text every name and script points into, a vector so a reloaded list can be swapped in whole
+	std::vector<char> data;
 private:
 	std::vector<ObjectTypeData> db;
+
+	// index into db for each (listID << 8 | typeID), NO_OBJECT if undefined
+	static const u16 NO_OBJECT = 0xffff;
+	std::vector<u16> lookup;
+
+	// file given to load(), watched for changes
+	std::string sourceFile;
+	FileWatcher* watcher = nullptr;
+
+	ObjectTypeData* addObjectData(u8 listID, u8 typeID);
+	void clear();
 public:
-	ObjectList() : data(0) {}
+	ObjectList() : lookup(0x10000, NO_OBJECT) {}
+	~ObjectList();
+
+	/// process-wide object database, loaded from ObjectList.ini on first use
+	static ObjectList* shared();
+
+	/// read an .ini file, through its compiled .bin next to it when that is up to date
+	void load(const char* file);
+	/// reload the file given to load() if it was written since the last call
+	/// fills changedTypes with (listID << 8 | typeID) of each type whose draw block or misc layout changed
+	/// returns false if nothing was reloaded, type data pointers stay valid in that case only
+	bool pollReload(std::vector<int>& changedTypes);
 
 	void readFile(const char* file);
 	void writeFile(const char* file);
 	void readEXE(const char* file);
 
-	ObjectTypeData* getObjectData(u8 listID, u8 typeID);
+	/// write compiled database, tagged with the modification time of the file it was read from
+	bool writeBinary(const char* file, u64 sourceTime);
+	/// read compiled database, returns false if missing, invalid, or compiled from another version of the source
+	bool readBinary(const char* file, u64 sourceTime);
+
+	/// get object type definition, or nullptr if not defined
+	ObjectTypeData* getObjectData(u8 listID, u8 typeID) {
+		u16 index = lookup[listID << 8 | typeID];
+		return index == NO_OBJECT ? nullptr : &db[index];
+	}
 };
@@ -0,0 +1,192 @@
+// Range fit encoder: endpoints are taken from the inset bounding box of each block's colors,
+// then every pixel picks the nearest of the interpolated palette entries
+
+#include "bcencode.hh"
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BCENCODE_SSE2
+#include <emmintrin.h>
+#endif
+
+u32 bcEncodedSize(u32 width, u32 height, bool alpha) {
+	return ((width + 3) / 4) * ((height + 3) / 4) * (alpha ? 16 : 8);
+}
+
+// load a 4x4 block of BGRA8 pixels, clamping to the image edge
+static void loadBlock(const u8* bgra, u32 width, u32 height, u32 bx, u32 by, u8 block[64]) {
+	for (u32 y = 0; y < 4; y++) {
+		u32 sy = by + y < height ? by + y : height - 1;
+		const u8* row = bgra + sy * width * 4;
+		if (bx + 4 <= width) {
+			memcpy(block + y * 16, row + bx * 4, 16);
+		} else {
+			for (u32 x = 0; x < 4; x++) {
+				u32 sx = bx + x < width ? bx + x : width - 1;
+				memcpy(block + y * 16 + x * 4, row + sx * 4, 4);
+			}
+		}
+	}
+}
+
+// per channel minimum and maximum of the block (b, g, r, a)
+static void blockBounds(const u8 block[64], u8 low[4], u8 high[4]) {
+#ifdef BCENCODE_SSE2
+	__m128i r0 = _mm_loadu_si128((const __m128i*) block);
+	__m128i r1 = _mm_loadu_si128((const __m128i*) (block + 16));
+	__m128i r2 = _mm_loadu_si128((const __m128i*) (block + 32));
+	__m128i r3 = _mm_loadu_si128((const __m128i*) (block + 48));
+	__m128i mn = _mm_min_epu8(_mm_min_epu8(r0, r1), _mm_min_epu8(r2, r3));
+	__m128i mx = _mm_max_epu8(_mm_max_epu8(r0, r1), _mm_max_epu8(r2, r3));
+	// reduce the four pixels in each register down to one
+	mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 8));
+	mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 8));
+	mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 4));
+	mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 4));
+	u32 lowBits = (u32) _mm_cvtsi128_si32(mn);
+	u32 highBits = (u32) _mm_cvtsi128_si32(mx);
+	memcpy(low, &lowBits, 4);
+	memcpy(high, &highBits, 4);
+#else
+	for (int c = 0; c < 4; c++) {
+		low[c] = 255;
+		high[c] = 0;
+	}
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < 4; c++) {
+			u8 v = block[i * 4 + c];
+			if (v < low[c]) low[c] = v;
+			if (v > high[c]) high[c] = v;
+		}
+	}
+#endif
+}
+
+static inline u16 pack565(int b, int g, int r) {
+	return (u16) (((r * 31 + 127) / 255) << 11 | ((g * 63 + 127) / 255) << 5 | ((b * 31 + 127) / 255));
+}
+
+static inline void unpack565(u16 c, int out[3]) {
+	int b = c & 0x1f, g = (c >> 5) & 0x3f, r = c >> 11;
+	out[0] = (b << 3) | (b >> 2);
+	out[1] = (g << 2) | (g >> 4);
+	out[2] = (r << 3) | (r >> 2);
+}
+
+// encode color part of block (always four color mode), returns squared error
+static u64 encodeColor(const u8 block[64], const u8 low[4], const u8 high[4], u8* out) {
+	// inset bounding box slightly, which lowers error for typical blocks
+	int minC[3], maxC[3];
+	for (int c = 0; c < 3; c++) {
+		int inset = (high[c] - low[c]) >> 4;
+		minC[c] = low[c] + inset;
+		maxC[c] = high[c] - inset;
+	}
+
+	u16 c0 = pack565(maxC[0], maxC[1], maxC[2]);
+	u16 c1 = pack565(minC[0], minC[1], minC[2]);
+	if (c0 < c1) {
+		u16 t = c0; c0 = c1; c1 = t;
+	}
+
+	int palette[4][3];
+	unpack565(c0, palette[0]);
+	unpack565(c1, palette[1]);
+	for (int c = 0; c < 3; c++) {
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+
+	u32 indices = 0;
+	u64 error = 0;
+	if (c0 != c1) {
+		for (int i = 0; i < 16; i++) {
+			const u8* p = block + i * 4;
+			int best = 0, bestDist = 0x7fffffff;
+			for (int j = 0; j < 4; j++) {
+				int db = p[0] - palette[j][0], dg = p[1] - palette[j][1], dr = p[2] - palette[j][2];
+				int dist = db * db + dg * dg + dr * dr;
+				if (dist < bestDist) {
+					bestDist = dist;
+					best = j;
+				}
+			}
+			indices |= (u32) best << (i * 2);
+			error += bestDist;
+		}
+	} else {
+		// solid block, equal endpoints select three color mode so every index must be 0
+		for (int i = 0; i < 16; i++) {
+			const u8* p = block + i * 4;
+			int db = p[0] - palette[0][0], dg = p[1] - palette[0][1], dr = p[2] - palette[0][2];
+			error += db * db + dg * dg + dr * dr;
+		}
+	}
+
+	out[0] = (u8) c0; out[1] = (u8) (c0 >> 8);
+	out[2] = (u8) c1; out[3] = (u8) (c1 >> 8);
+	memcpy(out + 4, &indices, 4);
+	return error;
+}
+
+// encode BC3 alpha part of block (eight alpha mode), returns squared error
+static u64 encodeAlpha(const u8 block[64], u8 low, u8 high, u8* out) {
+	int palette[8];
+	palette[0] = high;
+	palette[1] = low;
+	for (int j = 1; j < 7; j++) {
+		palette[j + 1] = ((7 - j) * high + j * low) / 7;
+	}
+
+	u64 indices = 0;
+	u64 error = 0;
+	for (int i = 0; i < 16; i++) {
+		int a = block[i * 4 + 3];
+		int best = 0, bestDist = 0x7fffffff;
+		if (high != low) {
+			for (int j = 0; j < 8; j++) {
+				int d = a - palette[j];
+				if (d * d < bestDist) {
+					bestDist = d * d;
+					best = j;
+				}
+			}
+		} else {
+			bestDist = (a - high) * (a - high);
+		}
+		indices |= (u64) best << (i * 3);
+		error += bestDist;
+	}
+
+	out[0] = high;
+	out[1] = low;
+	for (int i = 0; i < 6; i++) {
+		out[2 + i] = (u8) (indices >> (i * 8));
+	}
+	return error;
+}
+
+u64 bcEncode(const u8* bgra, u32 width, u32 height, bool alpha, u8* out) {
+	u64 error = 0;
+	u8 block[64];
+	u8 low[4], high[4];
+	for (u32 by = 0; by < height; by += 4) {
+		for (u32 bx = 0; bx < width; bx += 4) {
+			loadBlock(bgra, width, height, bx, by, block);
+			blockBounds(block, low, high);
+			if (alpha) {
+				error += encodeAlpha(block, low[3], high[3], out);
+				out += 8;
+			} else {
+				// opaque images are expected, but count alpha error so the measurement stays honest
+				for (int i = 0; i < 16; i++) {
+					int d = 255 - block[i * 4 + 3];
+					error += d * d;
+				}
+			}
+			error += encodeColor(block, low, high, out);
+			out += 8;
+		}
+	}
+	return error;
+}
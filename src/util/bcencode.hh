@@ -0,0 +1,13 @@
+// Fast block compression of BGRA8 images to BC1/BC3
+
+#pragma once
+
+#include "common.hh"
+
+/// size in bytes of width x height image once block compressed (8 bytes per block for BC1, 16 for BC3)
+u32 bcEncodedSize(u32 width, u32 height, bool alpha);
+
+/// encode BGRA8 image as BC1 (alpha = false) or BC3 (alpha = true)
+/// partial blocks at the right and bottom edges repeat the last row and column
+/// returns summed squared error over all channels, for quality measurement
+u64 bcEncode(const u8* bgra, u32 width, u32 height, bool alpha, u8* out);
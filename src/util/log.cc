@@ -3,10 +3,12 @@
 
 #include <string>
 #include <vector>
+#include <mutex>
 #include "stdarg.h"
 #include "stdio.h"
 
 static std::vector<std::string> logMessageRecord;
+static std::mutex logMutex; // messages can come from worker threads
 
 void log_message(const char* prefix, const char* func, const char* format, ...) {
 	va_list args;
@@ -15,6 +17,7 @@ void log_message(const char* prefix, const char* func, const char* format, ...)
 	buffer[0] = '\0';
 	size_t offset = (size_t) snprintf(buffer, 512, "%s%s: ", prefix, func);
 	vsnprintf(&buffer[offset], 512 - offset, format, args);
+	std::lock_guard<std::mutex> lock(logMutex);
 	puts(buffer);
 	logMessageRecord.emplace_back(buffer);
 	va_end(args);
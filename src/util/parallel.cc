@@ -0,0 +1,26 @@
+#include "parallel.hh"
+#include <atomic>
+#include <thread>
+
+void parallel_for(int count, const std::function<void(int i)>& fn) {
+	int threadCount = (int) std::thread::hardware_concurrency();
+	if (threadCount < 1) threadCount = 1;
+	if (threadCount > count) threadCount = count;
+
+	if (threadCount <= 1) {
+		for (int i = 0; i < count; i++) fn(i);
+		return;
+	}
+
+	// each thread takes the next index until none are left, so uneven work balances out
+	std::atomic<int> next(0);
+	auto worker = [&]() {
+		int i;
+		while ((i = next++) < count) fn(i);
+	};
+
+	std::vector<std::thread> threads;
+	for (int t = 1; t < threadCount; t++) threads.emplace_back(worker);
+	worker();
+	for (auto& thread : threads) thread.join();
+}
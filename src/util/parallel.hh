@@ -0,0 +1,10 @@
+// Run independent loop iterations across worker threads
+
+#pragma once
+
+#include "common.hh"
+#include <functional>
+
+/// call fn(i) for every i in [0, count) using up to one thread per core, returns once all calls are done
+/// fn must be safe to call concurrently for different i
+void parallel_for(int count, const std::function<void(int i)>& fn);
@@ -17,11 +17,13 @@
 //       derived from this software without specific prior written permission.
 
 #include "common.hh"
+#include "util/prs.hh"
+#include "util/ByteReader.hh"
 
-static u32 getControlBit(u32* bitPos, u8* currentByte, Buffer& in) {
+static u32 getControlBit(u32* bitPos, u8* currentByte, ByteReader& in) {
 	*bitPos -= 1;
 	if (*bitPos == 0) {
-		in.read(currentByte);
+		*currentByte = in.readU8();
 		*bitPos = 8;
 	}
 
@@ -30,36 +32,30 @@ static u32 getControlBit(u32* bitPos, u8* currentByte, Buffer& in) {
 	return flag;
 }
 
-Buffer prs_decode(void* compressed, u32 len) {
-	Buffer in(compressed, len, false);
-	Buffer out(len);
-	out.setStretchy(true);
+Buffer prs_decode(const void* compressed, u32 len) {
+	ByteReader in(compressed, len);
+	ByteWriter out(len);
 
 	u32 bitPos = 9;
 	u8 currentByte;
 	u32 lookBehindOffset, lookBehindLength;
-	u8 byte;
 
-	in.read(&currentByte);
-	while (true) {
+	currentByte = in.readU8();
+	while (in.ok()) {
 		if (getControlBit(&bitPos, &currentByte, in)) {
-			in.read(&byte);
-			out.write(byte);
+			out.writeU8(in.readU8());
 			continue;
 		}
 		if (getControlBit(&bitPos, &currentByte, in)) {
-			in.read(&byte);
-			lookBehindOffset = byte;
-			in.read(&byte);
-			lookBehindOffset |= byte << 8;
+			lookBehindOffset = in.readU8();
+			lookBehindOffset |= in.readU8() << 8;
 			if (!lookBehindOffset) break;
 
 			lookBehindLength = lookBehindOffset & 7;
 			lookBehindOffset = (lookBehindOffset >> 3) | -0x2000;
 
 			if (lookBehindLength == 0) {
-				in.read(&byte);
-				lookBehindLength = byte + 1;
+				lookBehindLength = in.readU8() + 1;
 			} else {
 				lookBehindLength += 2;
 			}
@@ -67,20 +63,19 @@ Buffer prs_decode(void* compressed, u32 len) {
 			lookBehindLength = 0;
 			lookBehindLength = (lookBehindLength << 1) | getControlBit(&bitPos, &currentByte, in);
 			lookBehindLength = (lookBehindLength << 1) | getControlBit(&bitPos, &currentByte, in);
-			in.read(&byte);
-			lookBehindOffset = byte | -0x100;
+			lookBehindOffset = in.readU8() | -0x100;
 			lookBehindLength += 2;
 		}
 
-		for (int i = 0; i < lookBehindLength; i++) {
-			u32 writePosition = out.tell();
-			out.seek(writePosition + lookBehindOffset);
-			out.read(&byte);
-			out.seek(writePosition);
-			out.write(byte);
+		// offset is negative, copy from that far back in the output
+		if (!out.copyBack(-lookBehindOffset, lookBehindLength)) {
+			log_error("Invalid back reference in PRS data");
+			break;
 		}
 	}
+	if (!in.ok()) log_error("Unexpected end of PRS data");
 
-	out.setStretchy(false);
-	return std::move(out);
+	u32 size = (u32) out.size();
+	if (!size) return Buffer(0);
+	return Buffer(out.release(), size, true);
 }
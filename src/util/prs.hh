@@ -4,4 +4,4 @@
 
 #include "common.hh"
 
-Buffer prs_decode(void* compressed, u32 len);
+Buffer prs_decode(const void* compressed, u32 len);
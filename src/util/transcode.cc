@@ -0,0 +1,137 @@
+#include "transcode.hh"
+#include "texture.hh"
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TRANSCODE_SSE2
+#include <emmintrin.h>
+#endif
+
+// raster format is stored in bits 8-11 of a texture's format, alongside palette and mip flags
+static const u32 RASTER_FORMAT_MASK = 0x0f00;
+
+int transcodeInputSize(u32 rasterFormat) {
+	switch (rasterFormat & RASTER_FORMAT_MASK) {
+		case rw::TextureRasterFormat::RASTER_C1555:
+		case rw::TextureRasterFormat::RASTER_C565:
+		case rw::TextureRasterFormat::RASTER_C4444:
+		case rw::TextureRasterFormat::RASTER_C555:
+			return 2;
+		case rw::TextureRasterFormat::RASTER_LUM8:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// expand n bit channel to 8 bits by replicating high bits into the low bits
+static inline u32 expand5(u32 x) { return (x << 3) | (x >> 2); }
+static inline u32 expand6(u32 x) { return (x << 2) | (x >> 4); }
+static inline u32 expand4(u32 x) { return (x << 4) | x; }
+
+static inline u32 packBGRA(u32 b, u32 g, u32 r, u32 a) {
+	return b | (g << 8) | (r << 16) | (a << 24);
+}
+
+// scalar conversion of a single pixel, used for tails and when SSE2 is unavailable
+static u32 convertPixel(u32 format, const u8* in) {
+	// luminance is one byte per pixel, in[1] may be past the end of the mip
+	if (format == rw::TextureRasterFormat::RASTER_LUM8) return packBGRA(in[0], in[0], in[0], 0xff);
+
+	u32 p = in[0] | (in[1] << 8);
+	switch (format) {
+		case rw::TextureRasterFormat::RASTER_C1555:
+			return packBGRA(expand5(p & 0x1f), expand5((p >> 5) & 0x1f), expand5((p >> 10) & 0x1f), (p >> 15) ? 0xff : 0);
+		case rw::TextureRasterFormat::RASTER_C555:
+			return packBGRA(expand5(p & 0x1f), expand5((p >> 5) & 0x1f), expand5((p >> 10) & 0x1f), 0xff);
+		case rw::TextureRasterFormat::RASTER_C565:
+			return packBGRA(expand5(p & 0x1f), expand6((p >> 5) & 0x3f), expand5(p >> 11), 0xff);
+		case rw::TextureRasterFormat::RASTER_C4444:
+			return packBGRA(expand4(p & 0xf), expand4((p >> 4) & 0xf), expand4((p >> 8) & 0xf), expand4(p >> 12));
+		default:
+			return 0;
+	}
+}
+
+#ifdef TRANSCODE_SSE2
+// interleave 8 pixels worth of 16 bit channel lanes (values 0-255) into BGRA8
+static inline void storeBGRA(u8* out, __m128i b, __m128i g, __m128i r, __m128i a) {
+	__m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+	__m128i ra = _mm_or_si128(r, _mm_slli_epi16(a, 8));
+	_mm_storeu_si128((__m128i*) out, _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i*) (out + 16), _mm_unpackhi_epi16(bg, ra));
+}
+
+static inline __m128i expand5(__m128i x) { return _mm_or_si128(_mm_slli_epi16(x, 3), _mm_srli_epi16(x, 2)); }
+static inline __m128i expand6(__m128i x) { return _mm_or_si128(_mm_slli_epi16(x, 2), _mm_srli_epi16(x, 4)); }
+static inline __m128i expand4(__m128i x) { return _mm_or_si128(_mm_slli_epi16(x, 4), x); }
+
+// converts count / 8 * 8 pixels, returns number converted
+static u32 convertSSE2(u32 format, const u8* in, u8* out, u32 count) {
+	const __m128i mask4 = _mm_set1_epi16(0x0f);
+	const __m128i mask5 = _mm_set1_epi16(0x1f);
+	const __m128i mask6 = _mm_set1_epi16(0x3f);
+	const __m128i opaque = _mm_set1_epi16(0xff);
+	const __m128i zero = _mm_setzero_si128();
+
+	u32 i = 0;
+	switch (format) {
+		case rw::TextureRasterFormat::RASTER_C1555:
+		case rw::TextureRasterFormat::RASTER_C555:
+			for (; i + 8 <= count; i += 8) {
+				__m128i p = _mm_loadu_si128((const __m128i*) (in + i * 2));
+				__m128i b = expand5(_mm_and_si128(p, mask5));
+				__m128i g = expand5(_mm_and_si128(_mm_srli_epi16(p, 5), mask5));
+				__m128i r = expand5(_mm_and_si128(_mm_srli_epi16(p, 10), mask5));
+				// alpha bit to 0 or 0xff
+				__m128i a = format == rw::TextureRasterFormat::RASTER_C555 ? opaque
+							: _mm_and_si128(_mm_sub_epi16(zero, _mm_srli_epi16(p, 15)), opaque);
+				storeBGRA(out + i * 4, b, g, r, a);
+			}
+			break;
+		case rw::TextureRasterFormat::RASTER_C565:
+			for (; i + 8 <= count; i += 8) {
+				__m128i p = _mm_loadu_si128((const __m128i*) (in + i * 2));
+				__m128i b = expand5(_mm_and_si128(p, mask5));
+				__m128i g = expand6(_mm_and_si128(_mm_srli_epi16(p, 5), mask6));
+				__m128i r = expand5(_mm_srli_epi16(p, 11));
+				storeBGRA(out + i * 4, b, g, r, opaque);
+			}
+			break;
+		case rw::TextureRasterFormat::RASTER_C4444:
+			for (; i + 8 <= count; i += 8) {
+				__m128i p = _mm_loadu_si128((const __m128i*) (in + i * 2));
+				__m128i b = expand4(_mm_and_si128(p, mask4));
+				__m128i g = expand4(_mm_and_si128(_mm_srli_epi16(p, 4), mask4));
+				__m128i r = expand4(_mm_and_si128(_mm_srli_epi16(p, 8), mask4));
+				__m128i a = expand4(_mm_srli_epi16(p, 12));
+				storeBGRA(out + i * 4, b, g, r, a);
+			}
+			break;
+		case rw::TextureRasterFormat::RASTER_LUM8:
+			for (; i + 8 <= count; i += 8) {
+				__m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (in + i)), zero);
+				storeBGRA(out + i * 4, l, l, l, opaque);
+			}
+			break;
+		default:
+			break;
+	}
+	return i;
+}
+#endif
+
+void transcodeToBGRA8(u32 rasterFormat, const u8* in, u8* out, u32 count) {
+	const u32 format = rasterFormat & RASTER_FORMAT_MASK;
+	const int inSize = transcodeInputSize(format);
+	if (!inSize) return;
+
+	u32 i = 0;
+#ifdef TRANSCODE_SSE2
+	i = convertSSE2(format, in, out, count);
+#endif
+	for (; i < count; i++) {
+		u32 pixel = convertPixel(format, in + i * inSize);
+		memcpy(out + i * 4, &pixel, 4);
+	}
+}
@@ -0,0 +1,12 @@
+// Convert RenderWare raster formats that bgfx can't sample directly to BGRA8
+
+#pragma once
+
+#include "common.hh"
+
+/// rasterFormat is a texture's rw::TextureRasterFormat flags
+/// returns bytes per pixel of input if rasterFormat can be converted by transcodeToBGRA8, otherwise 0
+int transcodeInputSize(u32 rasterFormat);
+
+/// convert count pixels from rasterFormat to BGRA8 (out must have space for count * 4 bytes)
+void transcodeToBGRA8(u32 rasterFormat, const u8* in, u8* out, u32 count);
@@ -0,0 +1,106 @@
+// Four vertices are interleaved per step: three position, one color and two uv registers
+// are shuffled into the six registers of output, with missing attributes as constants
+
+#include "vertexpack.hh"
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VERTEXPACK_SSE2
+#include <emmintrin.h>
+#endif
+
+static const u32 WHITE = 0xffffffff;
+
+// one vertex, colors are bytes so the result is the same on any host
+template<bool HasColors, bool HasUVs>
+static inline void packVertex(u8* out, const float* position, const u8* color, const float* uv) {
+	u32 abgr = WHITE;
+	if (HasColors) abgr = (u32) color[3] << 24 | (u32) color[2] << 16 | (u32) color[1] << 8 | color[0];
+	float texcoord[2] = {0.0f, 0.0f};
+	if (HasUVs) memcpy(texcoord, uv, 8);
+	memcpy(out, position, 12);
+	memcpy(out + 12, &abgr, 4);
+	memcpy(out + 16, texcoord, 8);
+}
+
+template<bool HasColors, bool HasUVs>
+static void packVerticesImpl(u8* out, u32 count, const float* positions, const u8* colors, const float* uvs) {
+	u32 i = 0;
+#ifdef VERTEXPACK_SSE2
+	// x86 is little endian, so rgba bytes loaded as u32 are already abgr
+	__m128 c = _mm_castsi128_ps(_mm_set1_epi32((int) WHITE));
+	__m128 t0 = _mm_setzero_ps(), t1 = _mm_setzero_ps();
+	for (; i + 4 <= count; i += 4, out += 4 * PACKED_VERTEX_SIZE) {
+		const float* p = positions + i * 3;
+		__m128 p0 = _mm_loadu_ps(p); // x0 y0 z0 x1
+		__m128 p1 = _mm_loadu_ps(p + 4); // y1 z1 x2 y2
+		__m128 p2 = _mm_loadu_ps(p + 8); // z2 x3 y3 z3
+		if (HasColors) c = _mm_loadu_ps((const float*) (colors + i * 4)); // c0 c1 c2 c3
+		if (HasUVs) {
+			t0 = _mm_loadu_ps(uvs + i * 2); // u0 v0 u1 v1
+			t1 = _mm_loadu_ps(uvs + i * 2 + 4); // u2 v2 u3 v3
+		}
+
+		__m128 zc0 = _mm_shuffle_ps(p0, c, _MM_SHUFFLE(0, 0, 2, 2)); // z0 z0 c0 c0
+		__m128 xy1 = _mm_shuffle_ps(p0, p1, _MM_SHUFFLE(0, 0, 3, 3)); // x1 x1 y1 y1
+		__m128 zc1 = _mm_shuffle_ps(p1, c, _MM_SHUFFLE(1, 1, 1, 1)); // z1 z1 c1 c1
+		__m128 zc2 = _mm_shuffle_ps(p2, c, _MM_SHUFFLE(2, 2, 0, 0)); // z2 z2 c2 c2
+		__m128 zc3 = _mm_shuffle_ps(p2, c, _MM_SHUFFLE(3, 3, 3, 3)); // z3 z3 c3 c3
+
+		float* o = (float*) out;
+		_mm_storeu_ps(o, _mm_shuffle_ps(p0, zc0, _MM_SHUFFLE(2, 0, 1, 0))); // x0 y0 z0 c0
+		_mm_storeu_ps(o + 4, _mm_shuffle_ps(t0, xy1, _MM_SHUFFLE(2, 0, 1, 0))); // u0 v0 x1 y1
+		_mm_storeu_ps(o + 8, _mm_shuffle_ps(zc1, t0, _MM_SHUFFLE(3, 2, 2, 0))); // z1 c1 u1 v1
+		_mm_storeu_ps(o + 12, _mm_shuffle_ps(p1, zc2, _MM_SHUFFLE(2, 0, 3, 2))); // x2 y2 z2 c2
+		_mm_storeu_ps(o + 16, _mm_shuffle_ps(t1, p2, _MM_SHUFFLE(2, 1, 1, 0))); // u2 v2 x3 y3
+		_mm_storeu_ps(o + 20, _mm_shuffle_ps(zc3, t1, _MM_SHUFFLE(3, 2, 2, 0))); // z3 c3 u3 v3
+	}
+#endif
+	for (; i < count; i++, out += PACKED_VERTEX_SIZE) {
+		packVertex<HasColors, HasUVs>(out, positions + i * 3, colors + i * 4, uvs + i * 2);
+	}
+}
+
+void packVertices(void* out, u32 count, const float* positions, const u8* colors, const float* uvs) {
+	u8* o = (u8*) out;
+	if (colors && uvs) packVerticesImpl<true, true>(o, count, positions, colors, uvs);
+	else if (colors) packVerticesImpl<true, false>(o, count, positions, colors, uvs);
+	else if (uvs) packVerticesImpl<false, true>(o, count, positions, colors, uvs);
+	else packVerticesImpl<false, false>(o, count, positions, colors, uvs);
+}
+
+u32 narrowIndices(u16* out, const u32* indices, u32 count, u32 vertexCount) {
+	u32 i = 0;
+	u32 invalid = 0;
+#ifdef VERTEXPACK_SSE2
+	// no unsigned compare or pack in SSE2, so both are done on values biased into signed range
+	const __m128i bias32 = _mm_set1_epi32((int) 0x80000000);
+	const __m128i limit = _mm_xor_si128(_mm_set1_epi32((int) vertexCount), bias32);
+	const __m128i bias16 = _mm_set1_epi32(0x8000);
+	const __m128i unbias16 = _mm_set1_epi16((short) 0x8000);
+	__m128i bad = _mm_setzero_si128();
+	for (; i + 8 <= count; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i*) (indices + i));
+		__m128i b = _mm_loadu_si128((const __m128i*) (indices + i + 4));
+		// index >= vertexCount, as not (index < vertexCount)
+		bad = _mm_or_si128(bad, _mm_cmpeq_epi32(_mm_cmplt_epi32(_mm_xor_si128(a, bias32), limit), _mm_setzero_si128()));
+		bad = _mm_or_si128(bad, _mm_cmpeq_epi32(_mm_cmplt_epi32(_mm_xor_si128(b, bias32), limit), _mm_setzero_si128()));
+		__m128i packed = _mm_packs_epi32(_mm_sub_epi32(a, bias16), _mm_sub_epi32(b, bias16));
+		_mm_storeu_si128((__m128i*) (out + i), _mm_add_epi16(packed, unbias16));
+	}
+	if (_mm_movemask_epi8(bad)) {
+		// only counted when something is wrong, which valid files never hit
+		for (u32 j = 0; j < i; j++) {
+			if (indices[j] >= vertexCount) {
+				out[j] = (u16) indices[j];
+				invalid++;
+			}
+		}
+	}
+#endif
+	for (; i < count; i++) {
+		if (indices[i] >= vertexCount) invalid++;
+		out[i] = (u16) indices[i];
+	}
+	return invalid;
+}
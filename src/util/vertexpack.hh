@@ -0,0 +1,16 @@
+// Interleave separate vertex attribute arrays into vertex buffer layout, and narrow index lists
+
+#pragma once
+
+#include "common.hh"
+
+/// size of a packed vertex: float x, y, z; u32 abgr color; float u, v (BSPVertex and DFFVertex)
+static const u32 PACKED_VERTEX_SIZE = 24;
+
+/// write count packed vertices to out from xyz positions, rgba byte colors and uv pairs
+/// colors and uvs may be null, giving opaque white and zero texture coordinates
+void packVertices(void* out, u32 count, const float* positions, const u8* colors, const float* uvs);
+
+/// narrow count indices to 16 bits
+/// returns how many are not below vertexCount, those are written truncated as before
+u32 narrowIndices(u16* out, const u32* indices, u32 count, u32 vertexCount);
@@ -0,0 +1,71 @@
+// Check BVH ray casts and collection against testing every box, over random boxes and rays
+
+#include "util/BVH.hh"
+#include <float.h>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+
+static float randomFloat(float low, float high) {
+	return low + (high - low) * (rand() / (float) RAND_MAX);
+}
+
+int main() {
+	srand(1234);
+	int failures = 0;
+
+	for (int round = 0; round < 20; round++) {
+		// a few hundred boxes, enough for several levels of interior nodes
+		std::vector<BVH::Item> items(100 + rand() % 400);
+		for (size_t i = 0; i < items.size(); i++) {
+			glm::vec3 center(randomFloat(-1000, 1000), randomFloat(-1000, 1000), randomFloat(-1000, 1000));
+			glm::vec3 size(randomFloat(1, 50), randomFloat(1, 50), randomFloat(1, 50));
+			items[i].low = center - size;
+			items[i].high = center + size;
+			items[i].id = (int) i;
+		}
+		BVH bvh;
+		bvh.build(items);
+
+		for (int r = 0; r < 200; r++) {
+			// aim at a random box so most rays hit something
+			const auto& target = items[rand() % items.size()];
+			Ray ray;
+			ray.origin = glm::vec3(randomFloat(-2000, 2000), randomFloat(-2000, 2000), randomFloat(-2000, 2000));
+			ray.dir = (target.low + target.high) * 0.5f - ray.origin;
+
+			// nearest box hit and all boxes hit, testing every item
+			int expected = -1;
+			float expectedT = FLT_MAX;
+			std::vector<int> expectedIds;
+			for (auto& item : items) {
+				float t;
+				if (!rayIntersectAabb(ray, item.low, item.high, t)) continue;
+				expectedIds.push_back(item.id);
+				if (t < expectedT) {
+					expectedT = t;
+					expected = item.id;
+				}
+			}
+
+			float t;
+			int hit = bvh.raycast(ray, [](int id, float& t) { return true; }, &t);
+			if (hit != expected && !(hit >= 0 && t == expectedT)) {
+				printf("round %d ray %d: raycast hit %d, expected %d\n", round, r, hit, expected);
+				failures++;
+			}
+
+			std::vector<int> ids;
+			bvh.collect(ray, ids);
+			std::sort(ids.begin(), ids.end());
+			if (ids != expectedIds) {
+				printf("round %d ray %d: collect found %d boxes, expected %d\n", round, r, (int) ids.size(),
+					   (int) expectedIds.size());
+				failures++;
+			}
+		}
+	}
+
+	printf("%s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}